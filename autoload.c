@@ -1004,6 +1004,33 @@ static val glob_instantiate(void)
   return nil;
 }
 
+static val async_set_entries(val fun)
+{
+  val sname[] = {
+    lit("async-task"),
+    nil
+  };
+  val name[] = {
+    lit("async"), lit("await"), lit("await-io"), lit("async-run"),
+    lit("async-get-line"), lit("async-fill-buf"), lit("async-put-buf"),
+    lit("async-put-string"), lit("async-put-line"), lit("async-sock-accept"),
+    nil
+  };
+  val slname[] = {
+    lit("done"), nil
+  };
+  autoload_set(al_struct, sname, fun);
+  autoload_set(al_fun, name, fun);
+  autoload_set(al_slot, slname, fun);
+  return nil;
+}
+
+static val async_instantiate(void)
+{
+  load(scat2(stdlib_path, lit("async")));
+  return nil;
+}
+
 
 val autoload_reg(val (*instantiate)(void),
                  val (*set_entries)(val))
@@ -1076,6 +1103,7 @@ void autoload_init(void)
   autoload_reg(load_args_instantiate, load_args_set_entries);
   autoload_reg(csort_instantiate, csort_set_entries);
   autoload_reg(glob_instantiate, glob_set_entries);
+  autoload_reg(async_instantiate, async_set_entries);
 
   reg_fun(intern(lit("autoload-try-fun"), system_package), func_n1(autoload_try_fun));
 }
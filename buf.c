@@ -49,6 +49,7 @@
 #include "utf8.h"
 #include "txr.h"
 #include "buf.h"
+#include "ffi.h"
 
 static cnum buf_check_len(val len, val self)
 {
@@ -153,9 +154,14 @@ static struct buf *buf_handle(val buf, val ctx)
 val copy_buf(val buf)
 {
   struct buf *b = buf_handle(buf, lit("copy-buf"));
-  return if3(b->size,
-             make_duplicate_buf(b->len, b->data),
-             make_borrowed_buf(b->len, b->data));
+
+  if (is_num(b->size)) {
+    return make_duplicate_buf(b->len, b->data);
+  } else {
+    val copy = make_borrowed_buf(b->len, b->data);
+    copy->b.size = b->size;
+    return copy;
+  }
 }
 
 static void buf_shrink(struct buf *b)
@@ -177,7 +183,7 @@ val buf_trim(val buf)
   val self = lit("buf-trim");
   struct buf *b = buf_handle(buf, self);
   val oldsize = b->size;
-  if (!oldsize)
+  if (!is_num(oldsize))
     uw_throwf(error_s, lit("~a: ~s is a fixed buffer"),
               self, buf, nao);
   buf_shrink(b);
@@ -189,12 +195,14 @@ static val buf_do_set_len(val buf, struct buf *b, val newlen,
 {
   val oldlen = b->len;
   cnum olen = c_num(oldlen, self), len = c_num(newlen, self);
-  cnum oldsize = c_num(b->size, self), size = oldsize;
+  cnum oldsize, size;
   cnum iv = c_u8(default_arg(init_val, zero), self);
 
-  if (!b->size)
+  if (!is_num(b->size))
     uw_throwf(error_s, lit("~a: ~s is a fixed buffer"),
               self, buf, nao);
+
+  oldsize = size = c_num(b->size, self);
   (void) buf_check_len(newlen, self);
 
   b->len = newlen;
@@ -231,7 +239,7 @@ val buf_free(val buf)
 {
   val self = lit("buf-free");
   struct buf *b = buf_handle(buf, self);
-  if (b->size) {
+  if (is_num(b->size)) {
     free(b->data);
     b->data = 0;
     b->len = b->size = zero;
@@ -251,7 +259,7 @@ val buf_alloc_size(val buf)
 {
   val self = lit("buf-alloc-size");
   struct buf *b = buf_handle(buf, self);
-  return b->size;
+  return if2(is_num(b->size), b->size);
 }
 
 mem_t *buf_get(val buf, val self)
@@ -260,11 +268,9 @@ mem_t *buf_get(val buf, val self)
   return b->data;
 }
 
-val sub_buf(val buf, val from, val to)
+static void buf_range(val len, val *pfrom, val *pto)
 {
-  val self = lit("sub-buf");
-  struct buf *b = buf_handle(buf, lit("sub"));
-  val len = b->len;
+  val from = *pfrom, to = *pto;
 
   if (null_or_missing_p(from))
     from = zero;
@@ -281,8 +287,17 @@ val sub_buf(val buf, val from, val to)
   else if (minusp(to))
     to = plus(to, len);
 
-  from = max2(zero, min2(from, len));
-  to = max2(zero, min2(to, len));
+  *pfrom = max2(zero, min2(from, len));
+  *pto = max2(zero, min2(to, len));
+}
+
+val sub_buf(val buf, val from, val to)
+{
+  val self = lit("sub-buf");
+  struct buf *b = buf_handle(buf, lit("sub"));
+  val len = b->len;
+
+  buf_range(len, &from, &to);
 
   if (ge(from, to)) {
     return make_buf(zero, nil, zero);
@@ -293,6 +308,53 @@ val sub_buf(val buf, val from, val to)
   }
 }
 
+val buf_slice(val obj, val from, val to)
+{
+  val self = lit("buf-slice");
+  val parent = obj, offs = zero, len, slice;
+  mem_t *data;
+
+  if (carrayp(obj)) {
+    cnum nbytes;
+    data = carray_bytes(obj, &nbytes, self);
+    len = num(nbytes);
+  } else {
+    struct buf *b = buf_handle(obj, self);
+
+    data = b->data;
+    len = b->len;
+
+    /* A slice of a slice refers directly to the original object. */
+    if (consp(b->size)) {
+      parent = car(b->size);
+      offs = cdr(b->size);
+    }
+  }
+
+  buf_range(len, &from, &to);
+
+  if (lt(to, from))
+    to = from;
+
+  slice = make_borrowed_buf(minus(to, from), data + c_num(from, self));
+  set(mkloc(slice->b.size, slice), cons(parent, plus(offs, from)));
+  return slice;
+}
+
+val buf_slice_parent(val buf)
+{
+  val self = lit("buf-slice-parent");
+  struct buf *b = buf_handle(buf, self);
+  return if2(consp(b->size), car(b->size));
+}
+
+val buf_slice_offset(val buf)
+{
+  val self = lit("buf-slice-offset");
+  struct buf *b = buf_handle(buf, self);
+  return if2(consp(b->size), cdr(b->size));
+}
+
 val replace_buf(val buf, val items, val from, val to)
 {
   val self = lit("replace");
@@ -985,8 +1047,12 @@ static int buf_strm_get_byte_callback(mem_t *ctx)
   struct buf_strm *s = coerce(struct buf_strm *, ctx);
   struct buf *b = buf_handle(s->buf, self);
   cnum p = buf_check_index(b, s->pos, self);
+
+  if (p >= c_num(b->len, self))
+    return EOF;
+
   s->pos = num(p + 1);
-  return (p >= c_num(b->len, self)) ? EOF : b->data[p];
+  return b->data[p];
 }
 
 static val buf_strm_get_char(val stream)
@@ -1376,6 +1442,9 @@ void buf_init(void)
   reg_fun(intern(lit("buf-alloc-size"), user_package), func_n1(buf_alloc_size));
   reg_fun(intern(lit("copy-buf"), user_package), func_n1(copy_buf));
   reg_fun(intern(lit("sub-buf"), user_package), func_n3(sub_buf));
+  reg_fun(intern(lit("buf-slice"), user_package), func_n3o(buf_slice, 1));
+  reg_fun(intern(lit("buf-slice-parent"), user_package), func_n1(buf_slice_parent));
+  reg_fun(intern(lit("buf-slice-offset"), user_package), func_n1(buf_slice_offset));
   reg_fun(intern(lit("replace-buf"), user_package), func_n4(replace_buf));
   reg_fun(intern(lit("buf-list"), user_package), func_n1(buf_list));
   reg_fun(intern(lit("buf-put-buf"), user_package), func_n3(buf_put_buf));
@@ -40,6 +40,9 @@ val length_buf(val buf);
 val buf_alloc_size(val buf);
 mem_t *buf_get(val buf, val self);
 val sub_buf(val seq, val from, val to);
+val buf_slice(val obj, val from, val to);
+val buf_slice_parent(val buf);
+val buf_slice_offset(val buf);
 val replace_buf(val buf, val items, val from, val to);
 val buf_list(val list);
 val buf_put_buf(val dbuf, val sbuf, val pos);
@@ -6107,6 +6107,15 @@ mem_t *carray_ptr(val carray, val type, val self)
   return scry->data;
 }
 
+mem_t *carray_bytes(val carray, cnum *pnbytes, val self)
+{
+  struct carray *scry = carray_struct_checked(self, carray);
+  if (scry->nelem < 0)
+    uw_throwf(error_s, lit("~a: size of ~s carray unknown"), self, carray, nao);
+  *pnbytes = scry->nelem * scry->eltft->size;
+  return scry->data;
+}
+
 void carray_set_ptr(val carray, val type, mem_t *ptr, val self)
 {
   struct carray *scry = carray_struct_checked(self, carray);
@@ -343,7 +343,7 @@ static void finalize(val obj)
     mp_clear(mp(obj));
     return;
   case BUF:
-    if (obj->b.size) {
+    if (is_num(obj->b.size)) {
       free(obj->b.data);
       obj->b.data = 0;
     }
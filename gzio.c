@@ -29,6 +29,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <wchar.h>
 #include <signal.h>
@@ -38,6 +39,12 @@
 #if HAVE_SYS_WAIT
 #include <sys/wait.h>
 #endif
+#if HAVE_PTHREAD
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 #include "alloca.h"
 #include "lib.h"
 #include "stream.h"
@@ -62,6 +69,11 @@ struct gzio_handle {
   int fd;
 #if HAVE_FORK_STUFF
   pid_t pid;
+#endif
+#if HAVE_PTHREAD
+  struct gzpar_wr *wr;
+  struct gzpar_rd *rd;
+  unsigned par_tried : 8;
 #endif
   unsigned is_byte_oriented : 8;
   unsigned is_output : 8;
@@ -71,6 +83,797 @@ val gzio_stream_s;
 
 struct cobj_class *gzio_stream_cls;
 
+static val gzip_threads_s;
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#if HAVE_PTHREAD
+
+/*
+ * Threaded compression and decompression.
+ *
+ * Output is compressed the way pigz does it: the data is cut into
+ * blocks which worker threads deflate independently, each primed with
+ * the last 32K of the preceding block as a dictionary, so that the
+ * compression ratio barely suffers. Every block but the last ends in
+ * a sync flush, which leaves it byte-aligned, so that the compressed
+ * blocks concatenate into a single Deflate stream. The gzip header and
+ * trailer are produced here; the gzFile underneath such a stream is
+ * opened in transparent mode, and just writes the bytes.
+ *
+ * Input from a regular file is inflated ahead of the consumer by a
+ * helper thread, into a ring of chunks. If the file is in the BGZF
+ * format, in which every gzip member records its own size, several
+ * threads inflate members concurrently, each delivering into the chunk
+ * for its member's sequence number. The helpers read the file with
+ * pread, leaving the gzFile untouched, so that it can take over if the
+ * stream is sought backward.
+ *
+ * The threads work only on malloced buffers, never touch Lisp objects,
+ * and run with all signals blocked.
+ */
+
+#define GZPAR_BLOCK 131072
+#define GZPAR_DICT 32768
+#define GZPAR_UNGET 16
+#define GZPAR_MAXTHR 64
+
+struct gzpar_job {
+  unsigned char *in, *out, *dict;
+  size_t inlen, outlen, dictlen;
+  uLong crc;
+  int last, done, ok;
+};
+
+struct gzpar_wr {
+  pthread_mutex_t mtx;
+  pthread_cond_t cnd;
+  pthread_t *thr;
+  int maxthr, nthr, started, stop;
+  int level, nslots, failed, eno, zs_ok;
+  pid_t pid;
+  size_t outsize;
+  struct gzpar_job *job;
+  ucnum nsub, nclaim, nwrit;
+  z_off_t total;
+  uLong crc;
+  z_stream zs;
+};
+
+enum gzpar_state { gzpar_empty, gzpar_full, gzpar_eof, gzpar_error };
+
+struct gzpar_chunk {
+  unsigned char *base;
+  size_t len;
+  enum gzpar_state state;
+  int eno;
+  const char *msg;
+};
+
+struct gzpar_rd {
+  pthread_mutex_t mtx;
+  pthread_cond_t cnd;
+  pthread_t *thr;
+  int nthr, nslots, fd, bgzf, streaming, done, stop;
+  pid_t pid;
+  off_t off;
+  ucnum nclaim, ncons;
+  struct gzpar_chunk *chunk;
+  unsigned char *ptr, *end, *floor;
+  z_off_t pos;
+};
+
+static int gzpar_threads(void)
+{
+  val n = cdr(lookup_var(nil, gzip_threads_s));
+  cnum c = n ? c_num(n, lit("gzip-stream")) : 0;
+  return c < 0 ? 0 : min(c, GZPAR_MAXTHR);
+}
+
+static int gzpar_spawn(pthread_t *thr, int n, void *(*fun)(void *), void *arg)
+{
+  sigset_t all, saved;
+  int i;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  for (i = 0; i < n; i++)
+    if (pthread_create(&thr[i], 0, fun, arg) != 0)
+      break;
+
+  pthread_sigmask(SIG_SETMASK, &saved, 0);
+  return i;
+}
+
+/* In a child created by fork, the threads don't exist, and the mutex
+   may have been copied in a locked state. */
+static int gzpar_orphaned(pid_t pid)
+{
+  if (getpid() == pid)
+    return 0;
+  errno = EBADF;
+  return 1;
+}
+
+static void gzpar_compress(z_stream *zs, struct gzpar_job *job, size_t outsize)
+{
+  int rc;
+
+  deflateReset(zs);
+  if (job->dictlen)
+    deflateSetDictionary(zs, job->dict, job->dictlen);
+  zs->next_in = job->in;
+  zs->avail_in = job->inlen;
+  zs->next_out = job->out;
+  zs->avail_out = outsize;
+  rc = deflate(zs, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+  job->outlen = outsize - zs->avail_out;
+  job->ok = (rc == (job->last ? Z_STREAM_END : Z_OK) && zs->avail_out != 0);
+  job->crc = crc32(crc32(0, Z_NULL, 0), job->in, job->inlen);
+}
+
+static int gzpar_deflate_init(z_stream *zs, int level)
+{
+  return deflateInit2(zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+static void *gzpar_deflate_thread(void *arg)
+{
+  struct gzpar_wr *wr = coerce(struct gzpar_wr *, arg);
+  z_stream zs;
+  int zok;
+
+  memset(&zs, 0, sizeof zs);
+  zok = gzpar_deflate_init(&zs, wr->level);
+
+  pthread_mutex_lock(&wr->mtx);
+
+  for (;;) {
+    struct gzpar_job *job;
+
+    while (!wr->stop && wr->nclaim == wr->nsub)
+      pthread_cond_wait(&wr->cnd, &wr->mtx);
+
+    if (wr->nclaim == wr->nsub)
+      break;
+
+    job = &wr->job[wr->nclaim++ % wr->nslots];
+    pthread_mutex_unlock(&wr->mtx);
+
+    if (zok)
+      gzpar_compress(&zs, job, wr->outsize);
+    else
+      job->ok = 0;
+
+    pthread_mutex_lock(&wr->mtx);
+    job->done = 1;
+    pthread_cond_broadcast(&wr->cnd);
+  }
+
+  pthread_mutex_unlock(&wr->mtx);
+
+  if (zok)
+    deflateEnd(&zs);
+  return 0;
+}
+
+static void gzpar_job_alloc(struct gzpar_wr *wr, struct gzpar_job *job)
+{
+  if (job->in == 0) {
+    job->in = coerce(unsigned char *, chk_malloc(GZPAR_BLOCK));
+    job->out = coerce(unsigned char *, chk_malloc(wr->outsize));
+    job->dict = coerce(unsigned char *, chk_malloc(GZPAR_DICT));
+  }
+  job->inlen = 0;
+}
+
+static struct gzpar_wr *gzpar_wr_new(int maxthr)
+{
+  struct gzpar_wr *wr = coerce(struct gzpar_wr *, chk_calloc(1, sizeof *wr));
+
+  wr->maxthr = maxthr;
+  wr->nslots = 2 * maxthr + 2;
+  wr->level = Z_DEFAULT_COMPRESSION;
+  wr->outsize = compressBound(GZPAR_BLOCK) + 64;
+  wr->crc = crc32(0, Z_NULL, 0);
+  wr->pid = getpid();
+  wr->job = coerce(struct gzpar_job *,
+                   chk_calloc(wr->nslots, sizeof *wr->job));
+  wr->thr = coerce(pthread_t *, chk_calloc(maxthr + 1, sizeof *wr->thr));
+  pthread_mutex_init(&wr->mtx, 0);
+  pthread_cond_init(&wr->cnd, 0);
+  gzpar_job_alloc(wr, &wr->job[0]);
+  return wr;
+}
+
+static void gzpar_wr_free(struct gzpar_wr *wr)
+{
+  int i;
+
+  if (!gzpar_orphaned(wr->pid)) {
+    pthread_mutex_lock(&wr->mtx);
+    wr->stop = 1;
+    pthread_cond_broadcast(&wr->cnd);
+    pthread_mutex_unlock(&wr->mtx);
+    for (i = 0; i < wr->nthr; i++)
+      pthread_join(wr->thr[i], 0);
+    pthread_mutex_destroy(&wr->mtx);
+    pthread_cond_destroy(&wr->cnd);
+  }
+
+  if (wr->zs_ok)
+    deflateEnd(&wr->zs);
+
+  for (i = 0; i < wr->nslots; i++) {
+    free(wr->job[i].in);
+    free(wr->job[i].out);
+    free(wr->job[i].dict);
+  }
+
+  free(wr->job);
+  free(wr->thr);
+  free(wr);
+}
+
+static int gzpar_fail(struct gzpar_wr *wr)
+{
+  wr->failed = 1;
+  wr->eno = errno;
+  return 0;
+}
+
+/* Write out compressed blocks in order, waiting for the oldest
+   ones until no more than keep are outstanding. */
+static int gzpar_drain(struct gzio_handle *h, ucnum keep)
+{
+  struct gzpar_wr *wr = h->wr;
+
+  while (wr->nwrit < wr->nsub) {
+    struct gzpar_job *job = &wr->job[wr->nwrit % wr->nslots];
+
+    if (wr->nthr) {
+      int done;
+
+      if (gzpar_orphaned(wr->pid))
+        return gzpar_fail(wr);
+
+      pthread_mutex_lock(&wr->mtx);
+      while (!job->done && wr->nsub - wr->nwrit > keep)
+        pthread_cond_wait(&wr->cnd, &wr->mtx);
+      done = job->done;
+      pthread_mutex_unlock(&wr->mtx);
+
+      if (!done)
+        break;
+    }
+
+    if (!job->ok) {
+      errno = ENOMEM;
+      return gzpar_fail(wr);
+    }
+
+    if (wr->nwrit == 0) {
+      unsigned char hdr[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+      hdr[8] = (wr->level == 9 ? 2 : wr->level == 0 || wr->level == 1 ? 4 : 0);
+      if (gzwrite(h->f, hdr, sizeof hdr) == 0)
+        return gzpar_fail(wr);
+    }
+
+    if (gzwrite(h->f, job->out, job->outlen) == 0)
+      return gzpar_fail(wr);
+
+    wr->crc = crc32_combine(wr->crc, job->crc, job->inlen);
+    wr->nwrit++;
+  }
+
+  return 1;
+}
+
+static int gzpar_submit(struct gzio_handle *h, int last)
+{
+  struct gzpar_wr *wr = h->wr;
+  struct gzpar_job *job = &wr->job[wr->nsub % wr->nslots];
+
+  job->last = last;
+  job->done = 0;
+
+  if (wr->nsub > 0) {
+    struct gzpar_job *prev = &wr->job[(wr->nsub - 1) % wr->nslots];
+    job->dictlen = min(prev->inlen, GZPAR_DICT);
+    memcpy(job->dict, prev->in + prev->inlen - job->dictlen, job->dictlen);
+  } else {
+    job->dictlen = 0;
+  }
+
+  if (!wr->started) {
+    wr->started = 1;
+    if (!last)
+      wr->nthr = gzpar_spawn(wr->thr, wr->maxthr, gzpar_deflate_thread, wr);
+  }
+
+  if (wr->nthr == 0) {
+    if (!wr->zs_ok && !(wr->zs_ok = gzpar_deflate_init(&wr->zs, wr->level))) {
+      errno = ENOMEM;
+      return gzpar_fail(wr);
+    }
+    gzpar_compress(&wr->zs, job, wr->outsize);
+    job->done = 1;
+    wr->nsub++;
+  } else {
+    pthread_mutex_lock(&wr->mtx);
+    wr->nsub++;
+    pthread_cond_broadcast(&wr->cnd);
+    pthread_mutex_unlock(&wr->mtx);
+  }
+
+  if (!gzpar_drain(h, last ? 0 : wr->nslots - 1))
+    return 0;
+
+  if (!last)
+    gzpar_job_alloc(wr, &wr->job[wr->nsub % wr->nslots]);
+
+  return 1;
+}
+
+static int gzpar_put(struct gzio_handle *h, const mem_t *ptr, size_t len)
+{
+  struct gzpar_wr *wr = h->wr;
+
+  if (wr->failed) {
+    errno = wr->eno;
+    return 0;
+  }
+
+  while (len > 0) {
+    struct gzpar_job *job = &wr->job[wr->nsub % wr->nslots];
+    size_t n;
+
+    if (job->inlen == GZPAR_BLOCK) {
+      if (!gzpar_submit(h, 0))
+        return 0;
+      continue;
+    }
+
+    n = min(len, GZPAR_BLOCK - job->inlen);
+    memcpy(job->in + job->inlen, ptr, n);
+    job->inlen += n;
+    wr->total += n;
+    ptr += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static int gzpar_wr_finish(struct gzio_handle *h)
+{
+  struct gzpar_wr *wr = h->wr;
+  unsigned char trl[8];
+  int i;
+
+  if (wr->failed) {
+    errno = wr->eno;
+    return 0;
+  }
+
+  if (!gzpar_submit(h, 1))
+    return 0;
+
+  for (i = 0; i < 4; i++) {
+    trl[i] = (wr->crc >> (8 * i)) & 0xff;
+    trl[i + 4] = (wr->total >> (8 * i)) & 0xff;
+  }
+
+  return gzwrite(h->f, trl, sizeof trl) != 0;
+}
+
+/* Called with the lock held. */
+static struct gzpar_chunk *gzpar_slot(struct gzpar_rd *rd, ucnum seq)
+{
+  while (!rd->stop && seq >= rd->ncons + rd->nslots)
+    pthread_cond_wait(&rd->cnd, &rd->mtx);
+  return rd->stop ? 0 : &rd->chunk[seq % rd->nslots];
+}
+
+/* Called with the lock held. */
+static void gzpar_post(struct gzpar_rd *rd, struct gzpar_chunk *ch,
+                       enum gzpar_state state, size_t len,
+                       int eno, const char *msg)
+{
+  ch->len = len;
+  ch->eno = eno;
+  ch->msg = msg;
+  ch->state = state;
+  if (state != gzpar_full)
+    rd->done = 1;
+  pthread_cond_broadcast(&rd->cnd);
+}
+
+/* Size of the BGZF block at off: 0 at the end of the file,
+   -1 if what is there isn't a BGZF block, -2 on a read error. */
+static long gzpar_bgzf_size(int fd, off_t off)
+{
+  unsigned char hdr[18];
+  ssize_t n = pread(fd, hdr, sizeof hdr, off);
+
+  if (n < 0)
+    return -2;
+  if (n == 0)
+    return 0;
+  if (n < convert(ssize_t, sizeof hdr) ||
+      hdr[0] != 0x1f || hdr[1] != 0x8b || hdr[2] != Z_DEFLATED ||
+      (hdr[3] & 4) == 0 || (hdr[10] | hdr[11] << 8) < 6 ||
+      hdr[12] != 'B' || hdr[13] != 'C' || (hdr[14] | hdr[15] << 8) != 2)
+  {
+    return -1;
+  }
+  return (hdr[16] | hdr[17] << 8) + 1;
+}
+
+/* Inflate everything from off onward as ordinary gzip members, in
+   order, ignoring anything after the last member, like gzread. */
+static void gzpar_stream(struct gzpar_rd *rd, z_stream *zs,
+                         unsigned char *in, off_t off)
+{
+  enum gzpar_state state = gzpar_full;
+  int eno = 0, member = 0;
+  const char *msg = 0;
+
+  zs->avail_in = 0;
+
+  for (;;) {
+    struct gzpar_chunk *ch;
+    size_t len;
+
+    pthread_mutex_lock(&rd->mtx);
+    ch = gzpar_slot(rd, rd->nclaim++);
+    pthread_mutex_unlock(&rd->mtx);
+
+    if (ch == 0)
+      return;
+
+    zs->next_out = ch->base + GZPAR_UNGET;
+    zs->avail_out = GZPAR_BLOCK;
+
+    while (state == gzpar_full && zs->avail_out > 0) {
+      int rc;
+
+      if (zs->avail_in < convert(uInt, member ? 1 : 2)) {
+        ssize_t n;
+
+        if (zs->avail_in)
+          memmove(in, zs->next_in, zs->avail_in);
+        zs->next_in = in;
+        n = pread(rd->fd, in + zs->avail_in, GZPAR_BLOCK - zs->avail_in, off);
+
+        if (n < 0) {
+          state = gzpar_error;
+          eno = errno;
+        } else if (n == 0) {
+          if (member) {
+            state = gzpar_error;
+            msg = "unexpected end of file";
+          } else {
+            state = gzpar_eof;
+          }
+        } else {
+          off += n;
+          zs->avail_in += n;
+        }
+        continue;
+      }
+
+      if (!member) {
+        if (zs->next_in[0] != 0x1f || zs->next_in[1] != 0x8b) {
+          state = gzpar_eof;
+          break;
+        }
+        inflateReset(zs);
+        member = 1;
+      }
+
+      switch (rc = inflate(zs, Z_NO_FLUSH)) {
+      case Z_STREAM_END:
+        member = 0;
+        break;
+      case Z_OK:
+      case Z_BUF_ERROR:
+        break;
+      default:
+        state = gzpar_error;
+        msg = zs->msg ? zs->msg : zError(rc);
+        break;
+      }
+    }
+
+    len = GZPAR_BLOCK - zs->avail_out;
+
+    pthread_mutex_lock(&rd->mtx);
+    if (state != gzpar_full && len == 0) {
+      gzpar_post(rd, ch, state, 0, eno, msg);
+      pthread_mutex_unlock(&rd->mtx);
+      return;
+    }
+    gzpar_post(rd, ch, gzpar_full, len, 0, 0);
+    pthread_mutex_unlock(&rd->mtx);
+  }
+}
+
+static void *gzpar_inflate_thread(void *arg)
+{
+  struct gzpar_rd *rd = coerce(struct gzpar_rd *, arg);
+  unsigned char *in = coerce(unsigned char *, malloc(GZPAR_BLOCK));
+  z_stream zs;
+  int zok;
+
+  memset(&zs, 0, sizeof zs);
+  zok = (inflateInit2(&zs, 16 + MAX_WBITS) == Z_OK);
+
+  pthread_mutex_lock(&rd->mtx);
+
+  while (!rd->stop && !rd->done) {
+    struct gzpar_chunk *ch;
+    off_t off = rd->off;
+    long size;
+    ucnum seq;
+
+    if (in == 0 || !zok) {
+      if ((ch = gzpar_slot(rd, rd->nclaim++)) != 0)
+        gzpar_post(rd, ch, gzpar_error, 0, ENOMEM, 0);
+      break;
+    }
+
+    if (!rd->bgzf) {
+      if (!rd->streaming) {
+        rd->streaming = 1;
+        pthread_mutex_unlock(&rd->mtx);
+        gzpar_stream(rd, &zs, in, off);
+        pthread_mutex_lock(&rd->mtx);
+      }
+      break;
+    }
+
+    if ((size = gzpar_bgzf_size(rd->fd, off)) == -1) {
+      rd->bgzf = 0;
+      continue;
+    }
+
+    seq = rd->nclaim++;
+
+    if (size <= 0) {
+      int eno = errno;
+      rd->done = 1;
+      if ((ch = gzpar_slot(rd, seq)) != 0)
+        gzpar_post(rd, ch, size == 0 ? gzpar_eof : gzpar_error, 0, eno, 0);
+      break;
+    }
+
+    rd->off = off + size;
+    pthread_mutex_unlock(&rd->mtx);
+
+    {
+      ssize_t n = pread(rd->fd, in, size, off);
+      enum gzpar_state state = gzpar_full;
+      int eno = errno;
+      const char *msg = 0;
+      size_t len = 0;
+
+      pthread_mutex_lock(&rd->mtx);
+      ch = gzpar_slot(rd, seq);
+      pthread_mutex_unlock(&rd->mtx);
+
+      if (ch == 0) {
+        pthread_mutex_lock(&rd->mtx);
+        break;
+      }
+
+      if (n < 0) {
+        state = gzpar_error;
+      } else if (n < size) {
+        state = gzpar_error;
+        msg = "unexpected end of file";
+      } else {
+        int rc;
+
+        inflateReset(&zs);
+        zs.next_in = in;
+        zs.avail_in = size;
+        zs.next_out = ch->base + GZPAR_UNGET;
+        zs.avail_out = GZPAR_BLOCK;
+
+        if ((rc = inflate(&zs, Z_FINISH)) == Z_STREAM_END && zs.avail_in == 0) {
+          len = GZPAR_BLOCK - zs.avail_out;
+        } else {
+          state = gzpar_error;
+          msg = rc == Z_STREAM_END || rc == Z_BUF_ERROR
+                ? "invalid BGZF block"
+                : zs.msg ? zs.msg : zError(rc);
+        }
+      }
+
+      pthread_mutex_lock(&rd->mtx);
+      gzpar_post(rd, ch, state, len, eno, msg);
+    }
+  }
+
+  pthread_mutex_unlock(&rd->mtx);
+
+  if (zok)
+    inflateEnd(&zs);
+  free(in);
+  return 0;
+}
+
+static void gzpar_rd_free(struct gzpar_rd *rd)
+{
+  int i;
+
+  if (!gzpar_orphaned(rd->pid)) {
+    pthread_mutex_lock(&rd->mtx);
+    rd->stop = 1;
+    pthread_cond_broadcast(&rd->cnd);
+    pthread_mutex_unlock(&rd->mtx);
+    for (i = 0; i < rd->nthr; i++)
+      pthread_join(rd->thr[i], 0);
+    pthread_mutex_destroy(&rd->mtx);
+    pthread_cond_destroy(&rd->cnd);
+  }
+
+  for (i = 0; i < rd->nslots; i++)
+    free(rd->chunk[i].base);
+
+  free(rd->chunk);
+  free(rd->thr);
+  free(rd);
+}
+
+static struct gzpar_rd *gzpar_rd_new(int fd, off_t off, int maxthr)
+{
+  int bgzf = gzpar_bgzf_size(fd, off) > 0;
+  int nthr = bgzf ? maxthr : 1, i;
+  struct gzpar_rd *rd = coerce(struct gzpar_rd *, chk_calloc(1, sizeof *rd));
+
+  rd->fd = fd;
+  rd->off = off;
+  rd->bgzf = bgzf;
+  rd->pid = getpid();
+  rd->nslots = 2 * nthr + 2;
+  rd->chunk = coerce(struct gzpar_chunk *,
+                     chk_calloc(rd->nslots, sizeof *rd->chunk));
+  for (i = 0; i < rd->nslots; i++)
+    rd->chunk[i].base = coerce(unsigned char *,
+                               chk_malloc(GZPAR_UNGET + GZPAR_BLOCK));
+  rd->thr = coerce(pthread_t *, chk_calloc(nthr, sizeof *rd->thr));
+  pthread_mutex_init(&rd->mtx, 0);
+  pthread_cond_init(&rd->cnd, 0);
+
+  if ((rd->nthr = gzpar_spawn(rd->thr, nthr, gzpar_inflate_thread, rd)) == 0) {
+    gzpar_rd_free(rd);
+    return 0;
+  }
+
+  return rd;
+}
+
+/* The helpers are started on the first read, if the stream is a
+   gzip file (not one read transparently) on a regular file. */
+static struct gzpar_rd *gzio_rd(struct gzio_handle *h)
+{
+  if (h->rd == 0 && !h->par_tried) {
+    struct stat st;
+    int nthr = gzpar_threads();
+    z_off_t off;
+
+    h->par_tried = 1;
+
+    if (nthr > 0 && h->fd >= 0 && fstat(h->fd, &st) == 0 &&
+        S_ISREG(st.st_mode) && !gzdirect(h->f) && gztell(h->f) == 0 &&
+        (off = gzoffset(h->f)) >= 0)
+    {
+      h->rd = gzpar_rd_new(h->fd, off, nthr);
+    }
+  }
+
+  return h->rd;
+}
+
+static struct gzpar_chunk *gzpar_cur(struct gzpar_rd *rd)
+{
+  return &rd->chunk[rd->ncons % rd->nslots];
+}
+
+/* Release the exhausted current chunk, and wait for the next one. */
+static int gzpar_next(struct gzpar_rd *rd)
+{
+  if (gzpar_orphaned(rd->pid))
+    return 0;
+
+  pthread_mutex_lock(&rd->mtx);
+
+  for (;;) {
+    struct gzpar_chunk *ch = gzpar_cur(rd);
+
+    if (rd->ptr != 0) {
+      if (ch->state != gzpar_full)
+        break;
+      ch->state = gzpar_empty;
+      rd->ncons++;
+      rd->ptr = 0;
+      pthread_cond_broadcast(&rd->cnd);
+      continue;
+    }
+
+    while (ch->state == gzpar_empty)
+      pthread_cond_wait(&rd->cnd, &rd->mtx);
+
+    rd->floor = ch->base;
+    rd->ptr = ch->base + GZPAR_UNGET;
+    rd->end = rd->ptr + ch->len;
+
+    if (ch->state != gzpar_full || ch->len != 0)
+      break;
+  }
+
+  pthread_mutex_unlock(&rd->mtx);
+  return rd->ptr < rd->end;
+}
+
+/* The error which the consumer has run into, if any: an errno value,
+   or EIO if the data is corrupt or truncated. */
+static int gzpar_rd_error(struct gzpar_rd *rd)
+{
+  int eno = 0;
+
+  if (!gzpar_orphaned(rd->pid)) {
+    struct gzpar_chunk *ch;
+
+    pthread_mutex_lock(&rd->mtx);
+    ch = gzpar_cur(rd);
+    if (rd->ptr != 0 && ch->state == gzpar_error)
+      eno = ch->eno ? ch->eno : EIO;
+    pthread_mutex_unlock(&rd->mtx);
+  }
+
+  return eno;
+}
+
+static int gzpar_getc(struct gzpar_rd *rd)
+{
+  if (rd->ptr < rd->end || gzpar_next(rd)) {
+    rd->pos++;
+    return *rd->ptr++;
+  }
+  return EOF;
+}
+
+static int gzpar_ungetc(struct gzpar_rd *rd, int byte)
+{
+  if (rd->ptr == 0 || rd->ptr == rd->floor)
+    return EOF;
+  *--rd->ptr = byte;
+  rd->pos--;
+  return byte;
+}
+
+static size_t gzpar_read(struct gzpar_rd *rd, mem_t *buf, size_t len)
+{
+  size_t total = 0;
+
+  while (total < len && (rd->ptr < rd->end || gzpar_next(rd))) {
+    size_t n = min(len - total, convert(size_t, rd->end - rd->ptr));
+    memcpy(buf + total, rd->ptr, n);
+    rd->ptr += n;
+    total += n;
+  }
+
+  rd->pos += total;
+  return total;
+}
+
+#endif
+
 static void gzio_stream_print(val stream, val out, val pretty,
                               struct strm_ctx *ctx)
 {
@@ -110,6 +913,31 @@ static val gzio_maybe_read_error(val stream)
 
   if (h->f == 0) {
     uw_throwf(file_error_s, lit("error reading ~s: file closed"), stream, nao);
+#if HAVE_PTHREAD
+  } else if (h->rd) {
+    struct gzpar_chunk *ch = gzpar_cur(h->rd);
+
+    switch (ch->state) {
+    case gzpar_full:
+      h->err = nil;
+      h->errstr = lit("no error");
+      break;
+    case gzpar_eof:
+      h->err = t;
+      h->errstr = lit("eof");
+      break;
+    default:
+      if (ch->state == gzpar_error && ch->msg) {
+        h->err = negone;
+        h->errstr = string_utf8(ch->msg);
+        break;
+      }
+      h->err = num(ch->state == gzpar_error ? ch->eno : EBADF);
+      h->errstr = nil;
+      uw_ethrowf(file_error_s, lit("error reading ~s: ~d/~s"),
+                 stream, h->err, errno_to_string(h->err), nao);
+    }
+#endif
   } else if (gzeof(h->f)) {
     h->err = t;
     h->errstr = lit("eof");
@@ -151,10 +979,19 @@ static val gzio_maybe_error(val stream, val action)
              action, stream, err, errno_to_string(err), nao);
 }
 
+static int gzio_eof(struct gzio_handle *h)
+{
+#if HAVE_PTHREAD
+  if (h->rd)
+    return gzpar_cur(h->rd)->state == gzpar_eof && h->rd->ptr >= h->rd->end;
+#endif
+  return gzeof(h->f);
+}
+
 static val gzio_get_error(val stream)
 {
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
-  if (h->f != 0 && gzeof(h->f))
+  if (h->f != 0 && gzio_eof(h))
     return t;
   return h->err;
 }
@@ -163,7 +1000,7 @@ static val gzio_get_error_str(val stream)
 {
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
 
-  if (h->f != 0 && gzeof(h->f))
+  if (h->f != 0 && gzio_eof(h))
     return lit("eof");
   return h->errstr;
 }
@@ -202,9 +1039,19 @@ static int se_gzgetc(gzFile f)
   return ret;
 }
 
-static int gzio_get_char_callback(mem_t *f)
+static int gzio_getc(struct gzio_handle *h)
 {
-  return se_gzgetc(coerce(gzFile, f));
+#if HAVE_PTHREAD
+  struct gzpar_rd *rd = gzio_rd(h);
+  if (rd)
+    return gzpar_getc(rd);
+#endif
+  return se_gzgetc(h->f);
+}
+
+static int gzio_get_char_callback(mem_t *h)
+{
+  return gzio_getc(coerce(struct gzio_handle *, h));
 }
 
 static val gzio_get_char(val stream)
@@ -218,12 +1065,12 @@ static val gzio_get_char(val stream)
     wint_t ch;
 
     if (h->is_byte_oriented) {
-      ch = se_gzgetc(h->f);
+      ch = gzio_getc(h);
       if (ch == 0)
         ch = 0xDC00;
     } else {
         ch = utf8_decode(&h->ud, gzio_get_char_callback,
-                         coerce(mem_t *, h->f));
+                         coerce(mem_t *, h));
     }
 
     return (ch != WEOF) ? chr(ch) : gzio_maybe_read_error(stream);
@@ -236,7 +1083,7 @@ static val gzio_get_byte(val stream)
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
 
   if (h->f) {
-    int ch = se_gzgetc(h->f);
+    int ch = gzio_getc(h);
     return (ch != EOF) ? num(ch) : gzio_maybe_read_error(stream);
   }
   return gzio_maybe_read_error(stream);
@@ -249,12 +1096,32 @@ static val gzio_unget_char(val stream, val ch)
   return ch;
 }
 
+static int gzio_ungetc(struct gzio_handle *h, int byte)
+{
+#if HAVE_PTHREAD
+  struct gzpar_rd *rd = gzio_rd(h);
+  if (rd)
+    return gzpar_ungetc(rd, byte);
+#endif
+  return gzungetc(byte, h->f);
+}
+
+static cnum gzio_read(struct gzio_handle *h, mem_t *ptr, ucnum len)
+{
+#if HAVE_PTHREAD
+  struct gzpar_rd *rd = gzio_rd(h);
+  if (rd)
+    return gzpar_read(rd, ptr, len);
+#endif
+  return gzread(h->f, ptr, len);
+}
+
 static val gzio_unget_byte(val stream, int byte)
 {
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
 
   errno = 0;
-  return h->f != 0 && gzungetc(byte, coerce(gzFile, h->f)) != EOF
+  return h->f != 0 && gzio_ungetc(h, byte) != EOF
          ? num_fast(byte)
          : gzio_maybe_error(stream, lit("writing"));
 }
@@ -269,7 +1136,7 @@ static ucnum gzio_fill_buf(val stream, mem_t *ptr, ucnum len, ucnum pos)
     return len;
   errno = 0;
   if (h->f != 0) {
-    cnum nread = gzread(h->f, ptr + pos, len - pos);
+    cnum nread = gzio_read(h, ptr + pos, len - pos);
     if (nread > 0)
       return pos + nread;
   }
@@ -282,8 +1149,37 @@ static val gzio_close(val stream, val throw_on_error)
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
 
   if (h->f != 0) {
-    int result = gzclose(h->f);
+    int result;
+#if HAVE_PTHREAD
+    int ok = 1, eno = 0;
+
+    if (h->wr) {
+      ok = gzpar_wr_finish(h);
+      eno = errno;
+      gzpar_wr_free(h->wr);
+      h->wr = 0;
+    }
+
+    if (h->rd) {
+      int rd_eno = gzpar_rd_error(h->rd);
+
+      if (rd_eno && ok) {
+        ok = 0;
+        eno = rd_eno;
+      }
+
+      gzpar_rd_free(h->rd);
+      h->rd = 0;
+    }
+#endif
+    result = gzclose(h->f);
     h->f = 0;
+#if HAVE_PTHREAD
+    if (!ok) {
+      result = Z_ERRNO;
+      errno = eno;
+    }
+#endif
     if (result != Z_OK) {
       if (default_null_arg(throw_on_error))
         gzio_maybe_error(stream, lit("closing"));
@@ -328,6 +1224,59 @@ static z_off_t z_off_t_num(val num, val self)
     internal_error("portme: unsupported z_off_t size");
   }
 }
+static z_off_t gzio_tell(struct gzio_handle *h)
+{
+#if HAVE_PTHREAD
+  if (h->wr)
+    return h->wr->total;
+  if (h->rd)
+    return h->rd->pos;
+#endif
+  return gztell(h->f);
+}
+
+static z_off_t gzio_do_seek(struct gzio_handle *h, z_off_t off, int whence)
+{
+#if HAVE_PTHREAD
+  if (h->wr || h->rd) {
+    static const mem_t zeros[4096];
+    mem_t skip[4096];
+    z_off_t pos = gzio_tell(h);
+
+    if (whence == SEEK_CUR) {
+      off += pos;
+    } else if (whence != SEEK_SET) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    if (off < pos) {
+      if (h->wr) {
+        errno = EINVAL;
+        return -1;
+      }
+      gzpar_rd_free(h->rd);
+      h->rd = 0;
+      return gzseek(h->f, off, SEEK_SET);
+    }
+
+    while (pos < off) {
+      size_t n = min(off - pos, convert(z_off_t, sizeof zeros));
+      if (h->wr) {
+        if (!gzpar_put(h, zeros, n))
+          return -1;
+      } else if (gzpar_read(h->rd, skip, n) < n) {
+        break;
+      }
+      pos += n;
+    }
+
+    return off;
+  }
+#endif
+  return gzseek(h->f, off, whence);
+}
+
 static val gzio_seek(val stream, val offset, enum strm_whence whence)
 {
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
@@ -337,9 +1286,9 @@ static val gzio_seek(val stream, val offset, enum strm_whence whence)
 
   if (h->f != 0) {
     if (offset == zero && whence == strm_cur) {
-      return num_z_off_t(gztell(h->f));
+      return num_z_off_t(gzio_tell(h));
     } else {
-      if (gzseek(h->f, z_off_t_num(offset, self), whence) >= 0) {
+      if (gzio_do_seek(h, z_off_t_num(offset, self), whence) >= 0) {
         if (!h->is_output)
           utf8_decoder_init(&h->ud);
         h->unget_c = nil;
@@ -351,9 +1300,29 @@ static val gzio_seek(val stream, val offset, enum strm_whence whence)
   return gzio_maybe_error(stream, lit("seeking"));
 }
 
-static int gzio_put_char_callback(int ch, mem_t *f)
+static int gzio_putc(struct gzio_handle *h, int ch)
+{
+#if HAVE_PTHREAD
+  if (h->wr) {
+    mem_t byte = ch;
+    return gzpar_put(h, &byte, 1) ? ch : EOF;
+  }
+#endif
+  return se_gzputc(ch, h->f);
+}
+
+static cnum gzio_write(struct gzio_handle *h, mem_t *ptr, ucnum len)
 {
-  int ret = se_gzputc(ch, coerce(gzFile, f)) != EOF;
+#if HAVE_PTHREAD
+  if (h->wr)
+    return gzpar_put(h, ptr, len) ? convert(cnum, len) : 0;
+#endif
+  return gzwrite(h->f, ptr, len);
+}
+
+static int gzio_put_char_callback(int ch, mem_t *h)
+{
+  int ret = gzio_putc(coerce(struct gzio_handle *, h), ch) != EOF;
   return ret;
 }
 
@@ -368,7 +1337,7 @@ static val gzio_put_string(val stream, val str)
     const wchar_t *s = c_str(str, self);
 
     while (*s) {
-      if (!utf8_encode(*s++, gzio_put_char_callback, coerce(mem_t *, h->f)))
+      if (!utf8_encode(*s++, gzio_put_char_callback, coerce(mem_t *, h)))
         return gzio_maybe_error(stream, lit("writing"));
     }
     return t;
@@ -381,7 +1350,7 @@ static val gzio_put_char(val stream, val ch)
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
   errno = 0;
   return h->f != 0 && utf8_encode(c_chr(ch), gzio_put_char_callback,
-                                  coerce(mem_t *, h->f))
+                                  coerce(mem_t *, h))
          ? t : gzio_maybe_error(stream, lit("writing"));
 }
 
@@ -389,7 +1358,7 @@ static val gzio_put_byte(val stream, int b)
 {
   struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
   errno = 0;
-  return h->f != 0 && se_gzputc(b, coerce(gzFile, h->f)) != EOF
+  return h->f != 0 && gzio_putc(h, b) != EOF
          ? t : gzio_maybe_error(stream, lit("writing"));
 }
 
@@ -403,7 +1372,7 @@ static ucnum gzio_put_buf(val stream, mem_t *ptr, ucnum len, ucnum pos)
     return len;
   errno = 0;
   if (h->f != 0) {
-    cnum nwrit = gzwrite(h->f, ptr + pos, len - pos);
+    cnum nwrit = gzio_write(h, ptr + pos, len - pos);
     if (nwrit > 0)
       return pos + nwrit;
   }
@@ -502,10 +1471,19 @@ void gzio_init(void)
   fill_stream_ops(&gzio_ops_wr);
   gzio_stream_s = intern(lit("gzip-stream"), user_package);
   gzio_stream_cls = cobj_register_super(gzio_stream_s, stream_cls);
+  gzip_threads_s = intern(lit("*gzip-threads*"), user_package);
+#if HAVE_PTHREAD && defined _SC_NPROCESSORS_ONLN
+  {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    reg_var(gzip_threads_s, num_fast(ncpu > 1 ? min(ncpu, GZPAR_MAXTHR) : 0));
+  }
+#else
+  reg_var(gzip_threads_s, zero);
+#endif
 }
 
 gzFile w_gzopen_mode(const wchar_t *wname, const wchar_t *wmode,
-                     const struct stdio_mode m, val self)
+                     const struct stdio_mode m, int *pfd, val self)
 {
   if (m.buforder >= 0 || m.nonblock || m.notrunc || m.unbuf ||
       m.linebuf || m.interactive)
@@ -522,6 +1500,8 @@ gzFile w_gzopen_mode(const wchar_t *wname, const wchar_t *wmode,
 #if HAVE_FCNTL
   {
     int fd = w_open_mode(wname, m);
+    if (pfd)
+      *pfd = fd;
     return (fd < 0) ? NULL : w_gzdopen_mode(fd, wmode, m, self);
   }
 #else
@@ -531,6 +1511,8 @@ gzFile w_gzopen_mode(const wchar_t *wname, const wchar_t *wmode,
     gzFile f = gzopen(name, mode);
     free(name);
     free(mode);
+    if (pfd)
+      *pfd = -1;
     return f;
   }
 #endif
@@ -552,7 +1534,17 @@ gzFile w_gzdopen_mode(int fd, const wchar_t *wmode,
 
   {
     char *mode = utf8_dup_to(wmode);
-    gzFile f = gzdopen(fd, mode);
+    gzFile f;
+#if HAVE_PTHREAD
+    /* Output will be compressed by make_gzio_stream's threads;
+       zlib just writes the result. */
+    if (m.write && gzpar_threads() > 0) {
+      size_t len = strlen(mode);
+      mode = coerce(char *, chk_realloc(coerce(mem_t *, mode), len + 2));
+      strcpy(mode + len, "T");
+    }
+#endif
+    f = gzdopen(fd, mode);
     free(mode);
     if (f)
       return f;
@@ -582,6 +1574,26 @@ val make_gzio_stream(gzFile f, int fd, val descr, int is_output)
   h->is_output = is_output;
 #if HAVE_FORK_STUFF
   h->pid = 0;
+#endif
+#if HAVE_PTHREAD
+  h->wr = 0;
+  h->rd = 0;
+  h->par_tried = 0;
+  if (is_output && gzdirect(f))
+    h->wr = gzpar_wr_new(gzpar_threads());
+#endif
+  return stream;
+}
+
+val gzio_set_mode_props(const struct stdio_mode m, val stream)
+{
+#if HAVE_PTHREAD
+  struct gzio_handle *h = coerce(struct gzio_handle *, stream->co.handle);
+
+  if (h->wr && m.gzlevel)
+    h->wr->level = m.gzlevel;
+#else
+  (void) m;
 #endif
   return stream;
 }
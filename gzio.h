@@ -29,10 +29,11 @@
 extern val gzio_stream_s;
 void gzio_init(void);
 gzFile w_gzopen_mode(const wchar_t *wname, const wchar_t *wmode,
-                     const struct stdio_mode m, val self);
+                     const struct stdio_mode m, int *pfd, val self);
 gzFile w_gzdopen_mode(int fd, const wchar_t *wmode,
                       const struct stdio_mode m, val self);
 val make_gzio_stream(gzFile f, int fd, val descr, int is_output);
+val gzio_set_mode_props(const struct stdio_mode m, val stream);
 #if HAVE_FORK_STUFF
 val make_gzio_pipe_stream(gzFile f, int fd, val descr, int is_output, pid_t pid);
 #endif
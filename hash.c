@@ -75,8 +75,14 @@ struct hash {
   ucnum count;
   val userdata;
   int usecount;
+  int frozen;
   val tblstack;
   struct hash_ops *hops;
+#if CONFIG_GEN_GC
+  val *dirty;
+  ucnum ndirty, dirty_max;
+  ucnum dirty_epoch;
+#endif
 };
 
 #define hash_seed (deref(lookup_var_l(nil, hash_seed_s)))
@@ -96,6 +102,15 @@ struct cobj_class *hash_cls, *hash_iter_cls;
 static struct hash *reachable_weak_hashes;
 static struct hash_iter *reachable_iters;
 
+#if CONFIG_GEN_GC
+/*
+ * Counts garbage collections. A weak hash which has new cells recorded
+ * in its dirty array during the current epoch was placed into the
+ * mutobj array; a generational pass then examines only those cells.
+ */
+static ucnum weak_epoch = 1;
+#endif
+
 static int hash_traversal_limit = 32;
 
 #if SIZEOF_PTR == 8
@@ -499,6 +514,110 @@ static val hash_lookup(struct hash *h, val key, ucnum hcode)
   return nil;
 }
 
+/*
+ * A frozen table is laid out by Robin Hood placement: each cell is
+ * displaced from its home slot by no more than the cells it passed
+ * over. A probe can therefore stop as soon as it meets a cell which is
+ * closer to its home than the key being sought would be, without
+ * walking to the end of the cluster.
+ */
+static val hash_frozen_lookup(struct hash *h, val key, ucnum hcode)
+{
+  val *vec = h->table->v.vec;
+  val (*equal_fun)(val, val) = h->hops->equal_fun;
+  ucnum mask = h->mask, i = hcode & mask, dist = 0;
+
+  for (; dist <= mask; i = (i + 1) & mask, dist++) {
+    val cell = vec[i];
+
+    if (cell == nil || ((i - cell->ch.hash) & mask) < dist)
+      break;
+
+    if (cell->ch.hash == hcode && equal_fun(us_car(cell), key))
+      return cell;
+  }
+
+  return nil;
+}
+
+static void hash_rh_place(val *vec, ucnum mask, val cell)
+{
+  ucnum i = cell->ch.hash & mask, dist = 0;
+
+  for (;; i = (i + 1) & mask, dist++) {
+    val occ = vec[i];
+    ucnum odist;
+
+    if (occ == nil) {
+      vec[i] = cell;
+      return;
+    }
+
+    odist = (i - occ->ch.hash) & mask;
+
+    if (odist < dist) {
+      vec[i] = cell;
+      cell = occ;
+      dist = odist;
+    }
+  }
+}
+
+static void hash_check_frozen(val self, struct hash *h, val hash)
+{
+  if (h->frozen)
+    uw_throwf(error_s, lit("~a: ~s is frozen"), self, hash, nao);
+}
+
+#if CONFIG_GEN_GC
+
+/*
+ * A new cell is being stored into the mature table of a mature weak hash.
+ * Rather than having the write barrier treat the cell as a root, which
+ * would keep it and its key and value alive until the next full gc,
+ * remember the cell in the dirty array, and have the hash itself visited
+ * in the next generational gc. Returns zero if the cell could not be
+ * recorded, in which case the caller must fall back on setcheck.
+ */
+static int hash_note_dirty(val hash, struct hash *h, val cell)
+{
+  if (h->wkopt == hash_weak_none || full_gc || h->table->t.gen <= 0)
+    return 0;
+
+  mut(hash);
+
+  if (hash->t.gen >= 0)
+    return 0;
+
+  if (h->ndirty >= h->dirty_max) {
+    ucnum nmax = if3(h->dirty_max, h->dirty_max * 2, 16);
+    h->dirty = coerce(val *, chk_realloc(coerce(mem_t *, h->dirty),
+                                         nmax * sizeof *h->dirty));
+    h->dirty_max = nmax;
+  }
+
+  h->dirty[h->ndirty++] = cell;
+  h->dirty_epoch = weak_epoch;
+  return 1;
+}
+
+static int hash_minor_gc(struct hash *h)
+{
+  return !full_gc && h->dirty_epoch == weak_epoch;
+}
+
+#else
+
+static int hash_note_dirty(val hash, struct hash *h, val cell)
+{
+  (void) hash;
+  (void) h;
+  (void) cell;
+  return 0;
+}
+
+#endif
+
 static void hash_grow(val hash, struct hash *h, ucnum mask)
 {
   ucnum j, nmask = (mask << 1) | 1;
@@ -556,7 +675,8 @@ static val hash_insert(val hash, struct hash *h, val key, ucnum hcode, loc new_p
       val ncell = cons(key, nil);
       ncell->ch.hash = hcode;
       vec[i] = ncell;
-      setcheck(table, ncell);
+      if (!hash_note_dirty(hash, h, ncell))
+        setcheck(table, ncell);
       if (!nullocp(new_p))
         deref(new_p) = t;
       if (++h->count > h->mask >> 1)
@@ -885,6 +1005,49 @@ static void hash_print_op(val hash, val out, val pretty, struct strm_ctx *ctx)
   set_indent(out, save_indent);
 }
 
+#if CONFIG_GEN_GC
+
+static void hash_mark_dirty(struct hash *h)
+{
+  ucnum i;
+
+  for (i = 0; i < h->ndirty; i++)
+    gc_mark(h->dirty[i]);
+
+  h->ndirty = 0;
+}
+
+static void hash_mark_dirty_weak(struct hash *h)
+{
+  ucnum i;
+
+  for (i = 0; i < h->ndirty; i++) {
+    val entry = h->dirty[i];
+
+    switch (h->wkopt) {
+    case hash_weak_none:
+      gc_mark(entry);
+      break;
+    case hash_weak_keys:
+      gc_mark(us_cdr(entry));
+      break;
+    case hash_weak_vals:
+      gc_mark(us_car(entry));
+      break;
+    case hash_weak_or:
+      break;
+    case hash_weak_and:
+      if (gc_is_reachable(us_car(entry)))
+        gc_mark(us_cdr(entry));
+      else if (gc_is_reachable(us_cdr(entry)))
+        gc_mark(us_car(entry));
+      break;
+    }
+  }
+}
+
+#endif
+
 static void hash_mark(val hash)
 {
   struct hash *h = coerce(struct hash *, hash->co.handle);
@@ -897,12 +1060,31 @@ static void hash_mark(val hash)
   if (h->count == 0 || h->tblstack) {
     gc_mark(table);
     gc_mark(h->tblstack);
+#if CONFIG_GEN_GC
+    hash_mark_dirty(h);
+#endif
     return;
   }
 
-  /* Use counts will be re-calculated by a scan of the
-     hash iterators which are still reachable. */
-  h->usecount = 0;
+#if CONFIG_GEN_GC
+  if (hash_minor_gc(h)) {
+    /* This is a tenured hash, visited in a generational gc only because
+       it has new cells. If the table is also tenured, then those cells
+       are the only entries which can possibly lapse. The use count is
+       left alone: tenured iterators are not visited by this gc. */
+    if (table->t.gen > 0) {
+      hash_mark_dirty_weak(h);
+      h->next = reachable_weak_hashes;
+      reachable_weak_hashes = h;
+      return;
+    }
+  } else
+#endif
+  {
+    /* Use counts will be re-calculated by a scan of the
+       hash iterators which are still reachable. */
+    h->usecount = 0;
+  }
 
   switch (h->wkopt) {
     ucnum i;
@@ -948,9 +1130,18 @@ static void hash_mark(val hash)
   reachable_weak_hashes = h;
 }
 
+static void hash_destroy(val hash)
+{
+  struct hash *h = coerce(struct hash *, hash->co.handle);
+#if CONFIG_GEN_GC
+  free(h->dirty);
+#endif
+  free(h);
+}
+
 static struct cobj_ops hash_ops = cobj_ops_init(hash_equal_op,
                                                 hash_print_op,
-                                                cobj_destroy_free_op,
+                                                hash_destroy,
                                                 hash_mark,
                                                 hash_hash_op,
                                                 copy_hash);
@@ -1026,7 +1217,12 @@ static val do_make_hash(hash_weak_opt_t wkopt, hash_type_t type, val seed)
     h->userdata = nil;
 
     h->usecount = 0;
+    h->frozen = 0;
     h->tblstack = nil;
+#if CONFIG_GEN_GC
+    h->dirty = 0;
+    h->ndirty = h->dirty_max = h->dirty_epoch = 0;
+#endif
 
     switch (type) {
     case hash_type_eq:
@@ -1101,8 +1297,13 @@ val make_similar_hash(val existing)
   h->seed = ex->seed;
   h->wkopt = ex->wkopt;
   h->usecount = 0;
+  h->frozen = 0;
   h->tblstack = 0;
   h->hops = ex->hops;
+#if CONFIG_GEN_GC
+  h->dirty = 0;
+  h->ndirty = h->dirty_max = h->dirty_epoch = 0;
+#endif
 
   return hash;
 }
@@ -1127,8 +1328,13 @@ val copy_hash(val existing)
   h->seed = ex->seed;
   h->wkopt = ex->wkopt;
   h->usecount = 0;
+  h->frozen = 0;
   h->tblstack = 0;
   h->hops = ex->hops;
+#if CONFIG_GEN_GC
+  h->dirty = 0;
+  h->ndirty = h->dirty_max = h->dirty_epoch = 0;
+#endif
 
   for (i = 0; i <= h->mask; i++) {
     val cell = exvec[i];
@@ -1148,6 +1354,7 @@ val gethash_c(val self, val hash, val key, loc new_p)
   struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
   int lim = hash_traversal_limit;
   ucnum hv = h->hops->hash_fun(key, &lim, h->seed);
+  hash_check_frozen(self, h, hash);
   return hash_insert(hash, h, key, hv, new_p);
 }
 
@@ -1156,7 +1363,9 @@ val gethash_e(val self, val hash, val key)
   struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
   int lim = hash_traversal_limit;
   ucnum hv = h->hops->hash_fun(key, &lim, h->seed);
-  return hash_lookup(h, key, hv);
+  return if3(h->frozen,
+             hash_frozen_lookup(h, key, hv),
+             hash_lookup(h, key, hv));
 }
 
 val gethash_d(val hash, val key)
@@ -1214,7 +1423,9 @@ val remhash(val hash, val key)
   struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
   int lim = hash_traversal_limit;
   ucnum hv = h->hops->hash_fun(key, &lim, h->seed);
-  ucnum victim = hash_find_slot(h, key, hv);
+  ucnum victim;
+  hash_check_frozen(self, h, hash);
+  victim = hash_find_slot(h, key, hv);
   return (victim != UINT_PTR_MAX) ? hash_remove(h, victim) : nil;
 }
 
@@ -1223,8 +1434,10 @@ val clearhash(val hash)
   val self = lit("clearhash");
   struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
   val mod = num_fast(256);
-  val table = vector(mod, nil);
+  val table;
   ucnum oldcount = h->count;
+  hash_check_frozen(self, h, hash);
+  table = vector(mod, nil);
   h->mask = c_unum(mod, self) - 1;
   h->count = 0;
   h->table = table;
@@ -1257,10 +1470,55 @@ val set_hash_userdata(val hash, val data)
   val self = lit("set-hash-userdata");
   struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
   val olddata = h->userdata;
+  hash_check_frozen(self, h, hash);
   set(mkloc(h->userdata, hash), data);
   return olddata;
 }
 
+val freeze_hash(val hash)
+{
+  val self = lit("freeze-hash");
+  struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
+
+  if (h->wkopt != hash_weak_none)
+    uw_throwf(error_s, lit("~a: ~s is a weak hash"), self, hash, nao);
+
+  if (!h->frozen) {
+    val table = h->table;
+    val *vec = table->v.vec;
+    ucnum mask = h->mask, nmask = 1, i;
+    val ntable;
+    val *nvec;
+
+    while (nmask >> 1 < h->count)
+      nmask = (nmask << 1) | 1;
+
+    ntable = vector(num_fast(nmask + 1), nil);
+    nvec = ntable->v.vec;
+
+    for (i = 0; i <= mask; i++) {
+      val cell = vec[i];
+      if (cell)
+        hash_rh_place(nvec, nmask, cell);
+    }
+
+    h->table = ntable;
+    h->mask = nmask;
+    h->frozen = 1;
+
+    setcheck(hash, ntable);
+  }
+
+  return hash;
+}
+
+val hash_frozen_p(val hash)
+{
+  val self = lit("hash-frozen-p");
+  struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
+  return tnil(h->frozen);
+}
+
 val hashp(val obj)
 {
   return cobjclassp(obj, hash_cls);
@@ -1447,6 +1705,68 @@ val hash_equal(val obj, val seed)
                              if3(missingp(seed), 0, c_unum(seed, self))));
 }
 
+#if CONFIG_GEN_GC
+
+static int hash_entry_lapsed(hash_weak_opt_t wkopt, val entry)
+{
+  switch (wkopt) {
+  case hash_weak_keys:
+    return !gc_is_reachable(us_car(entry));
+  case hash_weak_vals:
+    return !gc_is_reachable(us_cdr(entry));
+  case hash_weak_and:
+    return !gc_is_reachable(us_car(entry)) && !gc_is_reachable(us_cdr(entry));
+  case hash_weak_or:
+    return !gc_is_reachable(us_car(entry)) || !gc_is_reachable(us_cdr(entry));
+  case hash_weak_none:
+  default:
+    return 0;
+  }
+}
+
+static ucnum hash_cell_slot(struct hash *h, val cell)
+{
+  val *vec = h->table->v.vec;
+  ucnum mask = h->mask, start = cell->ch.hash & mask, i = start;
+
+  do {
+    val entry = vec[i];
+
+    if (entry == cell)
+      return i;
+    if (entry == nil)
+      break;
+
+    i = (i + 1) & mask;
+  } while (i != start);
+
+  return UINT_PTR_MAX;
+}
+
+/*
+ * Weak processing of a tenured table in a generational gc: only the
+ * cells added since the last gc are examined. Cells which were since
+ * removed from the table are left to ordinary reachability.
+ */
+static void do_weak_dirty(struct hash *h)
+{
+  ucnum j;
+
+  for (j = 0; j < h->ndirty; j++) {
+    val entry = h->dirty[j];
+    ucnum i = hash_cell_slot(h, entry);
+
+    if (i != UINT_PTR_MAX && hash_entry_lapsed(h->wkopt, entry))
+      hash_remove(h, i);
+    else if (i != UINT_PTR_MAX)
+      gc_mark(entry);
+  }
+
+  h->ndirty = 0;
+}
+
+#endif
+
 /*
  * Called from garbage collector. Hash module must process all weak tables
  * that were visited during the marking phase, maintained in the list
@@ -1464,6 +1784,16 @@ static void do_weak_tables(void)
     val *vec = table->v.vec;
     ucnum mask = h->mask;
 
+#if CONFIG_GEN_GC
+    if (hash_minor_gc(h) && table->t.gen > 0) {
+      do_weak_dirty(h);
+      continue;
+    }
+
+    /* Every entry is examined below, including any dirty ones. */
+    h->ndirty = 0;
+#endif
+
     /* The table of a weak hash was spuriously reached by conservative GC;
        it's a waste of time doing weak processing, since all keys and
        values have been transitively marked as reachable; and so we
@@ -1595,6 +1925,11 @@ static void do_iters(void)
 
     {
       struct hash *h = coerce(struct hash *, hash->co.handle);
+#if CONFIG_GEN_GC
+      /* Likewise, a tenured hash visited only for its dirty cells. */
+      if (hash_minor_gc(h))
+        continue;
+#endif
       h->usecount++;
     }
   }
@@ -1606,6 +1941,9 @@ void hash_process_weak(void)
 {
   do_weak_tables();
   do_iters();
+#if CONFIG_GEN_GC
+  weak_epoch++;
+#endif
 }
 
 static val equal_based_p(val equal, val eql, val eq, val wkeys)
@@ -2111,9 +2449,11 @@ val hash_proper_subset(val hash1, val hash2)
 val hash_update(val hash, val fun)
 {
   val self = lit("hash-update");
+  struct hash *h = coerce(struct hash *, cobj_handle(self, hash, hash_cls));
   val cell;
   struct hash_iter hi;
 
+  hash_check_frozen(self, h, hash);
   hash_iter_init(&hi, hash, self);
 
   while ((cell = hash_iter_next(&hi)) != nil) {
@@ -2132,6 +2472,7 @@ val hash_update_1(val hash, val key, val fun, val init)
     val cons = gethash_e(self, hash, key);
     if (cons) {
       val data = us_cdr(cons);
+      hash_check_frozen(self, coerce(struct hash *, hash->co.handle), hash);
       us_rplacd(cons, funcall1(fun, data));
       return data;
     }
@@ -2295,6 +2636,8 @@ void hash_init(void)
   reg_fun(intern(lit("hash-userdata"), user_package), ghu);
   reg_fun(intern(lit("set-hash-userdata"), user_package),
           func_n2(set_hash_userdata));
+  reg_fun(intern(lit("freeze-hash"), user_package), func_n1(freeze_hash));
+  reg_fun(intern(lit("hash-frozen-p"), user_package), func_n1(hash_frozen_p));
   reg_fun(intern(lit("hashp"), user_package), func_n1(hashp));
   reg_fun(intern(lit("maphash"), user_package), func_n2(maphash));
   reg_fun(intern(lit("hash-eql"), user_package), func_n1(hash_eql));
@@ -67,6 +67,8 @@ val hash_count(val hash);
 val us_hash_count(val hash);
 val get_hash_userdata(val hash);
 val set_hash_userdata(val hash, val data);
+val freeze_hash(val hash);
+val hash_frozen_p(val hash);
 val hashp(val obj);
 val maphash(val func, val hash);
 void hash_iter_init(struct hash_iter *hi, val hash, val self);
@@ -106,7 +106,7 @@ val var_s, expr_s, regex_s, chset_s, set_s, cset_s, wild_s, oneplus_s;
 val nongreedy_s;
 val quote_s, qquote_s, unquote_s, splice_s;
 val sys_qquote_s, sys_unquote_s, sys_splice_s;
-val zeroplus_s, optional_s, compl_s, compound_s;
+val zeroplus_s, optional_s, compl_s, compound_s, rgroup_s;
 val or_s, and_s, quasi_s, quasilist_s;
 val skip_s, trailer_s, block_s, next_s, freeform_s, fail_s, accept_s;
 val all_s, some_s, none_s, maybe_s, cases_s, collect_s, until_s, coll_s;
@@ -14446,6 +14446,7 @@ static void obj_init(void)
   optional_s = intern(lit("?"), user_package);
   compl_s = intern(lit("~"), user_package);
   compound_s = intern(lit("compound"), user_package);
+  rgroup_s = intern(lit("group"), user_package);
   or_s = intern(lit("or"), user_package);
   and_s = intern(lit("and"), user_package);
   quasi_s = intern(lit("quasi"), system_package);
@@ -707,7 +707,7 @@ extern val var_s, expr_s, regex_s, chset_s, set_s, cset_s, wild_s, oneplus_s;
 extern val nongreedy_s;
 extern val quote_s, qquote_s, unquote_s, splice_s;
 extern val sys_qquote_s, sys_unquote_s, sys_splice_s;
-extern val zeroplus_s, optional_s, compl_s, compound_s;
+extern val zeroplus_s, optional_s, compl_s, compound_s, rgroup_s;
 extern val or_s, and_s, quasi_s, quasilist_s;
 extern val skip_s, trailer_s, block_s, next_s, freeform_s, fail_s, accept_s;
 extern val all_s, some_s, none_s, maybe_s, cases_s, collect_s, until_s, coll_s;
@@ -568,7 +568,7 @@ void open_txr_file(val first_try_path, val *txr_lisp_p,
       errno = 0;
 #if HAVE_ZLIB
       if (suffix == tlz)
-        zin = w_gzopen_mode(c_str(try_path, self), L"r", m_r, self);
+        zin = w_gzopen_mode(c_str(try_path, self), L"r", m_r, 0, self);
       else
 #endif
         in = w_fopen(c_str(try_path, self), L"r");
@@ -623,7 +623,7 @@ void open_txr_file(val first_try_path, val *txr_lisp_p,
       {
         try_path = scat(lit("."), first_try_path, lit("tlo.gz"), nao);
         errno = 0;
-        if ((zin = w_gzopen_mode(c_str(try_path, nil), L"r", m_r, self)) != 0) {
+        if ((zin = w_gzopen_mode(c_str(try_path, nil), L"r", m_r, 0, self)) != 0) {
           *txr_lisp_p = chr('o');
           goto found;
         }
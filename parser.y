@@ -1320,7 +1320,7 @@ regterm : regterm '*'           { $$ = list(zeroplus_s, $1, nao); }
         | REGCHAR               { $$ = chr($1); }
         | regtoken              { $$ = $1; }
         | TEXT                  { $$ = list(compound_s, string_own($1), nao); }
-        | '(' regexpr ')'       { $$ = $2; }
+        | '(' regexpr ')'       { $$ = regex_group($2); }
         | '(' error             { $$ = nil;
                                   yybadtok(yychar, lit("regex subexpression")); }
         ;
@@ -45,6 +45,9 @@
 #include "eval.h"
 #include "cadr.h"
 #include "itypes.h"
+#include "buf.h"
+#include "hash.h"
+#include "utf8.h"
 #include "regex.h"
 #include "txr.h"
 
@@ -53,6 +56,8 @@
 #endif
 
 typedef union nfa_state nfa_state_t;
+typedef union char_set char_set_t;
+typedef struct dfa dfa_t;
 
 typedef struct nfa {
   nfa_state_t *start;
@@ -68,6 +73,14 @@ typedef struct regex {
     val dv;
   } r;
   int nstates;
+  int ngroups;
+  dfa_t *dfa, *udfa;
+  wchar_t *lit;
+  char_set_t *first;
+  wchar_t first_ch;
+  val rev;
+  val cap;
+  val u8;
   val source;
 } regex_t;
 
@@ -146,16 +159,45 @@ typedef cset_L1_t *cset_L2_t[16];
 typedef cset_L2_t *cset_L3_t[17];
 #endif
 
+/*
+ * The contents of a character set as an ascending sequence of
+ * disjoint, non-adjacent ranges, obtained by walking its tries.
+ */
+struct cs_range {
+  wchar_t lo, hi;
+};
+
+struct cs_ranges {
+  struct cs_range *r;
+  int n, alloc;
+};
+
+/*
+ * Every character set carries a bitmap of its Latin-1 members, with
+ * the complement flag already applied, so that testing those
+ * characters takes a single bit test. The members above Latin-1 are
+ * also kept as a list of ranges, if there are few enough of them for
+ * a binary search to beat a walk through the tries; otherwise nrng
+ * is -1. Both are filled in by char_set_finish.
+ */
+#define CHAR_SET_MAX_RNG 16
+
 struct any_char_set {
   unsigned type : 3;
   unsigned comp : 1;
   unsigned stat : 1;
+  cset_L0_t lat1;
+  int nrng;
+  struct cs_range rng[CHAR_SET_MAX_RNG];
 };
 
 struct small_char_set {
   unsigned type : 3;
   unsigned comp : 1;
   unsigned stat : 1;
+  cset_L0_t lat1;
+  int nrng;
+  struct cs_range rng[CHAR_SET_MAX_RNG];
   cset_L0_t bitcell;
 };
 
@@ -163,6 +205,9 @@ struct displaced_char_set {
   unsigned type : 3;
   unsigned comp : 1;
   unsigned stat : 1;
+  cset_L0_t lat1;
+  int nrng;
+  struct cs_range rng[CHAR_SET_MAX_RNG];
   cset_L0_t bitcell;
   wchar_t base;
 };
@@ -172,6 +217,9 @@ struct large_char_set {
   unsigned type : 3;
   unsigned comp : 1;
   unsigned stat : 1;
+  cset_L0_t lat1;
+  int nrng;
+  struct cs_range rng[CHAR_SET_MAX_RNG];
   cset_L2_t dir;
 };
 
@@ -180,11 +228,14 @@ struct xlarge_char_set {
   unsigned type : 3;
   unsigned comp : 1;
   unsigned stat : 1;
+  cset_L0_t lat1;
+  int nrng;
+  struct cs_range rng[CHAR_SET_MAX_RNG];
   cset_L3_t dir;
 };
 #endif
 
-typedef union char_set {
+union char_set {
   struct any_char_set any;
   struct small_char_set s;
   struct displaced_char_set d;
@@ -192,10 +243,10 @@ typedef union char_set {
 #ifdef FULL_UNICODE
   struct xlarge_char_set xl;
 #endif
-} char_set_t;
+};
 
 typedef enum {
-  nfa_empty, nfa_accept, nfa_wild, nfa_single, nfa_set
+  nfa_empty, nfa_accept, nfa_wild, nfa_single, nfa_set, nfa_tag, nfa_save
 } nfa_kind_t;
 
 struct nfa_state_any {
@@ -224,11 +275,29 @@ struct nfa_state_set {
   char_set_t *set;
 };
 
+/*
+ * A tag state has no transitions. It stands in for the acceptance
+ * state of one member of a regex set, and since it isn't an empty
+ * state, it appears in the state sets of the simulation, and in
+ * those which identify DFA states.
+ *
+ * A save state, which uses the same representation, occurs only in the
+ * NFA which tracks capture groups. It is an empty transition which records
+ * the current input position in the capture slot given by tag.
+ */
+struct nfa_state_tag {
+  nfa_kind_t kind;
+  unsigned visited;
+  nfa_state_t *trans;
+  int tag;
+};
+
 union nfa_state {
   struct nfa_state_any a;
   struct nfa_state_empty e;
   struct nfa_state_single o;
   struct nfa_state_set s;
+  struct nfa_state_tag t;
 };
 
 #define nfa_accept_state_p(s) ((s)->a.kind == nfa_accept)
@@ -237,6 +306,53 @@ union nfa_state {
 #define nfa_has_transitions(s) ((s)->a.kind != nfa_empty && \
                                 ((s)->e.trans0 || (s)->e.trans1))
 
+/*
+ * Lazy DFA: a DFA state stands for a set of NFA states, together with
+ * the accept and more flags that the NFA simulation reports upon
+ * reaching that set. DFA states and their transitions are only
+ * created when the input calls for them, and are kept in a cache
+ * bounded by DFA_MAX_BYTES. Characters below 256 are mapped to
+ * equivalence classes which index the transition vector; one
+ * transition on a character outside of that range is memoized.
+ */
+#define DFA_MAX_BYTES (512 * 1024)
+#define DFA_MIN_PROGRESS 10
+
+/*
+ * Running total of the memory allocated to lazy DFAs, never decreased;
+ * the regex cache consults it to avoid measuring its entries when
+ * no automaton has grown.
+ */
+static ucnum dfa_growth;
+
+typedef struct dfa_state dfa_state_t;
+
+struct dfa_state {
+  dfa_state_t *next;
+  ucnum hash;
+  int accept, more;
+  int ntags;
+  int nset;
+  nfa_state_t **set;
+  wchar_t wch;
+  dfa_state_t *wtrans;
+  dfa_state_t **trans;
+};
+
+struct dfa {
+  unsigned char cls[256];
+  int nclasses;
+  int users;
+  int failed;
+  unsigned gen;
+  dfa_state_t *start;
+  dfa_state_t **table;
+  ucnum mask;
+  ucnum count;
+  ucnum bytes;
+  ucnum progress;
+};
+
 struct nfa_machine {
   int is_nfa;           /* common member */
   cnum last_accept_pos; /* common member */
@@ -246,6 +362,9 @@ struct nfa_machine {
   int nclos;
   nfa_t nfa;
   int nstates;
+  int unanchored;
+  dfa_t *dfa;
+  dfa_state_t *dstate;
 };
 
 struct dv_machine {
@@ -557,6 +676,7 @@ static char_set_t *char_set_create(chset_type_t type, wchar_t base, unsigned st)
   *cs = blank;
   cs->any.type = type;
   cs->any.stat = st;
+  cs->any.nrng = -1;
 
   if (type == CHSET_DISPLACED)
     cs->d.base = base;
@@ -622,7 +742,7 @@ static void char_set_add(char_set_t *set, wchar_t ch)
 
 static void char_set_add_range(char_set_t *set, wchar_t ch0, wchar_t ch1)
 {
-  if (ch0 >= ch1)
+  if (ch0 > ch1)
     return;
 
   switch (set->any.type) {
@@ -654,7 +774,7 @@ static void char_set_add_str(char_set_t *set, wchar_t *str)
     char_set_add(set, *str++);
 }
 
-static int char_set_contains(char_set_t *set, wchar_t ch)
+static int char_set_trie_contains(char_set_t *set, wchar_t ch)
 {
   int result = 0;
 
@@ -683,6 +803,192 @@ static int char_set_contains(char_set_t *set, wchar_t ch)
 #endif
   }
 
+  return result;
+}
+
+#ifdef FULL_UNICODE
+#define CHAR_SET_MAX 0x10FFFF
+#else
+#define CHAR_SET_MAX 0xFFFF
+#endif
+
+static void cs_ranges_add(struct cs_ranges *cr, wchar_t lo, wchar_t hi)
+{
+  if (cr->n > 0 && cr->r[cr->n - 1].hi + 1 == lo) {
+    cr->r[cr->n - 1].hi = hi;
+    return;
+  }
+
+  if (cr->n == cr->alloc) {
+    cr->alloc = cr->alloc * 2 + 8;
+    cr->r = coerce(struct cs_range *,
+                   chk_realloc(coerce(mem_t *, cr->r),
+                               cr->alloc * sizeof *cr->r));
+  }
+
+  cr->r[cr->n].lo = lo;
+  cr->r[cr->n++].hi = hi;
+}
+
+static void L0_ranges(cset_L0_t *L0, wchar_t base, struct cs_ranges *cr)
+{
+  int i;
+
+  for (i = 0; i < 256; i++)
+    if (L0_contains(L0, i))
+      cs_ranges_add(cr, base + i, base + i);
+}
+
+static void L1_ranges(cset_L1_t *L1, wchar_t base, struct cs_ranges *cr)
+{
+  int i1;
+
+  for (i1 = 0; i1 < 16; i1++) {
+    cset_L0_t *L0 = (*L1)[i1];
+    wchar_t b = base + (i1 << 8);
+
+    if (L0 == coerce(cset_L0_t *, -1))
+      cs_ranges_add(cr, b, b + 0xFF);
+    else if (L0 != 0)
+      L0_ranges(L0, b, cr);
+  }
+}
+
+static void L2_ranges(cset_L2_t *L2, wchar_t base, struct cs_ranges *cr)
+{
+  int i2;
+
+  for (i2 = 0; i2 < 16; i2++) {
+    cset_L1_t *L1 = (*L2)[i2];
+    wchar_t b = base + (i2 << 12);
+
+    if (L1 == coerce(cset_L1_t *, -1))
+      cs_ranges_add(cr, b, b + 0xFFF);
+    else if (L1 != 0)
+      L1_ranges(L1, b, cr);
+  }
+}
+
+#ifdef FULL_UNICODE
+static void L3_ranges(cset_L3_t *L3, struct cs_ranges *cr)
+{
+  int i3;
+
+  for (i3 = 0; i3 < 17; i3++) {
+    cset_L2_t *L2 = (*L3)[i3];
+    wchar_t b = i3 << 16;
+
+    if (L2 == coerce(cset_L2_t *, -1))
+      cs_ranges_add(cr, b, b + 0xFFFF);
+    else if (L2 != 0)
+      L2_ranges(L2, b, cr);
+  }
+}
+#endif
+
+static void char_set_pos_ranges(char_set_t *set, struct cs_ranges *out)
+{
+  switch (set->any.type) {
+  case CHSET_SMALL:
+    L0_ranges(&set->s.bitcell, 0, out);
+    break;
+  case CHSET_DISPLACED:
+    L0_ranges(&set->d.bitcell, set->d.base, out);
+    break;
+  case CHSET_LARGE:
+    L2_ranges(&set->l.dir, 0, out);
+    break;
+#ifdef FULL_UNICODE
+  case CHSET_XLARGE:
+    L3_ranges(&set->xl.dir, out);
+    break;
+#endif
+  }
+}
+
+static void char_set_ranges(char_set_t *set, struct cs_ranges *cr)
+{
+  struct cs_ranges pos = { 0, 0, 0 };
+
+  if (!set->any.comp) {
+    char_set_pos_ranges(set, cr);
+  } else {
+    wchar_t lo = 0;
+    int i;
+
+    char_set_pos_ranges(set, &pos);
+
+    for (i = 0; i < pos.n; i++) {
+      if (pos.r[i].lo > lo)
+        cs_ranges_add(cr, lo, pos.r[i].lo - 1);
+      lo = pos.r[i].hi + 1;
+    }
+
+    if (lo <= CHAR_SET_MAX)
+      cs_ranges_add(cr, lo, CHAR_SET_MAX);
+
+    free(pos.r);
+  }
+}
+
+/*
+ * Fill in the Latin-1 bitmap and the range list of a set whose
+ * contents are complete.
+ */
+static void char_set_finish(char_set_t *set)
+{
+  struct cs_ranges cr = { 0, 0, 0 };
+  int i, n = 0;
+
+  for (i = 0; i < 256; i++) {
+    if (char_set_trie_contains(set, i) != set->any.comp)
+      set->any.lat1[CHAR_SET_INDEX(i)] |= (convert(bitcell_t, 1)
+                                           << CHAR_SET_BIT(i));
+  }
+
+  char_set_pos_ranges(set, &cr);
+
+  for (i = 0; i < cr.n; i++) {
+    if (cr.r[i].hi < 256)
+      continue;
+    if (n == CHAR_SET_MAX_RNG) {
+      n = -1;
+      break;
+    }
+    set->any.rng[n].lo = if3(cr.r[i].lo < 256, 256, cr.r[i].lo);
+    set->any.rng[n++].hi = cr.r[i].hi;
+  }
+
+  set->any.nrng = n;
+  free(cr.r);
+}
+
+static int char_set_contains(char_set_t *set, wchar_t ch)
+{
+  int result = 0;
+
+  if (ch < 256)
+    return L0_contains(&set->any.lat1, ch);
+
+  if (set->any.nrng >= 0) {
+    int lo = 0, hi = set->any.nrng;
+
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+
+      if (ch < set->any.rng[mid].lo) {
+        hi = mid;
+      } else if (ch > set->any.rng[mid].hi) {
+        lo = mid + 1;
+      } else {
+        result = 1;
+        break;
+      }
+    }
+  } else {
+    result = char_set_trie_contains(set, ch);
+  }
+
   return set->any.comp ? !result : result;
 }
 
@@ -723,9 +1029,9 @@ static char_set_t *char_set_compile(val args, val comp)
         min = 0x9;
     } else if (item == digit_k) {
       if (max < '9')
-        max = 9;
+        max = '9';
       if (min > '0')
-        min = 0;
+        min = '0';
     } else if (item == word_char_k) {
       if (min > 'A')
         min = 'A';
@@ -783,6 +1089,7 @@ static char_set_t *char_set_compile(val args, val comp)
     if (comp)
       char_set_compl(set);
 
+    char_set_finish(set);
     return set;
   }
 }
@@ -815,6 +1122,13 @@ static void init_special_char_sets(void)
   char_set_add_range(cword_cs, 'a', 'z');
   char_set_add(word_cs, '_');
   char_set_add(cword_cs, '_');
+
+  char_set_finish(space_cs);
+  char_set_finish(cspace_cs);
+  char_set_finish(digit_cs);
+  char_set_finish(cdigit_cs);
+  char_set_finish(word_cs);
+  char_set_finish(cword_cs);
 }
 
 static void char_set_cobj_destroy(val chset)
@@ -882,6 +1196,26 @@ static void nfa_state_shallow_free(nfa_state_t *st)
   free(st);
 }
 
+static nfa_state_t *nfa_state_tag(int tag)
+{
+  nfa_state_t *st = coerce(nfa_state_t *, chk_malloc(sizeof *st));
+  st->t.kind = nfa_tag;
+  st->t.visited = 0;
+  st->t.trans = 0;
+  st->t.tag = tag;
+  return st;
+}
+
+static nfa_state_t *nfa_state_save(nfa_state_t *t, int slot)
+{
+  nfa_state_t *st = coerce(nfa_state_t *, chk_malloc(sizeof *st));
+  st->t.kind = nfa_save;
+  st->t.visited = 0;
+  st->t.trans = t;
+  st->t.tag = slot;
+  return st;
+}
+
 static nfa_state_t *nfa_state_set(nfa_state_t *t, char_set_t *cs)
 {
   nfa_state_t *st = coerce(nfa_state_t *, chk_malloc(sizeof *st));
@@ -1056,6 +1390,23 @@ static nfa_t nfa_compile_regex(val exp)
       nfa_t nfa_arg = nfa_compile_regex(first(args));
       nfa_state_t *s = nfa_state_empty(nfa_arg.start, nfa_arg.accept);
       return nfa_make(s, nfa_arg.accept);
+    } else if (sym == rgroup_s) {
+      /* Capture group, numbered by its second argument: the inner NFA
+         is bracketed by save states which record its extent. Unnumbered
+         groups are only grouping. */
+      nfa_t nfa_arg = nfa_compile_regex(first(args));
+      val num = second(args);
+
+      if (num && nfa_arg.start) {
+        int slot = 2 * c_int(num, nil);
+        nfa_state_t *acc = nfa_state_accept();
+        nfa_state_t *close = nfa_state_save(acc, slot + 1);
+        nfa_state_t *s = nfa_state_save(nfa_arg.start, slot);
+        nfa_state_empty_convert(nfa_arg.accept, close, 0);
+        return nfa_make(s, acc);
+      }
+
+      return nfa_arg;
     } else if (sym == or_s) {
       /* Simple: make a new start and acceptance state, which form
          the ends of a spindle that goes through two branches. */
@@ -1105,6 +1456,8 @@ static void nfa_map_states(nfa_state_t *s,
     case nfa_wild:
     case nfa_single:
     case nfa_set:
+    case nfa_tag:
+    case nfa_save:
       nfa_map_states(s->o.trans, ctx, fun, visited);
       break;
     }
@@ -1149,9 +1502,14 @@ static void nfa_free(nfa_t nfa, int nstates)
 {
   nfa_state_t **all = coerce(nfa_state_t **, alloca(nstates * sizeof *all));
   nfa_state_t **pelem = all, *s = nfa.start;
-  unsigned visited = s->a.visited + 1;
+  unsigned visited;
   int i;
 
+  if (!s)
+    return;
+
+  visited = s->a.visited + 1;
+
   /* We don't care if visited has reached UINT_MAX here, because the regex is
    * going away, so we don't bother with nfa_handle_wraparound.
    */
@@ -1192,6 +1550,8 @@ static void nfa_thread_epsilons(nfa_state_t **ps, unsigned visited)
   case nfa_single:
   case nfa_wild:
   case nfa_set:
+  case nfa_tag:
+  case nfa_save:
     ps0 = &s->o.trans;
     break;
   }
@@ -1212,12 +1572,12 @@ static void nfa_fold_accept(nfa_state_t *s, mem_t *ctx)
     nfa_state_t *e0 = s->e.trans0;
     nfa_state_t *e1 = s->e.trans1;
 
-    if (e0 && nfa_accept_state_p(e0)) {
+    if (e0 && nfa_accept_state_p(e0) && !nfa_has_transitions(e0)) {
       s->a.kind = nfa_accept;
       s->e.trans0 = 0;
     }
 
-    if (e1 && nfa_accept_state_p(e1)) {
+    if (e1 && nfa_accept_state_p(e1) && !nfa_has_transitions(e1)) {
       s->a.kind = nfa_accept;
       s->e.trans1 = 0;
     }
@@ -1421,7 +1781,7 @@ static int nfa_move_closure(nfa_state_t **stack, nfa_state_t **set, int nin,
           set[nout++] = e1;
         if (nfa_accept_state_p(e1))
           *accept = 1;
-        if (!moreset && nfa_has_transitions(e0))
+        if (!moreset && nfa_has_transitions(e1))
           *more = 1;
       }
     }
@@ -1494,111 +1854,505 @@ static cnum nfa_run(nfa_t nfa, int nstates, const wchar_t *str)
   return last_accept_pos ? last_accept_pos - str : -1;
 }
 
-static cnum regex_machine_match_span(regex_machine_t *regm)
-{
-  return regm->n.last_accept_pos;
-}
-
-static void regex_destroy(val obj)
-{
-  regex_t *regex = coerce(regex_t *, obj->co.handle);
-  if (regex->kind == REGEX_NFA)
-    nfa_free(regex->r.nfa, regex->nstates);
-  free(regex);
-  obj->co.handle = 0;
-}
+/*
+ * Unanchored leftmost-longest search by NFA simulation, in which every
+ * thread carries the position where it started. Threads are kept in
+ * order of starting position, and a state reached by more than one
+ * thread belongs to the one which started earliest. A new thread is
+ * started at every position until a match is found. Then threads which
+ * started after the match are dropped, and the simulation carries on until
+ * the remaining threads die, in order to find the leftmost, longest match.
+ * The tag states of a regex set's NFA count as acceptance, the lowest
+ * tag among equal matches being kept; empty matches can be excluded.
+ */
+struct nfa_search {
+  nfa_state_t *start;
+  int nstates;
+  unsigned visited;
+  int nclos;
+  nfa_state_t **set, **nset, **stack, **sets;
+  cnum *beg, *nbeg, *begs;
+  cnum pos;
+  cnum match_beg, match_end, match_tag;
+  int nonempty;
+};
 
-static void regex_mark(val obj)
+static int nfa_search_add(struct nfa_search *ns, nfa_state_t **set, cnum *beg,
+                          int nout, nfa_state_t *s, cnum b)
 {
-  regex_t *regex = coerce(regex_t *, obj->co.handle);
-  if (regex->kind == REGEX_DV)
-    gc_mark(regex->r.dv);
-  gc_mark(regex->source);
-}
-
-static void regex_print(val obj, val stream, val pretty, struct strm_ctx *);
+  nfa_state_t **stack = ns->stack;
+  int stackp = 0;
 
-static struct cobj_ops regex_obj_ops = cobj_ops_init(eq,
-                                                     regex_print,
-                                                     regex_destroy,
-                                                     regex_mark,
-                                                     cobj_eq_hash_op,
-                                                     0);
+  if (!nfa_test_set_visited(s, ns->visited))
+    return nout;
 
-static val reg_nullable(val);
+  stack[stackp++] = s;
 
-static val reg_expand_nongreedy(val exp)
-{
-  if (atom(exp)) {
-    return exp;
-  } else if (consp(exp)) {
-    val sym = first(exp);
-    val args = rest(exp);
+  while (stackp) {
+    nfa_state_t *top = stack[--stackp];
 
-    if (sym == set_s || sym == cset_s) {
-      return exp;
-    } else if (sym == compound_s || sym == zeroplus_s || sym == oneplus_s ||
-               sym == optional_s || sym == compl_s ||
-               sym == or_s || sym == and_s)
+    if ((nfa_accept_state_p(top) || top->a.kind == nfa_tag) &&
+        (!ns->nonempty || b < ns->pos))
     {
-      list_collect_decl (out, iter);
-      iter = list_collect(iter, sym);
-      for (; args; args = cdr(args))
-        iter = list_collect(iter, reg_expand_nongreedy(first(args)));
-      return out;
-    } else if (sym == nongreedy_s) {
-      val xfirst = reg_expand_nongreedy(first(args));
-      val xsecond = reg_expand_nongreedy(second(args));
-      val zplus = cons(zeroplus_s, cons(xfirst, nil));
+      cnum tag = if3(top->a.kind == nfa_tag, top->t.tag, -1);
+
+      if (ns->match_beg < 0 || b < ns->match_beg) {
+        ns->match_beg = b;
+        ns->match_end = ns->pos;
+        ns->match_tag = tag;
+      } else if (b == ns->match_beg && ns->pos > ns->match_end) {
+        ns->match_end = ns->pos;
+        ns->match_tag = tag;
+      } else if (b == ns->match_beg && ns->pos == ns->match_end &&
+                 tag < ns->match_tag)
+      {
+        ns->match_tag = tag;
+      }
+    }
 
-      if (xsecond == nil) {
-        return zplus;
-      } else {
-        val any = list(zeroplus_s, wild_s, nao);
-        val notempty = list(oneplus_s, wild_s, nao);
+    if (nfa_empty_state_p(top)) {
+      nfa_state_t *e0 = top->e.trans0;
+      nfa_state_t *e1 = top->e.trans1;
 
-        return list(compound_s,
-                    list(and_s,
-                         zplus,
-                         list(compl_s,
-                              list(compound_s,
-                                   any,
-                                   if3(reg_nullable(xsecond),
-                                       list(and_s, xsecond, notempty, nao),
-                                       xsecond),
-                                   any, nao),
-                              nao),
-                         nao),
-                    xsecond, nao);
-      }
+      if (nfa_test_set_visited(e1, ns->visited))
+        stack[stackp++] = e1;
+      if (nfa_test_set_visited(e0, ns->visited))
+        stack[stackp++] = e0;
     } else {
-      uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
+      bug_unless (nout < ns->nstates);
+      set[nout] = top;
+      beg[nout++] = b;
     }
-  } else {
-    uw_throwf(error_s, lit("bad object in regex syntax: ~s"), exp, nao);
   }
-}
 
-static val reg_nary_to_bin(val regex);
+  return nout;
+}
 
-static val reg_nary_unfold(val sym, val args, val orig)
-{
-  if (atom(args)) {
-    return t; /* Nullary intersection and union are both empty. */
-  } else if (!cdr(args)) {
-    return reg_nary_to_bin(car(args));
-  } else if (!cddr(args)) {
-    val rx1 = pop(&args);
-    val rx2 = pop(&args);
-    val newrx1 = reg_nary_to_bin(rx1);
-    val newrx2 = reg_nary_to_bin(rx2);
-    if (!orig || rx1 != newrx1 || rx2 != newrx2)
-      return list(sym, newrx1, newrx2, nao);
-    return orig;
-  } else {
-    return list(sym,
-                reg_nary_to_bin(car(args)),
-                reg_nary_unfold(sym, cdr(args), nil), nao);
+static void nfa_search_init(struct nfa_search *ns, regex_t *regex, cnum pos,
+                            int nonempty)
+{
+  int nstates = regex->nstates;
+  nfa_state_t **sets = coerce(nfa_state_t **,
+                              chk_malloc(3 * nstates * sizeof *sets));
+  cnum *begs = coerce(cnum *, chk_malloc(2 * nstates * sizeof *begs));
+
+  ns->start = regex->r.nfa.start;
+  ns->nstates = nstates;
+  ns->sets = sets;
+  ns->begs = begs;
+  ns->set = sets;
+  ns->nset = sets + nstates;
+  ns->stack = sets + 2 * nstates;
+  ns->beg = begs;
+  ns->nbeg = begs + nstates;
+  ns->pos = pos;
+  ns->match_beg = ns->match_end = ns->match_tag = -1;
+  ns->nonempty = nonempty;
+  ns->nclos = 0;
+
+  if (ns->start) {
+    ns->visited = ns->start->a.visited + 1;
+    nfa_handle_wraparound(ns->start, &ns->visited);
+    ns->nclos = nfa_search_add(ns, ns->set, ns->beg, 0, ns->start, pos);
+    ns->start->a.visited = ns->visited;
+  }
+}
+
+static void nfa_search_cleanup(struct nfa_search *ns)
+{
+  free(ns->sets);
+  free(ns->begs);
+  ns->sets = ns->set = ns->nset = ns->stack = 0;
+  ns->begs = ns->beg = ns->nbeg = 0;
+}
+
+/*
+ * True if the search is concluded: no more input
+ * can change the outcome.
+ */
+static int nfa_search_done(struct nfa_search *ns)
+{
+  return ns->start == 0 || (ns->nclos == 0 && ns->match_beg >= 0);
+}
+
+/*
+ * True if no match has been found, and the only threads are those which
+ * have just started at the current position.
+ */
+static int nfa_search_idle(struct nfa_search *ns)
+{
+  return ns->match_beg < 0 && (ns->nclos == 0 || ns->beg[0] == ns->pos);
+}
+
+/*
+ * Move an idle search ahead to a new position; the threads which
+ * started at the current position are relabeled.
+ */
+static void nfa_search_skip(struct nfa_search *ns, cnum pos)
+{
+  int i;
+
+  for (i = 0; i < ns->nclos; i++)
+    ns->beg[i] = pos;
+
+  ns->pos = pos;
+}
+
+static void nfa_search_feed(struct nfa_search *ns, wchar_t ch)
+{
+  nfa_state_t **set = ns->set, **nset = ns->nset;
+  cnum *beg = ns->beg, *nbeg = ns->nbeg;
+  int i, nout = 0;
+
+  ns->visited = ns->start->a.visited + 1;
+  nfa_handle_wraparound(ns->start, &ns->visited);
+  ns->pos++;
+
+  for (i = 0; i < ns->nclos; i++) {
+    nfa_state_t *s = set[i];
+    cnum b = beg[i];
+
+    if (ns->match_beg >= 0 && b > ns->match_beg)
+      break;
+
+    switch (s->a.kind) {
+    case nfa_wild:
+      break;
+    case nfa_single:
+      if (s->o.ch == ch)
+        break;
+      continue;
+    case nfa_set:
+      if (char_set_contains(s->s.set, ch))
+        break;
+      continue;
+    default:
+      continue;
+    }
+
+    nout = nfa_search_add(ns, nset, nbeg, nout, s->o.trans, b);
+  }
+
+  if (ns->match_beg < 0)
+    nout = nfa_search_add(ns, nset, nbeg, nout, ns->start, ns->pos);
+
+  ns->start->a.visited = ns->visited;
+
+  ns->set = nset;
+  ns->nset = set;
+  ns->beg = nbeg;
+  ns->nbeg = beg;
+  ns->nclos = nout;
+}
+
+struct dfa_class_ctx {
+  unsigned char *cls;
+  int nclasses;
+};
+
+static void dfa_refine_classes(nfa_state_t *s, mem_t *ctx)
+{
+  struct dfa_class_ctx *cc = coerce(struct dfa_class_ctx *, ctx);
+  short remap[256][2];
+  int nnew = 0, i;
+
+  if (s->a.kind != nfa_single && s->a.kind != nfa_set)
+    return;
+
+  for (i = 0; i < cc->nclasses; i++)
+    remap[i][0] = remap[i][1] = -1;
+
+  for (i = 0; i < 256; i++) {
+    int m = if3(s->a.kind == nfa_single,
+                s->o.ch == i,
+                char_set_contains(s->s.set, i));
+    int k = cc->cls[i];
+
+    if (remap[k][m] < 0)
+      remap[k][m] = nnew++;
+    cc->cls[i] = remap[k][m];
+  }
+
+  cc->nclasses = nnew;
+}
+
+static int dfa_set_cmp(const void *lp, const void *rp)
+{
+  uint_ptr_t l = coerce(uint_ptr_t, *coerce(nfa_state_t * const *, lp));
+  uint_ptr_t r = coerce(uint_ptr_t, *coerce(nfa_state_t * const *, rp));
+  return (l > r) - (l < r);
+}
+
+static void dfa_flush(dfa_t *dfa)
+{
+  ucnum i;
+
+  for (i = 0; i <= dfa->mask; i++) {
+    dfa_state_t *ds = dfa->table[i], *next;
+
+    for (; ds; ds = next) {
+      next = ds->next;
+      free(ds);
+    }
+
+    dfa->table[i] = 0;
+  }
+
+  dfa->start = 0;
+  dfa->gen++;
+  dfa->count = 0;
+  dfa->bytes = 0;
+  dfa->progress = 0;
+}
+
+static void dfa_free(dfa_t *dfa)
+{
+  if (dfa) {
+    dfa_flush(dfa);
+    free(dfa->table);
+    free(dfa);
+  }
+}
+
+static void dfa_grow(dfa_t *dfa)
+{
+  ucnum nmask = 2 * dfa->mask + 1, i;
+  dfa_state_t **ntable = coerce(dfa_state_t **,
+                                chk_calloc(nmask + 1, sizeof *ntable));
+
+  for (i = 0; i <= dfa->mask; i++) {
+    dfa_state_t *ds = dfa->table[i], *next;
+
+    for (; ds; ds = next) {
+      next = ds->next;
+      ds->next = ntable[ds->hash & nmask];
+      ntable[ds->hash & nmask] = ds;
+    }
+  }
+
+  free(dfa->table);
+  dfa->table = ntable;
+  dfa_growth += (nmask - dfa->mask) * sizeof *ntable;
+  dfa->mask = nmask;
+}
+
+/*
+ * Find or create the DFA state for the given NFA state set, which
+ * gets sorted. Returns null if the state cannot be cached, in which
+ * case the caller must carry on with NFA simulation.
+ * The cache is flushed when it is full, unless there are other users
+ * which may be holding DFA states. If flushes happen too often,
+ * relative to the number of characters processed, the DFA is marked
+ * as failed, and its regex reverts to NFA simulation.
+ */
+static dfa_state_t *dfa_intern(dfa_t *dfa, nfa_state_t **set, int nset,
+                               int accept, int more)
+{
+  ucnum hash = accept + 2 * more, size;
+  dfa_state_t *ds;
+  int i;
+
+  if (dfa->failed)
+    return 0;
+
+  qsort(set, nset, sizeof *set, dfa_set_cmp);
+
+  for (i = 0; i < nset; i++)
+    hash = hash * 31 + (coerce(uint_ptr_t, set[i]) >> 4);
+
+  for (ds = dfa->table[hash & dfa->mask]; ds; ds = ds->next) {
+    if (ds->hash == hash && ds->nset == nset &&
+        ds->accept == accept && ds->more == more &&
+        memcmp(ds->set, set, nset * sizeof *set) == 0)
+      return ds;
+  }
+
+  size = sizeof *ds + dfa->nclasses * sizeof *ds->trans + nset * sizeof *set;
+
+  if (dfa->bytes + size > DFA_MAX_BYTES) {
+    if (dfa->users > 1)
+      return 0;
+    if (dfa->progress < DFA_MIN_PROGRESS * dfa->count)
+      dfa->failed = 1;
+    dfa_flush(dfa);
+    if (dfa->failed)
+      return 0;
+  }
+
+  ds = coerce(dfa_state_t *, chk_calloc(1, size));
+  ds->trans = coerce(dfa_state_t **, ds + 1);
+  ds->set = coerce(nfa_state_t **, ds->trans + dfa->nclasses);
+  ds->hash = hash;
+  ds->accept = accept;
+  ds->more = more;
+  ds->nset = nset;
+  memcpy(ds->set, set, nset * sizeof *set);
+
+  for (i = 0; i < nset; i++)
+    if (set[i]->a.kind == nfa_tag)
+      ds->ntags++;
+
+  ds->next = dfa->table[hash & dfa->mask];
+  dfa->table[hash & dfa->mask] = ds;
+  dfa->bytes += size;
+  dfa_growth += size;
+
+  if (++dfa->count > dfa->mask)
+    dfa_grow(dfa);
+
+  return ds;
+}
+
+static dfa_t *regex_dfa(regex_t *regex, int unanchored)
+{
+  dfa_t **pdfa = if3(unanchored, &regex->udfa, &regex->dfa);
+  dfa_t *dfa = *pdfa;
+
+  if (!dfa) {
+    nfa_state_t *start = regex->r.nfa.start;
+    struct dfa_class_ctx cc;
+
+    if (!start)
+      return 0;
+
+    dfa = coerce(dfa_t *, chk_calloc(1, sizeof *dfa));
+    dfa->mask = 15;
+    dfa->table = coerce(dfa_state_t **,
+                        chk_calloc(dfa->mask + 1, sizeof *dfa->table));
+
+    cc.cls = dfa->cls;
+    cc.nclasses = 1;
+    nfa_map_states(start, coerce(mem_t *, &cc), dfa_refine_classes,
+                   start->a.visited + 1);
+    dfa->nclasses = cc.nclasses;
+    dfa_growth += sizeof *dfa + (dfa->mask + 1) * sizeof *dfa->table;
+
+    *pdfa = dfa;
+  }
+
+  return if3(dfa->failed, 0, dfa);
+}
+
+static cnum regex_machine_match_span(regex_machine_t *regm)
+{
+  return regm->n.last_accept_pos;
+}
+
+static void regex_destroy(val obj)
+{
+  regex_t *regex = coerce(regex_t *, obj->co.handle);
+  if (regex->kind == REGEX_NFA) {
+    nfa_free(regex->r.nfa, regex->nstates);
+    dfa_free(regex->dfa);
+    dfa_free(regex->udfa);
+    char_set_destroy(regex->first, 1);
+    free(regex->lit);
+  }
+  free(regex);
+  obj->co.handle = 0;
+}
+
+static void regex_mark(val obj)
+{
+  regex_t *regex = coerce(regex_t *, obj->co.handle);
+  if (regex->kind == REGEX_DV)
+    gc_mark(regex->r.dv);
+  gc_mark(regex->rev);
+  gc_mark(regex->cap);
+  gc_mark(regex->u8);
+  gc_mark(regex->source);
+}
+
+static void regex_print(val obj, val stream, val pretty, struct strm_ctx *);
+
+static struct cobj_ops regex_obj_ops = cobj_ops_init(eq,
+                                                     regex_print,
+                                                     regex_destroy,
+                                                     regex_mark,
+                                                     cobj_eq_hash_op,
+                                                     0);
+
+static val reg_nullable(val);
+static val reg_ungroup(val);
+
+/*
+ * Expand nongreedy operators into and/compl syntax. Capture groups,
+ * if present, are retained, except in the complemented look-ahead
+ * copy of the right operand, which doesn't capture anything.
+ */
+static val reg_expand_nongreedy(val exp)
+{
+  if (atom(exp)) {
+    return exp;
+  } else if (consp(exp)) {
+    val sym = first(exp);
+    val args = rest(exp);
+
+    if (sym == set_s || sym == cset_s) {
+      return exp;
+    } else if (sym == compound_s || sym == zeroplus_s || sym == oneplus_s ||
+               sym == optional_s || sym == compl_s ||
+               sym == or_s || sym == and_s || sym == rgroup_s)
+    {
+      list_collect_decl (out, iter);
+      iter = list_collect(iter, sym);
+      for (; args; args = cdr(args))
+        iter = list_collect(iter, reg_expand_nongreedy(first(args)));
+      return out;
+    } else if (sym == nongreedy_s) {
+      val xfirst = reg_expand_nongreedy(first(args));
+      val xsecond = reg_expand_nongreedy(second(args));
+      val zplus = cons(zeroplus_s, cons(xfirst, nil));
+
+      if (xsecond == nil) {
+        return zplus;
+      } else {
+        val any = list(zeroplus_s, wild_s, nao);
+        val notempty = list(oneplus_s, wild_s, nao);
+        val look = reg_ungroup(xsecond);
+
+        return list(compound_s,
+                    list(and_s,
+                         zplus,
+                         list(compl_s,
+                              list(compound_s,
+                                   any,
+                                   if3(reg_nullable(look),
+                                       list(and_s, look, notempty, nao),
+                                       look),
+                                   any, nao),
+                              nao),
+                         nao),
+                    xsecond, nao);
+      }
+    } else {
+      uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
+    }
+  } else {
+    uw_throwf(error_s, lit("bad object in regex syntax: ~s"), exp, nao);
+  }
+}
+
+static val reg_nary_to_bin(val regex);
+
+static val reg_nary_unfold(val sym, val args, val orig)
+{
+  if (atom(args)) {
+    return t; /* Nullary intersection and union are both empty. */
+  } else if (!cdr(args)) {
+    return reg_nary_to_bin(car(args));
+  } else if (!cddr(args)) {
+    val rx1 = pop(&args);
+    val rx2 = pop(&args);
+    val newrx1 = reg_nary_to_bin(rx1);
+    val newrx2 = reg_nary_to_bin(rx2);
+    if (!orig || rx1 != newrx1 || rx2 != newrx2)
+      return list(sym, newrx1, newrx2, nao);
+    return orig;
+  } else {
+    return list(sym,
+                reg_nary_to_bin(car(args)),
+                reg_nary_unfold(sym, cdr(args), nil), nao);
   }
 }
 
@@ -1613,7 +2367,8 @@ static val reg_nary_to_bin(val regex)
     if (sym == or_s || sym == and_s) {
       return reg_nary_unfold(sym, args, regex);
     } else if (sym == compound_s || sym == zeroplus_s || sym == oneplus_s ||
-               sym == optional_s || sym == compl_s || sym == nongreedy_s)
+               sym == optional_s || sym == compl_s || sym == nongreedy_s ||
+               sym == rgroup_s)
     {
      list_collect_decl (out, ptail);
       val args_orig = args;
@@ -1724,6 +2479,8 @@ static val reg_nullable(val exp)
       return if2((reg_nullable(first(args)) || reg_nullable(second(args))), t);
     } else if (sym == and_s) {
       return if2((reg_nullable(first(args)) && reg_nullable(second(args))), t);
+    } else if (sym == rgroup_s) {
+      return reg_nullable(first(args));
     } else {
       uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
     }
@@ -1765,6 +2522,8 @@ static val reg_matches_all(val exp)
       return tnil(reg_matches_all(pop(&args)) || reg_matches_all(pop(&args)));
     } else if (sym == and_s) {
       return tnil(reg_matches_all(pop(&args)) && reg_matches_all(pop(&args)));
+    } else if (sym == rgroup_s) {
+      return nil;
     } else {
       uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
     }
@@ -1961,6 +2720,8 @@ static cnum dv_run(val regex, const wchar_t *str)
 
     if (deriv == t)
       return last_accept_pos ? last_accept_pos - str : -1;
+
+    regex = deriv;
   }
 
   if (reg_nullable(regex))
@@ -1990,6 +2751,53 @@ static val reg_compl_char_p(val exp)
   return nil;
 }
 
+/*
+ * Is exp a character, or a set made only of characters?
+ */
+static val reg_char_list_p(val exp)
+{
+  if (chrp(exp))
+    return t;
+  if (consp(exp) && car(exp) == set_s) {
+    val iter;
+    for (iter = rest(exp); iter; iter = cdr(iter))
+      if (!chrp(car(iter)))
+        return nil;
+    return t;
+  }
+  return nil;
+}
+
+/*
+ * Does the single-character regex exp match the character ch?
+ */
+static val reg_single_char_match(val exp, val ch)
+{
+  wchar_t c = c_chr(ch);
+
+  if (chrp(exp))
+    return tnil(exp == ch);
+  if (exp == space_k)
+    return tnil(char_set_contains(space_cs, c));
+  if (exp == cspace_k)
+    return tnil(char_set_contains(cspace_cs, c));
+  if (exp == word_char_k)
+    return tnil(char_set_contains(word_cs, c));
+  if (exp == cword_char_k)
+    return tnil(char_set_contains(cword_cs, c));
+  if (exp == digit_k)
+    return tnil(char_set_contains(digit_cs, c));
+  if (exp == cdigit_k)
+    return tnil(char_set_contains(cdigit_cs, c));
+
+  {
+    char_set_t *set = char_set_compile(rest(exp), tnil(car(exp) == cset_s));
+    int in = char_set_contains(set, c);
+    char_set_destroy(set, 1);
+    return tnil(in);
+  }
+}
+
 static val reg_optimize(val exp);
 
 static val invert_single(val exp)
@@ -2056,6 +2864,8 @@ static val reg_optimize(val exp)
       return cons(sym, xargs);
     } else if (sym == zeroplus_s) {
       val arg = reg_optimize(first(args));
+      if (arg == t)
+        return nil;
       if (consp(arg)) {
         val arg2 = first(arg);
         if (arg2 == zeroplus_s)
@@ -2070,6 +2880,8 @@ static val reg_optimize(val exp)
       val arg = reg_optimize(first(args));
       if (reg_matches_all(arg))
         return cons(zeroplus_s, cons(wild_s, nil));
+      if (arg == t)
+        return t;
       if (consp(arg)) {
         val arg2 = first(arg);
         if (arg2 == zeroplus_s || arg2 == oneplus_s)
@@ -2082,6 +2894,8 @@ static val reg_optimize(val exp)
       val arg = reg_optimize(first(args));
       if (reg_matches_all(arg))
         return arg;
+      if (arg == t)
+        return nil;
       if (consp(arg)) {
         val arg2 = first(arg);
         if (arg2 == zeroplus_s || arg2 == optional_s)
@@ -2208,7 +3022,35 @@ static val reg_optimize(val exp)
       if (reg_matches_all(arg2))
         return arg2;
 
+      if (consp(arg1) && car(arg1) == zeroplus_s &&
+          consp(arg2) && car(arg2) == zeroplus_s)
+      {
+        val s1 = second(arg1), s2 = second(arg2);
+
+        if (reg_char_list_p(s2) && reg_single_char_p(s1)) {
+          val tmp = s1;
+          s1 = s2;
+          s2 = tmp;
+        }
+
+        if (reg_char_list_p(s1) && reg_single_char_p(s2)) {
+          list_collect_decl (out, ptail);
+          val chars = if3(chrp(s1), cons(s1, nil), rest(s1));
+
+          for (; chars; chars = cdr(chars))
+            if (reg_single_char_match(s2, car(chars)))
+              ptail = list_collect(ptail, car(chars));
+
+          return reg_optimize(list(zeroplus_s, cons(set_s, out), nao));
+        }
+      }
+
       return cons(sym, cons(arg1, cons(arg2, nil)));
+    } else if (sym == rgroup_s) {
+      val arg = reg_optimize(first(args));
+      if (arg == t)
+        return t;
+      return cons(sym, cons(arg, rest(args)));
     } else {
       uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
     }
@@ -2237,146 +3079,820 @@ static val regex_requires_dv(val exp)
                  regex_requires_dv(second(args)), t);
     } else if (sym == and_s || sym == nongreedy_s) {
       return t;
+    } else if (sym == rgroup_s) {
+      return regex_requires_dv(first(args));
     } else {
       uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
     }
   }
 }
 
+/*
+ * Remove capture groups from regex syntax, leaving their contents.
+ */
+static val reg_ungroup(val exp)
+{
+  if (atom(exp)) {
+    return exp;
+  } else {
+    val sym = first(exp), args = rest(exp);
+
+    if (sym == set_s || sym == cset_s) {
+      return exp;
+    } else if (sym == rgroup_s) {
+      return reg_ungroup(first(args));
+    } else {
+      list_collect_decl (out, ptail);
+      ptail = list_collect(ptail, sym);
+      for (; args; args = cdr(args))
+        ptail = list_collect(ptail, reg_ungroup(car(args)));
+      return out;
+    }
+  }
+}
+
+/*
+ * Number the capture groups of regex syntax in the order of their
+ * opening parentheses, starting at 1; each (group x) becomes
+ * (group x n).
+ */
+static val reg_number_groups(val exp, int *count)
+{
+  if (atom(exp)) {
+    return exp;
+  } else {
+    val sym = first(exp), args = rest(exp);
+
+    if (sym == set_s || sym == cset_s) {
+      return exp;
+    } else if (sym == rgroup_s) {
+      val n = num((*count)++);
+      return list(sym, reg_number_groups(first(args), count), n, nao);
+    } else {
+      list_collect_decl (out, ptail);
+      ptail = list_collect(ptail, sym);
+      for (; args; args = cdr(args))
+        ptail = list_collect(ptail, reg_number_groups(car(args), count));
+      return out;
+    }
+  }
+}
+
 static val regex_optimize(val regex_sexp)
 {
-  return reg_optimize(reg_expand_nongreedy(reg_nary_to_bin(regex_sexp)));
+  val exp = reg_ungroup(reg_nary_to_bin(regex_sexp));
+  return reg_optimize(reg_expand_nongreedy(exp));
 }
 
-val regex_compile(val regex_sexp, val error_stream)
+/*
+ * Calculate the set of characters which can begin a match of exp,
+ * as a list of character set items, or else t if the set cannot
+ * be represented that way.
+ */
+static val reg_first(val exp)
 {
-  val regex_source;
+  if (nilp(exp) || exp == t) {
+    return nil;
+  } else if (chrp(exp)) {
+    return cons(exp, nil);
+  } else if (stringp(exp)) {
+    return if2(length_str_gt(exp, zero), cons(chr_str(exp, zero), nil));
+  } else if (exp == space_k || exp == digit_k || exp == word_char_k) {
+    return cons(exp, nil);
+  } else if (atom(exp)) {
+    return t;
+  } else {
+    val sym = first(exp), args = rest(exp);
 
-  if (stringp(regex_sexp)) {
-    regex_sexp = regex_parse(regex_sexp, error_stream);
-    return if2(regex_sexp, regex_compile(regex_sexp, error_stream));
+    if (sym == set_s) {
+      return args;
+    } else if (sym == compound_s) {
+      val out = nil;
+
+      for (; args; args = cdr(args)) {
+        val fa = reg_first(car(args));
+        if (fa == t)
+          return t;
+        out = append2(out, fa);
+        if (!reg_nullable(car(args)))
+          break;
+      }
+
+      return out;
+    } else if (sym == zeroplus_s || sym == oneplus_s || sym == optional_s) {
+      return reg_first(first(args));
+    } else if (sym == or_s) {
+      val f0 = reg_first(first(args));
+      val f1 = reg_first(second(args));
+      return if3(f0 == t || f1 == t, t, append2(f0, f1));
+    } else {
+      return t;
+    }
   }
+}
 
-  regex_source = reg_nary_to_bin(regex_sexp);
+/*
+ * Find the longest literal string which occurs in every match of exp,
+ * or else nil.
+ */
+static val reg_required_lit(val exp)
+{
+  if (chrp(exp)) {
+    return mkstring(one, exp);
+  } else if (stringp(exp)) {
+    return if2(length_str_gt(exp, zero), exp);
+  } else if (consp(exp)) {
+    val sym = first(exp), args = rest(exp);
 
-  regex_sexp = reg_optimize(reg_expand_nongreedy(regex_source));
+    if (sym == compound_s) {
+      val best = nil, run = nil;
 
-  if (opt_derivative_regex || regex_requires_dv(regex_sexp)) {
-    regex_t *regex = coerce(regex_t *, chk_malloc(sizeof *regex));
-    val ret;
-    val dv = reg_compile_csets(regex_sexp);
-    regex->kind = REGEX_DV;
-    regex->nstates = 0;
-    regex->source = nil;
-    ret = cobj(coerce(mem_t *, regex), regex_cls, &regex_obj_ops);
-    regex->r.dv = dv;
-    regex->source = regex_source;
-    return ret;
+      for (;; args = cdr(args)) {
+        val arg = car(args);
+
+        if (args && (chrp(arg) || stringp(arg))) {
+          run = if3(run, cat_str(list(run, arg, nao), nil),
+                    if3(chrp(arg), mkstring(one, arg), arg));
+        } else {
+          val req = if2(args, reg_required_lit(arg));
+          if (run && (!best || length_str_gt(run, length_str(best))))
+            best = run;
+          if (req && (!best || length_str_gt(req, length_str(best))))
+            best = req;
+          run = nil;
+          if (!args)
+            break;
+        }
+      }
+
+      return if2(best && length_str_gt(best, zero), best);
+    } else if (sym == oneplus_s) {
+      return reg_required_lit(first(args));
+    }
+  }
+
+  return nil;
+}
+
+/*
+ * Calculate the information which allows the search functions to skip
+ * ahead in the input, without running the automaton: a literal which
+ * every match must contain, and the set of characters which can begin
+ * a match, if the regex doesn't match the empty string.
+ */
+static void regex_prefilter(regex_t *regex, val exp)
+{
+  val lit = reg_required_lit(exp);
+
+  if (lit)
+    regex->lit = chk_strdup(c_str(lit, nil));
+
+  if (!reg_nullable(exp)) {
+    val items = reg_first(exp);
+
+    if (items != t && items) {
+      if (!cdr(items) && chrp(car(items)))
+        regex->first_ch = c_chr(car(items));
+      regex->first = char_set_compile(items, nil);
+    }
+  }
+}
+
+/*
+ * Find the first position at or after pos where a match could begin,
+ * according to the regex's set of leading characters, or else len.
+ */
+static cnum regex_skip(regex_t *regex, const wchar_t *h, cnum pos, cnum len)
+{
+  if (regex->first_ch) {
+    const wchar_t *p = wmemchr(h + pos, regex->first_ch, len - pos);
+    return p ? p - h : len;
+  } else if (regex->first) {
+    char_set_t *first = regex->first;
+    while (pos < len && !char_set_contains(first, h[pos]))
+      pos++;
+  }
+
+  return pos;
+}
+
+static val regex_compile_nfa(val regex_sexp, val regex_source)
+{
+  regex_t *regex = coerce(regex_t *, chk_malloc(sizeof *regex));
+  val ret;
+  regex->kind = REGEX_NFA;
+  regex->ngroups = 0;
+  regex->dfa = regex->udfa = 0;
+  regex->lit = 0;
+  regex->first = 0;
+  regex->first_ch = 0;
+  regex->rev = regex->cap = regex->u8 = nil;
+  regex->source = nil;
+  ret = cobj(coerce(mem_t *, regex), regex_cls, &regex_obj_ops);
+  regex->r.nfa = nfa_optimize(nfa_compile_regex(regex_sexp));
+  regex->nstates = nfa_count_states(regex->r.nfa.start);
+  regex->source = regex_source;
+  regex_prefilter(regex, regex_sexp);
+  return ret;
+}
+
+/*
+ * Reverse optimized regex syntax which doesn't require the
+ * derivative back-end, such that it matches the reversed strings.
+ */
+static val reg_reverse(val exp)
+{
+  if (stringp(exp)) {
+    return reverse(exp);
+  } else if (atom(exp)) {
+    return exp;
   } else {
-    regex_t *regex = coerce(regex_t *, chk_malloc(sizeof *regex));
-    val ret;
-    regex->kind = REGEX_NFA;
-    regex->source = nil;
-    ret = cobj(coerce(mem_t *, regex), regex_cls, &regex_obj_ops);
-    regex->r.nfa = nfa_optimize(nfa_compile_regex(regex_sexp));
-    regex->nstates = nfa_count_states(regex->r.nfa.start);
-    regex->source = regex_source;
-    return ret;
+    val sym = first(exp), args = rest(exp);
+
+    if (sym == set_s || sym == cset_s) {
+      return exp;
+    } else if (sym == compound_s) {
+      list_collect_decl (out, ptail);
+      for (args = reverse(args); args; args = cdr(args))
+        ptail = list_collect(ptail, reg_reverse(car(args)));
+      return cons(sym, out);
+    } else if (sym == zeroplus_s || sym == oneplus_s || sym == optional_s) {
+      return list(sym, reg_reverse(first(args)), nao);
+    } else if (sym == or_s) {
+      return list(sym, reg_reverse(first(args)),
+                  reg_reverse(second(args)), nao);
+    } else {
+      uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
+    }
   }
 }
 
-val regexp(val obj)
+/*
+ * Obtain the compiled reverse of an NFA-based regex, which is
+ * created on first use.
+ */
+static val regex_reversed(val compiled_regex, regex_t *regex)
 {
-  return cobjclassp(obj, regex_cls);
+  if (!regex->rev) {
+    val exp = reg_optimize(reg_expand_nongreedy(reg_ungroup(regex->source)));
+    val rev = regex_compile_nfa(reg_reverse(exp), nil);
+    regex->rev = rev;
+    setcheck(compiled_regex, rev);
+  }
+
+  return regex->rev;
 }
 
-val regex_source(val compiled_regex)
+/*
+ * Byte input is matched by a regex translated to one over the bytes of
+ * the UTF-8 encodings of the strings it matches. A byte is represented
+ * by the character of the same value, except that the null byte is
+ * represented by REG_BYTE_NUL, since a null character marks the end of
+ * the input of a regex machine. Each character set, and the wildcard,
+ * becomes an alternation of sequences of byte ranges.
+ * The decoder produces U+DC00 for the null byte, which sets and the
+ * wildcard match. It produces the characters U+DC80 to U+DCFF for bytes
+ * which aren't valid UTF-8; those characters match the corresponding
+ * bytes only when they occur individually in the regex, not in sets
+ * or ranges, or under the wildcard: those could otherwise match a
+ * part of a valid multibyte character.
+ */
+#define REG_BYTE_NUL 0x100
+
+INLINE wchar_t reg_byte_chr(int byte)
 {
-  val self = lit("regex-source");
-  regex_t *regex = coerce(regex_t *,
-                          cobj_handle(self, compiled_regex, regex_cls));
-  return regex->source;
+  return byte ? convert(wchar_t, byte) : REG_BYTE_NUL;
 }
 
-static void puts_clear_flag(val str, val stream, int *semi_flag)
+static val reg_byte_range(int lo, int hi)
 {
-  *semi_flag = 0;
-  put_string(str, stream);
+  if (lo == hi)
+    return chr(reg_byte_chr(lo));
+  return list(set_s, cons(chr(lo), chr(hi)), nao);
 }
 
-static void putc_clear_flag(val ch, val stream, int *semi_flag)
+static int reg_utf8_encode(wchar_t wch, unsigned char *b)
 {
-  *semi_flag = 0;
-  put_char(ch, stream);
+  if (wch < 0x80) {
+    b[0] = wch;
+    return 1;
+  } else if (wch < 0x800) {
+    b[0] = 0xC0 | (wch >> 6);
+    b[1] = 0x80 | (wch & 0x3F);
+    return 2;
+  } else if (wch < 0x10000) {
+    b[0] = 0xE0 | (wch >> 12);
+    b[1] = 0x80 | ((wch >> 6) & 0x3F);
+    b[2] = 0x80 | (wch & 0x3F);
+    return 3;
+  } else {
+    b[0] = 0xF0 | (wch >> 18);
+    b[1] = 0x80 | ((wch >> 12) & 0x3F);
+    b[2] = 0x80 | ((wch >> 6) & 0x3F);
+    b[3] = 0x80 | (wch & 0x3F);
+    return 4;
+  }
 }
 
-static void print_class_char(val ch, val first_p, val stream, int *semi_flag)
+/*
+ * Split a range of characters into ranges whose UTF-8 encodings
+ * have the same length, and differ only in a trailing sequence
+ * of bytes which take on all of their possible values. Each of those
+ * is then expressed as a sequence of byte ranges.
+ */
+static loc reg_utf8_split(wchar_t lo, wchar_t hi, loc ptail)
 {
-  wchar_t c = c_chr(ch);
-  switch (c) {
-  case '^':
-    if (!first_p)
-      break;
-    /* fallthrough */
-  case '-': case '[': case ']':
-    putc_clear_flag(chr('\\'), stream, semi_flag);
-    put_char(ch, stream);
-    return;
+  static const wchar_t lim[3] = { 0x7F, 0x7FF, 0xFFFF };
+  unsigned char b0[4], b1[4];
+  int i, n;
+
+  for (i = 0; i < 3; i++) {
+    if (lo <= lim[i] && hi > lim[i]) {
+      ptail = reg_utf8_split(lo, lim[i], ptail);
+      return reg_utf8_split(lim[i] + 1, hi, ptail);
+    }
+  }
+
+  for (i = 1; i < 4; i++) {
+    wchar_t m = (convert(wchar_t, 1) << (6 * i)) - 1;
+
+    if ((lo & ~m) != (hi & ~m)) {
+      if ((lo & m) != 0) {
+        ptail = reg_utf8_split(lo, lo | m, ptail);
+        return reg_utf8_split((lo | m) + 1, hi, ptail);
+      }
+      if ((hi & m) != m) {
+        ptail = reg_utf8_split(lo, (hi & ~m) - 1, ptail);
+        return reg_utf8_split(hi & ~m, hi, ptail);
+      }
+    }
+  }
+
+  n = reg_utf8_encode(lo, b0);
+  reg_utf8_encode(hi, b1);
+
+  if (n == 1) {
+    return list_collect(ptail, reg_byte_range(b0[0], b1[0]));
+  } else {
+    list_collect_decl (seq, stail);
+    stail = list_collect(stail, compound_s);
+    for (i = 0; i < n; i++)
+      stail = list_collect(stail, reg_byte_range(b0[i], b1[i]));
+    return list_collect(ptail, seq);
   }
-  out_str_char(c_chr(ch), stream, semi_flag, 1);
 }
 
-static void print_rec(val exp, val stream, int *semi_flag);
+static val reg_utf8_alt(val alts)
+{
+  if (!alts)
+    return t;
+  if (!cdr(alts))
+    return car(alts);
+  return list(or_s, car(alts), reg_utf8_alt(cdr(alts)), nao);
+}
 
-static void paren_print_rec(val exp, val stream, int *semi_flag)
+/*
+ * Translate a set of characters, given as ranges, to byte syntax.
+ * If raw is zero, the characters U+DC80 to U+DCFF are omitted.
+ */
+static val reg_utf8_ranges(struct cs_range *r, int n, int raw)
 {
-  putc_clear_flag(chr('('), stream, semi_flag);
-  print_rec(exp, stream, semi_flag);
-  putc_clear_flag(chr(')'), stream, semi_flag);
+  list_collect_decl (alts, ptail);
+  int i;
+
+  for (i = 0; i < n; i++) {
+    wchar_t lo = r[i].lo, hi = r[i].hi;
+
+    if (lo == 0)
+      lo = 1;
+
+    if (lo > hi)
+      continue;
+
+    if (lo < 0xDC00)
+      ptail = reg_utf8_split(lo, if3(hi < 0xDBFF, hi, 0xDBFF), ptail);
+
+    if (lo <= 0xDC00 && hi >= 0xDC00)
+      ptail = list_collect(ptail, reg_byte_range(0, 0));
+
+    if (raw && lo <= 0xDCFF && hi >= 0xDC80)
+      ptail = list_collect(ptail,
+                           reg_byte_range(if3(lo > 0xDC80, lo, 0xDC80) & 0xFF,
+                                          if3(hi < 0xDCFF, hi, 0xDCFF) & 0xFF));
+
+    if (hi > 0xDCFF)
+      ptail = reg_utf8_split(if3(lo > 0xDD00, lo, 0xDD00), hi, ptail);
+  }
+
+  return reg_utf8_alt(alts);
 }
 
-static void print_rec(val exp, val stream, int *semi_flag)
+static val reg_utf8_set(char_set_t *set)
 {
-  val self = lit("regex-print");
+  struct cs_ranges cr = { 0, 0, 0 };
+  val alt;
 
-  if (exp == space_k) {
-    puts_clear_flag(lit("\\s"), stream, semi_flag);
+  char_set_ranges(set, &cr);
+  alt = reg_utf8_ranges(cr.r, cr.n, 0);
+  free(cr.r);
+  return alt;
+}
+
+static val reg_utf8(val exp)
+{
+  if (exp == nil || exp == t) {
+    return exp;
+  } else if (chrp(exp)) {
+    struct cs_range r;
+    r.lo = r.hi = c_chr(exp);
+    return reg_utf8_ranges(&r, 1, 1);
+  } else if (stringp(exp)) {
+    return cons(compound_s, mapcar(func_n1(reg_utf8), list_str(exp)));
+  } else if (exp == wild_s) {
+    struct cs_range r;
+    r.lo = 0;
+    r.hi = CHAR_SET_MAX;
+    return reg_utf8_ranges(&r, 1, 0);
+  } else if (exp == space_k) {
+    return reg_utf8_set(space_cs);
   } else if (exp == digit_k) {
-    puts_clear_flag(lit("\\d"), stream, semi_flag);
+    return reg_utf8_set(digit_cs);
   } else if (exp == word_char_k) {
-    puts_clear_flag(lit("\\w"), stream, semi_flag);
+    return reg_utf8_set(word_cs);
   } else if (exp == cspace_k) {
-    puts_clear_flag(lit("\\S"), stream, semi_flag);
+    return reg_utf8_set(cspace_cs);
   } else if (exp == cdigit_k) {
-    puts_clear_flag(lit("\\D"), stream, semi_flag);
+    return reg_utf8_set(cdigit_cs);
   } else if (exp == cword_char_k) {
-    puts_clear_flag(lit("\\W"), stream, semi_flag);
-  } else if (exp == wild_s) {
-    putc_clear_flag(chr('.'), stream, semi_flag);
-  } else if (chrp(exp)) {
-    wchar_t ch = c_chr(exp);
-    switch (ch) {
-    case '?': case '.': case '*': case '+':
-    case '(': case ')': case '|': case '~':
-    case '&': case '%': case '/':
-    case '[': case ']': case '\\':
-      putc_clear_flag(chr('\\'), stream, semi_flag);
-      put_char(exp, stream);
-      break;
-    default:
-      out_str_char(ch, stream, semi_flag, 1);
-    }
-  } else if (stringp(exp)) {
-    cnum i;
-    cnum l = c_num(length(exp), self);
-    for (i = 0; i < l; i++)
-      print_rec(chr_str(exp, num(i)), stream, semi_flag);
+    return reg_utf8_set(cword_cs);
   } else if (consp(exp)) {
-    val sym = first(exp);
-    val args = rest(exp);
+    val sym = first(exp), args = rest(exp);
 
     if (sym == set_s || sym == cset_s) {
-      val first_p = t;
+      char_set_t *set = char_set_compile(args, tnil(sym == cset_s));
+      val alt = reg_utf8_set(set);
+      char_set_destroy(set, 0);
+      return alt;
+    } else if (sym == compound_s || sym == zeroplus_s ||
+               sym == oneplus_s || sym == optional_s || sym == or_s)
+    {
+      return cons(sym, mapcar(func_n1(reg_utf8), args));
+    } else {
+      uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
+    }
+  } else {
+    uw_throwf(error_s, lit("bad object in regex syntax: ~s"), exp, nao);
+  }
+}
+
+/*
+ * Obtain the byte-oriented version of a regex, which is created on
+ * first use.
+ */
+static val regex_utf8(val self, val compiled_regex, regex_t *regex)
+{
+  if (!regex->u8) {
+    val exp = reg_optimize(reg_expand_nongreedy(reg_ungroup(regex->source)));
+    val bexp;
+
+    if (regex_requires_dv(exp))
+      uw_throwf(error_s, lit("~a: ~s isn't supported for byte input"),
+                self, compiled_regex, nao);
+
+    bexp = reg_utf8(exp);
+    regex->u8 = regex_compile_nfa(bexp, bexp);
+    setcheck(compiled_regex, regex->u8);
+  }
+
+  return regex->u8;
+}
+
+static val regex_compile_tree(val regex_sexp)
+{
+  val regex_source = reg_nary_to_bin(regex_sexp);
+
+  regex_sexp = reg_optimize(reg_expand_nongreedy(reg_ungroup(regex_source)));
+
+  if (opt_derivative_regex || regex_requires_dv(regex_sexp)) {
+    regex_t *regex = coerce(regex_t *, chk_malloc(sizeof *regex));
+    val ret;
+    val dv = reg_compile_csets(regex_sexp);
+    regex->kind = REGEX_DV;
+    regex->nstates = regex->ngroups = 0;
+    regex->dfa = regex->udfa = 0;
+    regex->lit = 0;
+    regex->first = 0;
+    regex->first_ch = 0;
+    regex->rev = regex->cap = regex->u8 = nil;
+    regex->source = nil;
+    ret = cobj(coerce(mem_t *, regex), regex_cls, &regex_obj_ops);
+    regex->r.dv = dv;
+    regex->source = regex_source;
+    return ret;
+  } else {
+    return regex_compile_nfa(regex_sexp, regex_source);
+  }
+}
+
+/*
+ * Cache of compiled regexes, keyed on the source string or syntax
+ * tree under equal.  Each value is a (regex . tick) cons; the tick
+ * is refreshed on every hit, and when the cache is full, the entry
+ * with the oldest tick is evicted.  The size is bounded by
+ * *regex-cache-size*, which is small enough that a linear scan for
+ * the victim costs far less than the compile it saves.
+ *
+ * A cached regex keeps the automata derived from it as it is used:
+ * lazy DFAs, and the reversed, capturing and UTF-8 regexes with their
+ * own DFAs. Each of these can grow to DFA_MAX_BYTES, so the entries
+ * are also bounded by the memory which these occupy, according to
+ * *regex-cache-bytes*. Since the automata grow after the regex is
+ * cached, this is checked on every miss, and on a hit if the DFAs have
+ * grown by a sixteenth of the limit since the previous check.
+ */
+static val regex_cache, regex_cache_size_s, regex_cache_bytes_s;
+static val count_k, bytes_k, hits_k, misses_k, evictions_k;
+static cnum regex_cache_tick;
+static ucnum regex_cache_growth;
+static ucnum regex_cache_hits, regex_cache_misses, regex_cache_evictions;
+
+static cnum regex_cache_limit(void)
+{
+  val self = lit("regex-compile");
+  val size = cdr(lookup_var(nil, regex_cache_size_s));
+  return if3(size, c_num(size, self), 0);
+}
+
+static ucnum dfa_footprint(dfa_t *dfa)
+{
+  return if3(dfa, sizeof *dfa + dfa->bytes +
+                  (dfa->mask + 1) * sizeof *dfa->table, 0);
+}
+
+static ucnum regex_footprint(val rx)
+{
+  regex_t *regex;
+
+  if (!rx)
+    return 0;
+
+  regex = coerce(regex_t *, rx->co.handle);
+
+  return (dfa_footprint(regex->dfa) + dfa_footprint(regex->udfa) +
+          regex_footprint(regex->rev) + regex_footprint(regex->cap) +
+          regex_footprint(regex->u8));
+}
+
+static ucnum regex_cache_footprint(void)
+{
+  struct hash_iter hi;
+  val cell;
+  ucnum total = 0;
+
+  us_hash_iter_init(&hi, regex_cache);
+
+  while ((cell = hash_iter_next(&hi)))
+    total += regex_footprint(cadr(cell));
+
+  return total;
+}
+
+static val regex_cache_evict(void)
+{
+  struct hash_iter hi;
+  val cell, oldest = nil;
+
+  us_hash_iter_init(&hi, regex_cache);
+
+  while ((cell = hash_iter_next(&hi))) {
+    if (!oldest || c_n(cddr(cell)) < c_n(cddr(oldest)))
+      oldest = cell;
+  }
+
+  if (oldest) {
+    remhash(regex_cache, car(oldest));
+    regex_cache_evictions++;
+    return cadr(oldest);
+  }
+
+  return nil;
+}
+
+static void regex_cache_trim(int hit)
+{
+  val self = lit("regex-compile");
+  val max;
+
+  if (hit && dfa_growth == regex_cache_growth)
+    return;
+
+  max = cdr(lookup_var(nil, regex_cache_bytes_s));
+
+  if (max) {
+    ucnum limit = c_unum(max, self), total;
+
+    if (hit && dfa_growth - regex_cache_growth <= limit / 16)
+      return;
+
+    regex_cache_growth = dfa_growth;
+    total = regex_cache_footprint();
+
+    while (total > limit) {
+      val victim = regex_cache_evict();
+      if (!victim)
+        break;
+      total -= regex_footprint(victim);
+    }
+  }
+}
+
+static void regex_cache_put(val key, val regex, cnum limit)
+{
+  while (c_n(hash_count(regex_cache)) >= limit)
+    regex_cache_evict();
+
+  key = if3(stringp(key), copy_str(key), copy_tree(key));
+  sethash(regex_cache, key, cons(regex, num(regex_cache_tick++)));
+}
+
+val regex_compile(val regex_sexp, val error_stream)
+{
+  cnum limit = regex_cache_limit();
+  val regex;
+
+  if (limit <= 0) {
+    if (hash_count(regex_cache) != zero)
+      clearhash(regex_cache);
+  } else {
+    val entry = gethash(regex_cache, regex_sexp);
+
+    if (entry) {
+      rplacd(entry, num(regex_cache_tick++));
+      regex_cache_hits++;
+      regex_cache_trim(1);
+      return car(entry);
+    }
+
+    regex_cache_misses++;
+    regex_cache_trim(0);
+  }
+
+  if (stringp(regex_sexp)) {
+    val tree = regex_parse(regex_sexp, error_stream);
+    if (!tree)
+      return nil;
+    regex = regex_compile_tree(tree);
+  } else {
+    regex = regex_compile_tree(regex_sexp);
+  }
+
+  if (limit > 0)
+    regex_cache_put(regex_sexp, regex, limit);
+
+  return regex;
+}
+
+val regex_cache_stats(void)
+{
+  return list(count_k, hash_count(regex_cache),
+              bytes_k, unum(regex_cache_footprint()),
+              hits_k, unum(regex_cache_hits),
+              misses_k, unum(regex_cache_misses),
+              evictions_k, unum(regex_cache_evictions), nao);
+}
+
+val regex_cache_clear(void)
+{
+  clearhash(regex_cache);
+  regex_cache_hits = regex_cache_misses = regex_cache_evictions = 0;
+  return nil;
+}
+
+/*
+ * Called by the parser for a parenthesized regex, which is a
+ * capture group.
+ */
+val regex_group(val exp)
+{
+  if (opt_compat && opt_compat <= 298)
+    return exp;
+  return list(rgroup_s, exp, nao);
+}
+
+val regexp(val obj)
+{
+  return cobjclassp(obj, regex_cls);
+}
+
+val regex_source(val compiled_regex)
+{
+  val self = lit("regex-source");
+  regex_t *regex = coerce(regex_t *,
+                          cobj_handle(self, compiled_regex, regex_cls));
+  return regex->source;
+}
+
+static void puts_clear_flag(val str, val stream, int *semi_flag)
+{
+  *semi_flag = 0;
+  put_string(str, stream);
+}
+
+static void putc_clear_flag(val ch, val stream, int *semi_flag)
+{
+  *semi_flag = 0;
+  put_char(ch, stream);
+}
+
+static void print_class_char(val ch, val first_p, val stream, int *semi_flag)
+{
+  wchar_t c = c_chr(ch);
+  switch (c) {
+  case '^':
+    if (!first_p)
+      break;
+    /* fallthrough */
+  case '-': case '[': case ']':
+    putc_clear_flag(chr('\\'), stream, semi_flag);
+    put_char(ch, stream);
+    return;
+  }
+  out_str_char(c_chr(ch), stream, semi_flag, 1);
+}
+
+static void print_rec(val exp, val stream, int *semi_flag, int tail);
+
+static void paren_print_rec(val exp, val stream, int *semi_flag)
+{
+  putc_clear_flag(chr('('), stream, semi_flag);
+  print_rec(exp, stream, semi_flag, 1);
+  putc_clear_flag(chr(')'), stream, semi_flag);
+}
+
+/*
+ * True if exp must be parenthesized as the operand of a postfix
+ * operator, or the left operand of %.
+ */
+static int print_postfix_paren_p(val exp)
+{
+  if (consp(exp)) {
+    val sym = car(exp);
+    return (sym == compound_s || sym == or_s || sym == and_s ||
+            sym == compl_s || sym == nongreedy_s);
+  }
+  return 0;
+}
+
+/*
+ * Since parentheses denote capture groups, they are only added where
+ * they are required. The right operands of the ~ and % operators extend
+ * as far as the enclosing catenation does, so such an operator
+ * needs no parentheses in the last position of a catenation which
+ * is itself in tail position: followed only by a closing parenthesis,
+ * a | or & operator, or the end of the regex.
+ */
+static void print_rec(val exp, val stream, int *semi_flag, int tail)
+{
+  val self = lit("regex-print");
+
+  if (exp == space_k) {
+    puts_clear_flag(lit("\\s"), stream, semi_flag);
+  } else if (exp == digit_k) {
+    puts_clear_flag(lit("\\d"), stream, semi_flag);
+  } else if (exp == word_char_k) {
+    puts_clear_flag(lit("\\w"), stream, semi_flag);
+  } else if (exp == cspace_k) {
+    puts_clear_flag(lit("\\S"), stream, semi_flag);
+  } else if (exp == cdigit_k) {
+    puts_clear_flag(lit("\\D"), stream, semi_flag);
+  } else if (exp == cword_char_k) {
+    puts_clear_flag(lit("\\W"), stream, semi_flag);
+  } else if (exp == wild_s) {
+    putc_clear_flag(chr('.'), stream, semi_flag);
+  } else if (chrp(exp)) {
+    wchar_t ch = c_chr(exp);
+    switch (ch) {
+    case '?': case '.': case '*': case '+':
+    case '(': case ')': case '|': case '~':
+    case '&': case '%': case '/':
+    case '[': case ']': case '\\':
+      putc_clear_flag(chr('\\'), stream, semi_flag);
+      put_char(exp, stream);
+      break;
+    default:
+      out_str_char(ch, stream, semi_flag, 1);
+    }
+  } else if (stringp(exp)) {
+    cnum i;
+    cnum l = c_num(length(exp), self);
+    for (i = 0; i < l; i++)
+      print_rec(chr_str(exp, num(i)), stream, semi_flag, 0);
+  } else if (consp(exp)) {
+    val sym = first(exp);
+    val args = rest(exp);
+
+    if (sym == set_s || sym == cset_s) {
+      val first_p = t;
 
       putc_clear_flag(chr('['), stream, semi_flag);
 
@@ -2392,7 +3908,7 @@ static void print_rec(val exp, val stream, int *semi_flag)
           putc_clear_flag(chr('-'), stream, semi_flag);
           print_class_char(cdr(arg), nil, stream, semi_flag);
         } else if (symbolp(arg)) {
-          print_rec(arg, stream, semi_flag);
+          print_rec(arg, stream, semi_flag, 0);
         } else {
           print_class_char(arg, first_p, stream, semi_flag);
         }
@@ -2402,18 +3918,21 @@ static void print_rec(val exp, val stream, int *semi_flag)
     } else if (sym == compound_s) {
       for (; args; args = cdr(args)) {
         val arg = car(args);
-        if (consp(arg) && (car(arg) == compl_s || car(arg) == and_s ||
-                           car(arg) == or_s || car(arg) == nongreedy_s))
+        int last_tail = tail && !cdr(args);
+        if (consp(arg) && (car(arg) == and_s || car(arg) == or_s))
+          paren_print_rec(arg, stream, semi_flag);
+        else if (consp(arg) && !last_tail &&
+                 (car(arg) == compl_s || car(arg) == nongreedy_s))
           paren_print_rec(arg, stream, semi_flag);
         else
-          print_rec(arg, stream, semi_flag);
+          print_rec(arg, stream, semi_flag, last_tail);
       }
     } else if (sym == zeroplus_s || sym == oneplus_s || sym == optional_s) {
       val arg = pop(&args);
-      if (consp(arg) && car(arg) != set_s && car(arg) != cset_s)
+      if (print_postfix_paren_p(arg))
         paren_print_rec(arg, stream, semi_flag);
       else
-        print_rec(arg, stream, semi_flag);
+        print_rec(arg, stream, semi_flag, 0);
       if (sym == zeroplus_s)
         putc_clear_flag(chr('*'), stream, semi_flag);
       else if (sym == oneplus_s)
@@ -2426,35 +3945,37 @@ static void print_rec(val exp, val stream, int *semi_flag)
       if (consp(arg) && (car(arg) == or_s || car(arg) == and_s))
         paren_print_rec(arg, stream, semi_flag);
       else
-        print_rec(arg, stream, semi_flag);
+        print_rec(arg, stream, semi_flag, tail);
     } else if (sym == and_s) {
       val arg1 = pop(&args);
       val arg2 = pop(&args);
       if (consp(arg1) && car(arg1) == or_s)
         paren_print_rec(arg1, stream, semi_flag);
       else
-        print_rec(arg1, stream, semi_flag);
+        print_rec(arg1, stream, semi_flag, 1);
       putc_clear_flag(chr('&'), stream, semi_flag);
       if (consp(arg2) && car(arg2) == or_s)
         paren_print_rec(arg2, stream, semi_flag);
       else
-        print_rec(arg2, stream, semi_flag);
+        print_rec(arg2, stream, semi_flag, 1);
     } else if (sym == or_s) {
-      print_rec(pop(&args), stream, semi_flag);
+      print_rec(pop(&args), stream, semi_flag, 1);
       putc_clear_flag(chr('|'), stream, semi_flag);
-      print_rec(pop(&args), stream, semi_flag);
+      print_rec(pop(&args), stream, semi_flag, 1);
     } else if (sym == nongreedy_s) {
       val arg1 = pop(&args);
       val arg2 = pop(&args);
-      if (consp(arg1) && car(arg1) != set_s && car(arg1) != cset_s)
+      if (print_postfix_paren_p(arg1))
         paren_print_rec(arg1, stream, semi_flag);
       else
-        print_rec(arg1, stream, semi_flag);
+        print_rec(arg1, stream, semi_flag, 0);
       putc_clear_flag(chr('%'), stream, semi_flag);
-      if (consp(arg2) && (car(arg2) == and_s && car(arg2) == or_s))
+      if (consp(arg2) && (car(arg2) == and_s || car(arg2) == or_s))
         paren_print_rec(arg2, stream, semi_flag);
       else
-        print_rec(arg2, stream, semi_flag);
+        print_rec(arg2, stream, semi_flag, tail);
+    } else if (sym == rgroup_s) {
+      paren_print_rec(first(args), stream, semi_flag);
     } else {
       uw_throwf(error_s, lit("bad operator in regex syntax: ~s"), sym, nao);
     }
@@ -2475,20 +3996,10 @@ static void regex_print(val obj, val stream, val pretty, struct strm_ctx *ctx)
   (void) ctx;
 
   put_string(lit("#/"), stream);
-  print_rec(regex->source, stream, &semi_flag);
+  print_rec(regex->source, stream, &semi_flag, 1);
   put_char(chr('/'), stream);
 }
 
-static cnum regex_run(val compiled_regex, const wchar_t *str)
-{
-  val self = lit("regex-run");
-  regex_t *regex = coerce(regex_t *, cobj_handle(self, compiled_regex, regex_cls));
-
-  return if3(regex->kind == REGEX_DV,
-             dv_run(regex->r.dv, str),
-             nfa_run(regex->r.nfa, regex->nstates, str));
-}
-
 /*
  * Regex machine: represents the logic of the regex_run function as state
  * machine object which can be fed one character at a time.
@@ -2503,8 +4014,15 @@ static void regex_machine_reset(regex_machine_t *regm)
 
   if (regm->n.is_nfa) {
     nfa_state_t *s = regm->n.nfa.start;
+    dfa_t *dfa = regm->n.dfa;
 
-    if (s) {
+    regm->n.dstate = 0;
+
+    if (dfa && dfa->start) {
+      regm->n.dstate = dfa->start;
+      regm->n.nclos = dfa->start->nset;
+      accept = dfa->start->accept;
+    } else if (s) {
       regm->n.visited = s->a.visited + 1;
       nfa_handle_wraparound(s, &regm->n.visited);
       regm->n.set[0] = s;
@@ -2512,6 +4030,12 @@ static void regex_machine_reset(regex_machine_t *regm)
                                   regm->n.nstates,
                                   regm->n.visited, &accept, &more);
       s->a.visited = regm->n.visited;
+      if (dfa) {
+        regm->n.dstate = dfa_intern(dfa, regm->n.set, regm->n.nclos,
+                                    accept, more);
+        if (!dfa->start)
+          dfa->start = regm->n.dstate;
+      }
     } else {
       regm->n.nclos = 0;
     }
@@ -2524,7 +4048,8 @@ static void regex_machine_reset(regex_machine_t *regm)
     regm->n.last_accept_pos = regm->n.count;
 }
 
-static void regex_machine_init(val self, regex_machine_t *regm, val reg)
+static void regex_machine_init(val self, regex_machine_t *regm, val reg,
+                               int unanchored)
 {
   regex_t *regex = coerce(regex_t *, cobj_handle(self, reg, regex_cls));
 
@@ -2536,10 +4061,13 @@ static void regex_machine_init(val self, regex_machine_t *regm, val reg)
     regm->n.nfa = regex->r.nfa;
     regm->n.nstates = regex->nstates;
     regm->n.visited = 0;
+    regm->n.unanchored = unanchored;
     regm->n.set = coerce(nfa_state_t **,
                           chk_malloc(regex->nstates * sizeof *regm->n.set));
     regm->n.stack = coerce(nfa_state_t **,
                            chk_malloc(regex->nstates * sizeof *regm->n.stack));
+    if ((regm->n.dfa = regex_dfa(regex, unanchored)) != 0)
+      regm->n.dfa->users++;
   }
 
   regex_machine_reset(regm);
@@ -2550,8 +4078,12 @@ static void regex_machine_cleanup(regex_machine_t *regm)
   if (regm->n.is_nfa) {
     free(regm->n.stack);
     free(regm->n.set);
+    if (regm->n.dfa)
+      regm->n.dfa->users--;
     regm->n.stack = 0;
     regm->n.set = 0;
+    regm->n.dfa = 0;
+    regm->n.dstate = 0;
     regm->n.nfa.start = 0;
     regm->n.nfa.accept = 0;
   }
@@ -2565,11 +4097,99 @@ static regm_result_t regex_machine_infer_init_state(regex_machine_t *regm)
     return (regm->d.deriv != t) ? REGM_INCOMPLETE : REGM_FAIL;
 }
 
+/*
+ * In unanchored mode, the closure of the start state is added after
+ * every move, so that the machine matches the regex anywhere
+ * in the input, as if it were preceded by .*
+ */
+static void regex_machine_add_start(regex_machine_t *regm,
+                                    int *accept, int *more)
+{
+  nfa_state_t *s = regm->n.nfa.start;
+
+  if (s && s->a.visited != regm->n.visited) {
+    nfa_state_t **set = regm->n.set + regm->n.nclos;
+    set[0] = s;
+    regm->n.nclos += nfa_closure(regm->n.stack, set, 1, regm->n.nstates,
+                                 regm->n.visited, accept, more);
+  }
+}
+
+/*
+ * Compute a DFA transition which is not yet cached, by NFA simulation
+ * from the current DFA state's set. If the target state cannot be
+ * cached, the machine drops into NFA mode, continuing from the
+ * computed set.
+ */
+static void regex_machine_dfa_move(regex_machine_t *regm, wchar_t ch,
+                                   int *accept, int *more)
+{
+  dfa_t *dfa = regm->n.dfa;
+  dfa_state_t *ds = regm->n.dstate, *nx;
+  unsigned gen = dfa->gen;
+
+  memcpy(regm->n.set, ds->set, ds->nset * sizeof *ds->set);
+
+  regm->n.visited = regm->n.nfa.start->a.visited;
+  nfa_handle_wraparound(regm->n.nfa.start, &regm->n.visited);
+
+  regm->n.nclos = nfa_move_closure(regm->n.stack,
+                                   regm->n.set, ds->nset,
+                                   regm->n.nstates, ch, ++regm->n.visited,
+                                   accept, more);
+
+  if (regm->n.unanchored)
+    regex_machine_add_start(regm, accept, more);
+
+  regm->n.nfa.start->a.visited = regm->n.visited;
+
+  nx = dfa_intern(dfa, regm->n.set, regm->n.nclos, *accept, *more);
+
+  if (nx && dfa->gen == gen) {
+    if (ch < 256) {
+      ds->trans[dfa->cls[ch]] = nx;
+    } else {
+      ds->wch = ch;
+      ds->wtrans = nx;
+    }
+  }
+
+  regm->n.dstate = nx;
+}
+
 static regm_result_t regex_machine_feed(regex_machine_t *regm, wchar_t ch)
 {
   int accept = 0, more = 0;
 
   if (regm->n.is_nfa) {
+    dfa_state_t *ds = regm->n.dstate;
+
+    if (ds && ch != 0) {
+      dfa_t *dfa = regm->n.dfa;
+      dfa_state_t *nx = (ch < 256
+                         ? ds->trans[dfa->cls[ch]]
+                         : ds->wch == ch ? ds->wtrans : 0);
+
+      regm->n.count++;
+      dfa->progress++;
+
+      if (nx) {
+        regm->n.dstate = nx;
+        regm->n.nclos = nx->nset;
+        accept = nx->accept;
+        more = nx->more;
+      } else {
+        regex_machine_dfa_move(regm, ch, &accept, &more);
+      }
+
+      if (accept) {
+        regm->n.last_accept_pos = regm->n.count;
+        return more ? REGM_MATCH : REGM_MATCH_DONE;
+      }
+
+      return (regm->n.nclos != 0) ? REGM_INCOMPLETE : REGM_FAIL;
+    }
+
     nfa_handle_wraparound(regm->n.nfa.start, &regm->n.visited);
 
     if (ch != 0) {
@@ -2580,6 +4200,9 @@ static regm_result_t regex_machine_feed(regex_machine_t *regm, wchar_t ch)
                                        regm->n.nstates, ch, ++regm->n.visited,
                                        &accept, &more);
 
+      if (regm->n.unanchored)
+        regex_machine_add_start(regm, &accept, &more);
+
       if (regm->n.nfa.start)
         regm->n.nfa.start->a.visited = regm->n.visited;
 
@@ -2615,14 +4238,235 @@ static regm_result_t regex_machine_feed(regex_machine_t *regm, wchar_t ch)
   return REGM_INCOMPLETE;
 }
 
-val search_regex(val haystack, val needle_regex, val start,
+/*
+ * True if the characters of str can be accessed directly,
+ * rather than through chr_str.
+ */
+static int regex_str_direct_p(val str)
+{
+  return stringp(str) && !lazy_stringp(str);
+}
+
+static cnum regex_run(val compiled_regex, const wchar_t *str)
+{
+  val self = lit("regex-run");
+  regex_t *regex = coerce(regex_t *, cobj_handle(self, compiled_regex, regex_cls));
+
+  if (regex->kind == REGEX_DV) {
+    return dv_run(regex->r.dv, str);
+  } else if (regex_dfa(regex, 0)) {
+    regex_machine_t regm;
+    cnum span;
+
+    regex_machine_init(self, &regm, compiled_regex, 0);
+
+    for (; *str != 0; str++) {
+      regm_result_t res = regex_machine_feed(&regm, *str);
+      if (res == REGM_FAIL || res == REGM_MATCH_DONE)
+        break;
+    }
+
+    span = regex_machine_match_span(&regm);
+    regex_machine_cleanup(&regm);
+    return span;
+  } else {
+    return nfa_run(regex->r.nfa, regex->nstates, str);
+  }
+}
+
+/*
+ * Length of the longest match of a byte-oriented regex which is a
+ * prefix of the given bytes, or -1.
+ */
+static cnum regex_run_bytes(val self, val u8re, const unsigned char *h,
+                            cnum len)
+{
+  regex_machine_t regm;
+  cnum i, span = -1;
+
+  regex_machine_init(self, &regm, u8re, 0);
+
+  uw_simple_catch_begin;
+
+  for (i = 0; i < len; i++) {
+    regm_result_t res = regex_machine_feed(&regm, reg_byte_chr(h[i]));
+    if (res == REGM_FAIL || res == REGM_MATCH_DONE)
+      break;
+  }
+
+  span = regex_machine_match_span(&regm);
+
+  uw_unwind {
+    regex_machine_cleanup(&regm);
+  }
+
+  uw_catch_end;
+
+  return span;
+}
+
+/*
+ * Byte-oriented counterparts of the prefilter tests.
+ */
+static int regex_lit_bytes(regex_t *u8, const unsigned char *h,
+                           cnum pos, cnum len)
+{
+  const wchar_t *lit = u8->lit;
+  cnum n = wcslen(lit), i;
+  const unsigned char *p = h + pos, *end = h + len;
+
+  while (end - p >= n) {
+    p = coerce(const unsigned char *, memchr(p, lit[0] & 0xFF, end - p - n + 1));
+    if (!p)
+      break;
+    for (i = 1; i < n && p[i] == (lit[i] & 0xFF); i++)
+      ; /* empty */
+    if (i == n)
+      return 1;
+    p++;
+  }
+
+  return 0;
+}
+
+static cnum regex_skip_bytes(regex_t *u8, const unsigned char *h,
+                             cnum pos, cnum len)
+{
+  if (u8->first_ch) {
+    const unsigned char *p = coerce(const unsigned char *,
+                                    memchr(h + pos, u8->first_ch & 0xFF,
+                                           len - pos));
+    return p ? p - h : len;
+  } else if (u8->first) {
+    char_set_t *first = u8->first;
+    while (pos < len && !char_set_contains(first, reg_byte_chr(h[pos])))
+      pos++;
+  }
+
+  return pos;
+}
+
+static val nfa_search_bytes(regex_t *u8, const unsigned char *h,
+                            cnum pos, cnum len)
+{
+  struct nfa_search ns;
+  cnum j;
+  val retval = nil;
+
+  nfa_search_init(&ns, u8, pos, 0);
+
+  uw_simple_catch_begin;
+
+  for (j = pos; j < len && !nfa_search_done(&ns); j++) {
+    if (u8->first && nfa_search_idle(&ns)) {
+      cnum k = regex_skip_bytes(u8, h, j, len);
+      if (k >= len)
+        break;
+      nfa_search_skip(&ns, k);
+      j = k;
+    }
+    nfa_search_feed(&ns, reg_byte_chr(h[j]));
+  }
+
+  if (ns.match_beg >= 0)
+    retval = cons(num(ns.match_beg), num(ns.match_end - ns.match_beg));
+
+  uw_unwind {
+    nfa_search_cleanup(&ns);
+  }
+
+  uw_catch_end;
+
+  return retval;
+}
+
+static val search_regex_buf(val self, val haystack, val needle_regex,
+                            regex_t *regex, val start, val from_end)
+{
+  val u8re = regex_utf8(self, needle_regex, regex);
+  regex_t *u8 = coerce(regex_t *, u8re->co.handle);
+  const unsigned char *h = buf_get(haystack, self);
+  cnum len = c_num(length_buf(haystack), self);
+  cnum s = c_num(start, self), i;
+  regex_machine_t regm;
+  int found = 0;
+  val retval = nil;
+
+  if (s < 0 && (s += len) < 0)
+    s = 0;
+
+  if (s > len || (u8->lit && !regex_lit_bytes(u8, h, s, len)))
+    return nil;
+
+  if (from_end) {
+    if (regex_run_bytes(self, u8re, h, 0) >= 0)
+      return cons(num(len), zero);
+    regex_machine_init(self, &regm, regex_reversed(u8re, u8), 1);
+  } else {
+    if (u8->first && (s = regex_skip_bytes(u8, h, s, len)) >= len)
+      return nil;
+    regex_machine_init(self, &regm, u8re, 1);
+  }
+
+  uw_simple_catch_begin;
+
+  if (from_end) {
+    for (i = len - 1; i >= s; i--) {
+      regm_result_t res = regex_machine_feed(&regm, reg_byte_chr(h[i]));
+
+      if (res == REGM_MATCH || res == REGM_MATCH_DONE) {
+        found = 1;
+        break;
+      }
+
+      if (res == REGM_FAIL)
+        break;
+    }
+  } else {
+    found = (regm.n.last_accept_pos >= 0);
+
+    for (i = s; !found && i < len; i++) {
+      regm_result_t res = regex_machine_feed(&regm, reg_byte_chr(h[i]));
+
+      if (res == REGM_MATCH || res == REGM_MATCH_DONE)
+        found = 1;
+      else if (res == REGM_FAIL)
+        break;
+    }
+  }
+
+  uw_unwind {
+    regex_machine_cleanup(&regm);
+  }
+
+  uw_catch_end;
+
+  if (!found)
+    return nil;
+
+  if (from_end)
+    retval = cons(num(i), num(regex_run_bytes(self, u8re, h + i, len - i)));
+  else
+    retval = nfa_search_bytes(u8, h, s, len);
+
+  gc_hint(haystack);
+  return retval;
+}
+
+val search_regex(val haystack, val needle_regex, val start,
                  val from_end)
 {
   val self = lit("search-regex");
+  regex_t *regex = coerce(regex_t *,
+                          cobj_handle(self, needle_regex, regex_cls));
   val slen = nil;
   start = default_arg(start, zero);
   from_end = default_null_arg(from_end);
 
+  if (bufp(haystack))
+    return search_regex_buf(self, haystack, needle_regex, regex,
+                            start, from_end);
+
   if (minusp(start)) {
     slen = length_str(haystack);
     start = plus(start, slen);
@@ -2640,13 +4484,124 @@ val search_regex(val haystack, val needle_regex, val start,
     if (regex_run(needle_regex, L"") >= 0)
       return cons(slen, zero);
 
-    for (i = c_num(slen, self) - 1; i >= s; i--) {
-      cnum span = regex_run(needle_regex, h + i);
-      if (span >= 0)
+    if (regex->kind == REGEX_NFA && regex->lit && !wcsstr(h + s, regex->lit)) {
+      /* No match: the required literal doesn't occur. */
+    } else if (regex->kind == REGEX_NFA) {
+      /* Scan backwards with the reversed regex in unanchored mode; the
+         first acceptance is at the rightmost position where a match
+         starts. */
+      regex_machine_t regm;
+
+      regex_machine_init(self, &regm, regex_reversed(needle_regex, regex), 1);
+
+      for (i = c_num(slen, self) - 1; i >= s; i--) {
+        regm_result_t res = regex_machine_feed(&regm, h[i]);
+
+        if (res == REGM_MATCH || res == REGM_MATCH_DONE)
+          break;
+
+        if (res == REGM_FAIL) {
+          i = s - 1;
+          break;
+        }
+      }
+
+      regex_machine_cleanup(&regm);
+
+      if (i >= s) {
+        cnum span = regex_run(needle_regex, h + i);
+        gc_hint(haystack);
         return cons(num(i), num(span));
+      }
+    } else {
+      for (i = c_num(slen, self) - 1; i >= s; i--) {
+        cnum span = regex_run(needle_regex, h + i);
+        if (span >= 0)
+          return cons(num(i), num(span));
+      }
     }
 
     gc_hint(haystack);
+  } else if (regex->kind == REGEX_NFA) {
+    struct nfa_search ns;
+    val retval = nil;
+
+    if (length_str_lt(haystack, start))
+      return nil;
+
+    if (regex_str_direct_p(haystack)) {
+      const wchar_t *h = c_str(haystack, self);
+      cnum i, j = c_num(start, self);
+      cnum len = c_num(length_str(haystack), self);
+      regex_machine_t regm;
+      int found;
+
+      if (regex->lit && !wcsstr(h + j, regex->lit))
+        return nil;
+
+      if (regex->first && (j = regex_skip(regex, h, j, len)) >= len)
+        return nil;
+
+      /* Find out whether there is a match at all, using the
+         unanchored machine, which can run as a DFA. */
+      regex_machine_init(self, &regm, needle_regex, 1);
+
+      found = (regm.n.last_accept_pos >= 0);
+
+      for (i = j; !found && i < len; i++) {
+        regm_result_t res = regex_machine_feed(&regm, h[i]);
+
+        if (res == REGM_MATCH || res == REGM_MATCH_DONE)
+          found = 1;
+        else if (res == REGM_FAIL)
+          break;
+      }
+
+      regex_machine_cleanup(&regm);
+
+      if (!found)
+        return nil;
+
+      nfa_search_init(&ns, regex, j, 0);
+
+      for (; j < len && !nfa_search_done(&ns); j++) {
+        if (regex->first && nfa_search_idle(&ns)) {
+          cnum k = regex_skip(regex, h, j, len);
+          if (k >= len)
+            break;
+          nfa_search_skip(&ns, k);
+          j = k;
+        }
+        nfa_search_feed(&ns, h[j]);
+      }
+
+      gc_hint(haystack);
+    } else {
+      val i;
+
+      nfa_search_init(&ns, regex, c_num(start, self), 0);
+
+      uw_simple_catch_begin;
+
+      for (i = start;
+           !nfa_search_done(&ns) && length_str_gt(haystack, i);
+           i = plus(i, one))
+      {
+        nfa_search_feed(&ns, c_chr(chr_str(haystack, i)));
+      }
+
+      uw_unwind {
+        nfa_search_cleanup(&ns);
+      }
+
+      uw_catch_end;
+    }
+
+    if (ns.match_beg >= 0)
+      retval = cons(num(ns.match_beg), num(ns.match_end - ns.match_beg));
+
+    nfa_search_cleanup(&ns);
+    return retval;
   } else {
     regex_machine_t regm;
     val i, pos = start, retval;
@@ -2655,7 +4610,7 @@ val search_regex(val haystack, val needle_regex, val start,
     if (length_str_lt(haystack, pos))
       return nil;
 
-    regex_machine_init(self, &regm, needle_regex);
+    regex_machine_init(self, &regm, needle_regex, 0);
 
 again:
     for (i = pos; length_str_gt(haystack, i); i = plus(i, one)) {
@@ -2678,6 +4633,12 @@ again:
     if (last_res != REGM_MATCH_DONE)
       last_res = regex_machine_feed(&regm, 0);
 
+    if (last_res == REGM_FAIL && length_str_gt(haystack, pos)) {
+      regex_machine_reset(&regm);
+      pos = plus(pos, one);
+      goto again;
+    }
+
     switch (last_res) {
     case REGM_INCOMPLETE:
     case REGM_MATCH:
@@ -2745,13 +4706,34 @@ val range_regex_all(val haystack, val needle_regex, val start, val end)
   return out;
 }
 
+static val match_regex_buf(val self, val buf, val reg, val pos)
+{
+  regex_t *regex = coerce(regex_t *, cobj_handle(self, reg, regex_cls));
+  val u8re = regex_utf8(self, reg, regex);
+  cnum len = c_num(length_buf(buf), self);
+  cnum p = c_num(if3(null_or_missing_p(pos), zero, pos), self), span;
+
+  if (p < 0 && (p += len) < 0)
+    return nil;
+
+  if (p > len)
+    return nil;
+
+  span = regex_run_bytes(self, u8re, buf_get(buf, self) + p, len - p);
+  gc_hint(buf);
+  return if2(span >= 0, num(p + span));
+}
+
 val match_regex(val str, val reg, val pos)
 {
   val self = lit("match-regex");
   regex_machine_t regm;
-  val i, retval;
+  val i, retval = nil;
   regm_result_t last_res = REGM_INCOMPLETE;
 
+  if (bufp(str))
+    return match_regex_buf(self, str, reg, pos);
+
   if (null_or_missing_p(pos)) {
     pos = zero;
   } else if (minusp(pos)) {
@@ -2762,30 +4744,42 @@ val match_regex(val str, val reg, val pos)
     return nil;
   }
 
-  regex_machine_init(self, &regm, reg);
+  regex_machine_init(self, &regm, reg, 0);
 
-  for (i = pos; length_str_gt(str, i); i = plus(i, one)) {
-    last_res = regex_machine_feed(&regm, c_chr(chr_str(str, i)));
-    if (last_res == REGM_FAIL || last_res == REGM_MATCH_DONE)
-      break;
+  uw_simple_catch_begin;
+
+  if (regex_str_direct_p(str)) {
+    const wchar_t *wstr = c_str(str, self);
+    cnum j, len = c_num(length_str(str), self);
+
+    for (j = c_num(pos, self); j < len; j++) {
+      last_res = regex_machine_feed(&regm, wstr[j]);
+      if (last_res == REGM_FAIL || last_res == REGM_MATCH_DONE)
+        break;
+    }
+
+    gc_hint(str);
+  } else {
+    for (i = pos; length_str_gt(str, i); i = plus(i, one)) {
+      last_res = regex_machine_feed(&regm, c_chr(chr_str(str, i)));
+      if (last_res == REGM_FAIL || last_res == REGM_MATCH_DONE)
+        break;
+    }
   }
 
   if (last_res != REGM_MATCH_DONE)
     last_res = regex_machine_feed(&regm, 0);
 
-  switch (last_res) {
-  case REGM_INCOMPLETE:
-  case REGM_MATCH:
-  case REGM_MATCH_DONE:
+  if (last_res != REGM_FAIL)
     retval = plus(pos, num(regex_machine_match_span(&regm)));
+
+  uw_unwind {
     regex_machine_cleanup(&regm);
-    return retval;
-  case REGM_FAIL:
-    regex_machine_cleanup(&regm);
-    return nil;
   }
 
-  return nil;
+  uw_catch_end;
+
+  return retval;
 }
 
 val match_regex_len(val str, val regex, val pos)
@@ -2839,12 +4833,40 @@ val match_regex_right(val str, val regex, val end)
     return nil;
   }
 
+  if (regex_str_direct_p(str)) {
+    regex_t *rx = coerce(regex_t *, cobj_handle(self, regex, regex_cls));
+
+    if (rx->kind == REGEX_NFA) {
+      /* The longest match of the reversed regex, running backwards
+         from end, reaches the leftmost position from which
+         the regex matches up to end. */
+      const wchar_t *h = c_str(str, self);
+      regex_machine_t regm;
+      cnum i, span;
+
+      regex_machine_init(self, &regm, regex_reversed(regex, rx), 0);
+
+      for (i = c_num(end, self) - 1; i >= 0; i--) {
+        regm_result_t res = regex_machine_feed(&regm, h[i]);
+        if (res == REGM_FAIL || res == REGM_MATCH_DONE)
+          break;
+      }
+
+      span = regex_machine_match_span(&regm);
+      regex_machine_cleanup(&regm);
+      gc_hint(str);
+      return if2(span >= 0, num(span));
+    }
+  }
+
   while (le(pos, end)) {
     regex_machine_t regm;
     val i;
     regm_result_t last_res = REGM_INCOMPLETE;
 
-    regex_machine_init(self, &regm, regex);
+    regex_machine_init(self, &regm, regex, 0);
+
+    uw_simple_catch_begin;
 
     for (i = pos; lt(i, end); i = plus(i, one)) {
       last_res = regex_machine_feed(&regm, c_chr(chr_str(str, i)));
@@ -2855,17 +4877,21 @@ val match_regex_right(val str, val regex, val end)
     if (last_res != REGM_MATCH_DONE)
       last_res = regex_machine_feed(&regm, 0);
 
+    uw_unwind {
+      regex_machine_cleanup(&regm);
+    }
+
+    uw_catch_end;
+
     switch (last_res) {
     case REGM_MATCH_DONE:
       if (!lt(plus(i, one), end)) {
     case REGM_MATCH:
-        regex_machine_cleanup(&regm);
         return minus(end, pos);
       }
       /* fallthrough */
     case REGM_INCOMPLETE:
     case REGM_FAIL:
-      regex_machine_cleanup(&regm);
       break;
     }
 
@@ -2892,17 +4918,23 @@ val regex_prefix_match(val reg, val str, val pos)
     return nil;
   }
 
-  regex_machine_init(self, &regm, reg);
+  regex_machine_init(self, &regm, reg, 0);
 
   last_res = regex_machine_infer_init_state(&regm);
 
+  uw_simple_catch_begin;
+
   for (i = pos; length_str_gt(str, i); i = plus(i, one)) {
     last_res = regex_machine_feed(&regm, c_chr(chr_str(str, i)));
     if (last_res == REGM_FAIL || last_res == REGM_MATCH_DONE)
       break;
   }
 
-  regex_machine_cleanup(&regm);
+  uw_unwind {
+    regex_machine_cleanup(&regm);
+  }
+
+  uw_catch_end;
 
   switch (last_res) {
   case REGM_INCOMPLETE:
@@ -3013,178 +5045,976 @@ static val do_match_full(val regex, val str)
    return if2(eql(match_regex(str, regex, zero), length_str(str)), str);
 }
 
-static val do_match_full_offs(val env, val str)
-{
-  cons_bind (regex, pos_in, env);
-  val len = length_str(str);
-  val pos = if3(minusp(pos_in), plus(pos_in, len), pos_in);
-  return if3(minusp(pos),
-             nil,
-             if2(eql(match_regex(str, regex, pos), len),
-                 sub_str(str, pos, t)));
-}
+static val do_match_full_offs(val env, val str)
+{
+  cons_bind (regex, pos_in, env);
+  val len = length_str(str);
+  val pos = if3(minusp(pos_in), plus(pos_in, len), pos_in);
+  return if3(minusp(pos),
+             nil,
+             if2(eql(match_regex(str, regex, pos), len),
+                 sub_str(str, pos, t)));
+}
+
+val regex_match_full_fun(val regex, val pos)
+{
+  if (null_or_missing_p(pos))
+    return func_f1(regex, do_match_full);
+  return func_f1(cons(regex, pos), do_match_full_offs);
+}
+
+static val do_match_left(val regex, val str)
+{
+  return match_regst(str, regex, zero);
+}
+
+static val do_match_left_offs(val env, val str)
+{
+  cons_bind (regex, pos, env);
+  return match_regst(str, regex, pos);
+}
+
+val regex_match_left_fun(val regex, val pos)
+{
+  if (null_or_missing_p(pos))
+    return func_f1(regex, do_match_left);
+  return func_f1(cons(regex, pos), do_match_left_offs);
+}
+
+static val do_match_right(val regex, val str)
+{
+  return match_regst_right(str, regex, nil);
+}
+
+static val do_match_right_offs(val env, val str)
+{
+  cons_bind (regex, end, env);
+  return match_regst_right(str, regex, end);
+}
+
+val regex_match_right_fun(val regex, val end)
+{
+  if (null_or_missing_p(end))
+    return func_f1(regex, do_match_right);
+  return func_f1(cons(regex, end), do_match_right_offs);
+}
+
+val regex_match_full(val regex, val arg1, val arg2)
+{
+  if (null_or_missing_p(arg2)) {
+    val str = arg1;
+    return if2(eql(match_regex(arg1, regex, arg2), length_str(str)), str);
+  } else {
+    val str = arg2;
+    val len = length_str(str);
+    val pos = if3(minusp(arg1), plus(len, arg1), arg1);
+    return if3(minusp(pos),
+               nil,
+               if2(eql(match_regex(str, regex, pos), len),
+                   sub_str(str, pos, t)));
+  }
+}
+
+val regex_match_left(val regex, val arg1, val arg2)
+{
+  if (null_or_missing_p(arg2))
+    return match_regst(arg1, regex, arg2);
+  return match_regst(arg2, regex, arg1);
+}
+
+val regex_match_right(val regex, val arg1, val arg2)
+{
+  if (null_or_missing_p(arg2))
+    return match_regst_right(arg1, regex, arg2);
+  return match_regst_right(arg2, regex, arg1);
+}
+
+val regex_range_full(val regex, val arg1, val arg2)
+{
+  if (null_or_missing_p(arg2)) {
+    val str = arg1;
+    val len = length_str(str);
+    return if2(eql(match_regex(str, regex, zero), len), rcons(zero, len));
+  } else {
+    val str = arg2;
+    val len = length_str(str);
+    val pos = if3(minusp(arg1), plus(len, arg1), arg1);
+    return if3(minusp(pos), nil,
+               if2(eql(match_regex(str, regex, pos), len), rcons(pos, len)));
+  }
+}
+
+val regex_range_left(val regex, val arg1, val arg2)
+{
+  if (null_or_missing_p(arg2)) {
+    val len = match_regex(arg1, regex, arg2);
+    return if2(len, rcons(zero, len));
+  } else {
+    val pos = if3(minusp(arg1), plus(arg1, length_str(arg2)), arg1);
+    val new_pos = if3(minusp(pos), nil, match_regex(arg2, regex, pos));
+    return if2(new_pos, rcons(pos, new_pos));
+  }
+}
+
+val regex_range_right(val regex, val arg1, val arg2)
+{
+  if (null_or_missing_p(arg2)) {
+    val len = match_regex_right(arg1, regex, arg2);
+    if (len) {
+      val slen = length_str(arg1);
+      return rcons(minus(slen, len), slen);
+    } else {
+      return nil;
+    }
+  } else {
+    val end = if3(minusp(arg1), plus(arg1, length_str(arg2)), arg1);
+    val len = match_regex_right(arg2, regex, end);
+    return if2(len, rcons(minus(end, len), end));
+  }
+}
+
+val regex_range_search(val regex, val arg1, val arg2, val arg3)
+{
+  if (missingp(arg2)) {
+    return range_regex(arg1, regex, zero, nil);
+  } else if (missingp(arg3)) {
+    return range_regex(arg2, regex, arg1, nil);
+  } else {
+    return range_regex(arg3, regex, arg1, arg2);
+  }
+}
+
+val regex_range_all(val regex, val arg1, val arg2, val arg3)
+{
+  if (missingp(arg2)) {
+    return range_regex_all(arg1, regex, zero, nil);
+  } else if (missingp(arg3)) {
+    return range_regex_all(arg2, regex, arg1, nil);
+  } else {
+    return range_regex_all(arg3, regex, arg1, arg2);
+  }
+}
+
+val regex_range_full_fun(val regex, val pos)
+{
+  return pa_123_3(func_n3(regex_range_full),
+                  regex, default_arg(pos, zero));
+}
+
+val regex_range_left_fun(val regex, val pos)
+{
+  return pa_123_3(func_n3(regex_range_left),
+                  regex, default_arg(pos, zero));
+}
+
+val regex_range_right_fun(val regex, val end)
+{
+  if (null_or_missing_p(end))
+    return pa_123_2(func_n3(regex_range_right), regex, end);
+  return pa_123_3(func_n3(regex_range_left), regex, end);
+}
+
+val regex_range_search_fun(val regex, val start, val from_end)
+{
+  return pa_1234_1(func_n4(range_regex), regex, start, from_end);
+}
+
+/*
+ * A regex set compiles its member regexes into a single NFA, in which the
+ * acceptance state of each member is replaced by a tag state carrying the
+ * member's index. One unanchored pass of the regex machine over the input
+ * then reveals every member which matches somewhere, since a tag state
+ * appears in the state set at each position where its member's match ends.
+ * DFA states count their tag states, so that states without any can be
+ * passed over cheaply. If a member requires the derivative back-end,
+ * the members are searched one by one instead.
+ */
+typedef struct regex_set {
+  val regexes;
+  val combined;
+  val u8;
+  int dv;
+} regex_set_t;
+
+static val regex_set_s;
+static struct cobj_class *regex_set_cls;
+
+static void regex_set_mark(val obj)
+{
+  regex_set_t *rs = coerce(regex_set_t *, obj->co.handle);
+  gc_mark(rs->regexes);
+  gc_mark(rs->combined);
+  gc_mark(rs->u8);
+}
+
+static struct cobj_ops regex_set_ops = cobj_ops_init(eq,
+                                                     cobj_print_op,
+                                                     cobj_destroy_free_op,
+                                                     regex_set_mark,
+                                                     cobj_eq_hash_op,
+                                                     0);
+
+static val regex_set_combine(val self, val regexes, int u8)
+{
+  cnum i, n = c_num(length_vec(regexes), self);
+  nfa_state_t *start = 0;
+  regex_t *regex;
+  val ret;
+
+  for (i = n - 1; i >= 0; i--) {
+    regex_t *mem = coerce(regex_t *,
+                          cobj_handle(self, regexes->v.vec[i], regex_cls));
+    val exp = reg_optimize(reg_expand_nongreedy(reg_ungroup(mem->source)));
+    nfa_t nfa = nfa_compile_regex(if3(u8, reg_utf8(exp), exp));
+
+    if (!nfa.start)
+      continue;
+
+    nfa_state_empty_convert(nfa.accept, nfa_state_tag(i), 0);
+    start = if3(start, nfa_state_empty(nfa.start, start), nfa.start);
+  }
+
+  if (!start)
+    return nil;
+
+  regex = coerce(regex_t *, chk_malloc(sizeof *regex));
+  regex->kind = REGEX_NFA;
+  regex->ngroups = 0;
+  regex->dfa = regex->udfa = 0;
+  regex->lit = 0;
+  regex->first = 0;
+  regex->first_ch = 0;
+  regex->rev = regex->cap = regex->u8 = nil;
+  regex->source = nil;
+  regex->r.nfa = nfa_optimize(nfa_make(start, 0));
+  regex->nstates = nfa_count_states(regex->r.nfa.start);
+  ret = cobj(coerce(mem_t *, regex), regex_cls, &regex_obj_ops);
+  return ret;
+}
+
+val regex_set(val regexes)
+{
+  val self = lit("regex-set");
+  regex_set_t *rs = coerce(regex_set_t *, chk_calloc(1, sizeof *rs));
+  val vec = vec_seq(regexes), ret;
+  cnum i, n = c_num(length_vec(vec), self);
+
+  rs->regexes = rs->combined = rs->u8 = nil;
+  ret = cobj(coerce(mem_t *, rs), regex_set_cls, &regex_set_ops);
+
+  vec = if3(vec == regexes, copy_vec(vec), vec);
+
+  for (i = 0; i < n; i++) {
+    val re = vec->v.vec[i];
+    regex_t *regex;
+    if (!regexp(re))
+      set(mkloc(vec->v.vec[i], vec), re = regex_compile(re, colon_k));
+    regex = coerce(regex_t *, cobj_handle(self, re, regex_cls));
+    if (regex->kind == REGEX_DV)
+      rs->dv = 1;
+  }
+
+  rs->regexes = vec;
+  setcheck(ret, vec);
+
+  if (!rs->dv) {
+    rs->combined = regex_set_combine(self, vec, 0);
+    setcheck(ret, rs->combined);
+  }
+
+  return ret;
+}
+
+val regex_set_p(val obj)
+{
+  return cobjclassp(obj, regex_set_cls);
+}
+
+static void regex_set_tags(nfa_state_t **set, int nset, char *hit, cnum *nhit)
+{
+  int i;
+
+  for (i = 0; i < nset; i++) {
+    nfa_state_t *s = set[i];
+    if (s->a.kind == nfa_tag && !hit[s->t.tag]) {
+      hit[s->t.tag] = 1;
+      (*nhit)++;
+    }
+  }
+}
+
+static void regex_set_check(regex_machine_t *regm, char *hit, cnum *nhit)
+{
+  dfa_state_t *ds = regm->n.dstate;
+
+  if (!ds)
+    regex_set_tags(regm->n.set, regm->n.nclos, hit, nhit);
+  else if (ds->ntags)
+    regex_set_tags(ds->set, ds->nset, hit, nhit);
+}
+
+/*
+ * Identify the members of the regex set which match somewhere in str,
+ * starting at position start, marking them in the hit array, which
+ * has one element per member. Returns the starting position, or -1
+ * if it is out of range.
+ */
+static cnum regex_set_scan(val self, regex_set_t *rs, val str, val start,
+                           char *hit)
+{
+  val regexes = rs->regexes;
+  cnum i, n = c_num(length_vec(regexes), self);
+  val slen = length_str(str);
+  cnum s;
+
+  start = default_arg(start, zero);
+
+  if (minusp(start)) {
+    start = plus(start, slen);
+    if (minusp(start))
+      start = zero;
+  }
+
+  if (gt(start, slen))
+    return -1;
+
+  s = c_num(start, self);
+
+  if (rs->dv) {
+    for (i = 0; i < n; i++)
+      hit[i] = (search_regex(str, regexes->v.vec[i], start, nil) != nil);
+  } else if (rs->combined) {
+    const wchar_t *h = c_str(str, self), *p;
+    regex_machine_t regm;
+    cnum nhit = 0;
+
+    regex_machine_init(self, &regm, rs->combined, 1);
+
+    uw_simple_catch_begin;
+
+    regex_set_check(&regm, hit, &nhit);
+
+    for (p = h + s; *p != 0 && nhit < n; p++) {
+      regex_machine_feed(&regm, *p);
+      regex_set_check(&regm, hit, &nhit);
+    }
+
+    uw_unwind {
+      regex_machine_cleanup(&regm);
+    }
+
+    uw_catch_end;
+
+    gc_hint(str);
+  }
+
+  return s;
+}
+
+val regex_set_matches(val set, val str, val start)
+{
+  val self = lit("regex-set-matches");
+  regex_set_t *rs = coerce(regex_set_t *,
+                           cobj_handle(self, set, regex_set_cls));
+  cnum i, n = c_num(length_vec(rs->regexes), self);
+  char *hit = coerce(char *, chk_calloc(n + 1, 1));
+  list_collect_decl (out, ptail);
+
+  uw_simple_catch_begin;
+
+  if (regex_set_scan(self, rs, str, start, hit) >= 0) {
+    for (i = 0; i < n; i++)
+      if (hit[i])
+        ptail = list_collect(ptail, num(i));
+  }
+
+  uw_unwind {
+    free(hit);
+  }
+
+  uw_catch_end;
+
+  return out;
+}
+
+val regex_set_search(val set, val str, val start)
+{
+  val self = lit("regex-set-search");
+  regex_set_t *rs = coerce(regex_set_t *,
+                           cobj_handle(self, set, regex_set_cls));
+  val regexes = rs->regexes;
+  cnum i, n = c_num(length_vec(regexes), self);
+  char *hit = coerce(char *, chk_calloc(n + 1, 1));
+  cnum s;
+  list_collect_decl (out, ptail);
+
+  uw_simple_catch_begin;
+
+  if ((s = regex_set_scan(self, rs, str, start, hit)) >= 0) {
+    for (i = 0; i < n; i++) {
+      if (hit[i]) {
+        val m = search_regex(str, regexes->v.vec[i], num(s), nil);
+        ptail = list_collect(ptail, cons(num(i), m));
+      }
+    }
+  }
+
+  uw_unwind {
+    free(hit);
+  }
+
+  uw_catch_end;
+
+  return out;
+}
+
+/*
+ * A regex tokenizer splits the input from a stream into tokens, each
+ * of which is the longest nonempty match of any member of a regex set
+ * at the current position, with ties going to the lowest numbered
+ * member. The input is read in large blocks of bytes, and matched by
+ * the byte-oriented version of the set's combined NFA, so that no
+ * per-character stream operations or decoding take place; only the
+ * text of each token is decoded. A match which reaches the end of the
+ * block causes more input to be appended, the consumed bytes being
+ * discarded or the block grown. Text that no member matches is
+ * gathered into tokens of its own.
+ */
+#define REGEX_TOK_BLOCK 65536
+
+typedef struct regex_tokenizer {
+  val set;
+  val stream;
+  unsigned char *buf;
+  ucnum size, pos, fill;
+  cnum ptag;
+  ucnum plen;
+  int eof;
+} regex_tokenizer_t;
+
+static val regex_tokenizer_s;
+static struct cobj_class *regex_tokenizer_cls;
+
+static void regex_tokenizer_mark(val obj)
+{
+  regex_tokenizer_t *rt = coerce(regex_tokenizer_t *, obj->co.handle);
+  gc_mark(rt->set);
+  gc_mark(rt->stream);
+}
+
+static void regex_tokenizer_destroy(val obj)
+{
+  regex_tokenizer_t *rt = coerce(regex_tokenizer_t *, obj->co.handle);
+  free(rt->buf);
+  free(rt);
+}
+
+static struct cobj_ops regex_tokenizer_ops = cobj_ops_init(eq,
+                                                           cobj_print_op,
+                                                           regex_tokenizer_destroy,
+                                                           regex_tokenizer_mark,
+                                                           cobj_eq_hash_op,
+                                                           0);
+
+val regex_tokenizer(val regexes, val stream_in)
+{
+  val self = lit("regex-tokenizer");
+  val stream = default_arg_strict(stream_in, std_input);
+  val set = if3(regex_set_p(regexes), regexes, regex_set(regexes));
+  regex_set_t *rs = coerce(regex_set_t *, set->co.handle);
+  regex_tokenizer_t *rt;
+  val ret;
+
+  class_check(self, stream, stream_cls);
+
+  if (rs->dv) {
+    uw_throwf(error_s, lit("~a: ~s isn't supported for byte input"),
+              self, set, nao);
+  }
+
+  if (rs->combined && !rs->u8) {
+    rs->u8 = regex_set_combine(self, rs->regexes, 1);
+    setcheck(set, rs->u8);
+  }
+
+  rt = coerce(regex_tokenizer_t *, chk_calloc(1, sizeof *rt));
+  rt->set = rt->stream = nil;
+  rt->ptag = -1;
+  ret = cobj(coerce(mem_t *, rt), regex_tokenizer_cls, &regex_tokenizer_ops);
+  rt->buf = chk_malloc(REGEX_TOK_BLOCK);
+  rt->size = REGEX_TOK_BLOCK;
+  rt->set = set;
+  rt->stream = stream;
+  return ret;
+}
+
+/*
+ * Read more input. The bytes before the current position are
+ * discarded when the buffer is full, if that frees at least half of
+ * it; otherwise the buffer is grown, so that the cost of moving the
+ * bytes is amortized. Returns zero if the end of the stream has been
+ * reached.
+ */
+static int regex_tokenizer_fill(val self, regex_tokenizer_t *rt)
+{
+  ucnum nread;
+
+  if (rt->eof)
+    return 0;
+
+  if (rt->pos == rt->fill) {
+    rt->pos = rt->fill = 0;
+  } else if (rt->fill == rt->size) {
+    if (rt->pos >= rt->size / 2) {
+      memmove(rt->buf, rt->buf + rt->pos, rt->fill - rt->pos);
+      rt->fill -= rt->pos;
+      rt->pos = 0;
+    } else {
+      rt->size *= 2;
+      rt->buf = chk_realloc(rt->buf, rt->size);
+    }
+  }
+
+  nread = c_unum(get_bytes(self, rt->stream, rt->buf + rt->fill,
+                           rt->size - rt->fill), self);
+
+  if (nread == 0) {
+    rt->eof = 1;
+    return 0;
+  }
+
+  rt->fill += nread;
+  return 1;
+}
+
+/*
+ * Lowest numbered member of the set whose match ends
+ * at the current position, or -1.
+ */
+static cnum regex_tokenizer_tag(regex_machine_t *regm)
+{
+  dfa_state_t *ds = regm->n.dstate;
+  nfa_state_t **set = regm->n.set;
+  int i, nset = regm->n.nclos;
+  cnum tag = -1;
+
+  if (ds) {
+    if (!ds->ntags)
+      return -1;
+    set = ds->set;
+    nset = ds->nset;
+  }
+
+  for (i = 0; i < nset; i++) {
+    nfa_state_t *s = set[i];
+    if (s->a.kind == nfa_tag && (tag < 0 || s->t.tag < tag))
+      tag = s->t.tag;
+  }
+
+  return tag;
+}
+
+static val regex_tokenizer_token(regex_tokenizer_t *rt, cnum tag, ucnum len)
+{
+  const char *text = coerce(const char *, rt->buf + rt->pos);
+  val str = string_own(utf8_dup_from_buf(text, len));
+  rt->pos += len;
+  return cons(if2(tag >= 0, num(tag)), str);
+}
+
+/*
+ * The next token is found by first trying for a match at the current
+ * position with the anchored machine, which runs as a DFA. If there
+ * is none, one pass of a leftmost-longest NFA search finds both the
+ * extent of the unmatched text and the match which follows it; that
+ * match is held for the next call.
+ */
+val regex_tokenizer_next(val tokenizer)
+{
+  val self = lit("regex-tokenizer-next");
+  regex_tokenizer_t *rt = coerce(regex_tokenizer_t *,
+                                 cobj_handle(self, tokenizer,
+                                             regex_tokenizer_cls));
+  regex_set_t *rs = coerce(regex_set_t *, rt->set->co.handle);
+  regex_machine_t regm;
+  struct nfa_search ns;
+  val tok = nil;
+
+  if (rt->plen > 0) {
+    tok = regex_tokenizer_token(rt, rt->ptag, rt->plen);
+    rt->ptag = -1;
+    rt->plen = 0;
+    return tok;
+  }
+
+  if (!rs->u8) {
+    while (regex_tokenizer_fill(self, rt))
+      ; /* nothing can match: the rest of the input is one token */
+    if (rt->pos < rt->fill)
+      tok = regex_tokenizer_token(rt, -1, rt->fill - rt->pos);
+    return tok;
+  }
+
+  regex_machine_init(self, &regm, rs->u8, 0);
+  ns.sets = 0;
+  ns.begs = 0;
+
+  uw_simple_catch_begin;
+
+  {
+    ucnum i = 0, len = 0;
+    cnum tag = -1;
+
+    for (;;) {
+      regm_result_t res;
+      cnum t;
+
+      if (rt->pos + i >= rt->fill && !regex_tokenizer_fill(self, rt))
+        break;
+
+      res = regex_machine_feed(&regm, reg_byte_chr(rt->buf[rt->pos + i++]));
+
+      if ((t = regex_tokenizer_tag(&regm)) >= 0) {
+        tag = t;
+        len = i;
+      }
+
+      if (res == REGM_FAIL)
+        break;
+    }
+
+    if (len > 0) {
+      tok = regex_tokenizer_token(rt, tag, len);
+    } else if (rt->pos < rt->fill) {
+      regex_t *u8 = coerce(regex_t *, rs->u8->co.handle);
+      ucnum gap;
+
+      nfa_search_init(&ns, u8, 0, 1);
+
+      for (i = 0; !nfa_search_done(&ns); i++) {
+        if (rt->pos + i >= rt->fill && !regex_tokenizer_fill(self, rt))
+          break;
+        nfa_search_feed(&ns, reg_byte_chr(rt->buf[rt->pos + i]));
+      }
+
+      if (ns.match_beg >= 0) {
+        gap = ns.match_beg;
+        rt->ptag = ns.match_tag;
+        rt->plen = ns.match_end - ns.match_beg;
+      } else {
+        gap = rt->fill - rt->pos;
+      }
+
+      tok = regex_tokenizer_token(rt, -1, gap);
+    }
+  }
 
-val regex_match_full_fun(val regex, val pos)
-{
-  if (null_or_missing_p(pos))
-    return func_f1(regex, do_match_full);
-  return func_f1(cons(regex, pos), do_match_full_offs);
-}
+  uw_unwind {
+    regex_machine_cleanup(&regm);
+    nfa_search_cleanup(&ns);
+  }
 
-static val do_match_left(val regex, val str)
-{
-  return match_regst(str, regex, zero);
-}
+  uw_catch_end;
 
-static val do_match_left_offs(val env, val str)
-{
-  cons_bind (regex, pos, env);
-  return match_regst(str, regex, pos);
+  return tok;
 }
 
-val regex_match_left_fun(val regex, val pos)
+static val regex_tokenize_lazy(val tokenizer, val lcons)
 {
-  if (null_or_missing_p(pos))
-    return func_f1(regex, do_match_left);
-  return func_f1(cons(regex, pos), do_match_left_offs);
+  val tok = regex_tokenizer_next(tokenizer);
+  us_rplacd(lcons, if2(tok, make_lazy_cons_car(us_lcons_fun(lcons), tok)));
+  return nil;
 }
 
-static val do_match_right(val regex, val str)
+val regex_tokenize(val regexes, val stream)
 {
-  return match_regst_right(str, regex, nil);
+  val tokenizer = regex_tokenizer(regexes, stream);
+  val tok = regex_tokenizer_next(tokenizer);
+  if (!tok)
+    return nil;
+  return make_lazy_cons_car(func_f1(tokenizer, regex_tokenize_lazy), tok);
 }
 
-static val do_match_right_offs(val env, val str)
-{
-  cons_bind (regex, end, env);
-  return match_regst_right(str, regex, end);
+/*
+ * Capture groups are matched by a separate NFA, which is built on first
+ * use from the regex's source syntax, without optimization, so that the
+ * groups are retained. Each group is bracketed by a pair of save states.
+ * The NFA is simulated in the manner of a Pike VM: each thread carries
+ * its own vector of capture slots, and threads are kept in priority
+ * order, so that when more than one thread reaches the same state,
+ * the higher priority one claims it. The overall match is leftmost and
+ * longest, like that of search-regex; among threads which produce the
+ * same overall match, the submatches of the highest priority one are
+ * reported, which favors the left branch of an alternative and more
+ * repetitions of a greedy operator.
+ */
+struct nfa_capture {
+  int nstates;
+  int ncap;
+  unsigned visited;
+  int nclos;
+  cnum pos;
+  nfa_state_t **set, **nset, **sets;
+  cnum *caps, *ncaps, *capv;
+  cnum *match;
+};
+
+static val regex_captures(val self, val compiled_regex, regex_t *regex)
+{
+  if (!regex->cap) {
+    val src = regex->source;
+    int count;
+    val exp;
+    regex_t *cre;
+
+    count = 1;
+    exp = reg_number_groups(reg_nary_to_bin(src), &count);
+    exp = reg_optimize(reg_expand_nongreedy(exp));
+
+    /* The optimizer reduces an expression that can't match anything
+       to t, which the NFA compiler only handles as an empty set. */
+    if (exp == t)
+      exp = cons(set_s, nil);
+
+    if (regex_requires_dv(exp))
+      uw_throwf(error_s, lit("~a: capture groups not supported for ~s"),
+                self, compiled_regex, nao);
+
+    exp = list(rgroup_s, exp, zero, nao);
+
+    cre = coerce(regex_t *, chk_malloc(sizeof *cre));
+    cre->kind = REGEX_NFA;
+    cre->nstates = 0;
+    cre->ngroups = count;
+    cre->dfa = cre->udfa = 0;
+    cre->lit = 0;
+    cre->first = 0;
+    cre->first_ch = 0;
+    cre->rev = cre->cap = cre->u8 = nil;
+    cre->source = nil;
+    cre->r.nfa = nfa_make(0, 0);
+    regex->cap = cobj(coerce(mem_t *, cre), regex_cls, &regex_obj_ops);
+    setcheck(compiled_regex, regex->cap);
+    cre->r.nfa = nfa_compile_regex(exp);
+    cre->nstates = nfa_count_states(cre->r.nfa.start);
+  }
+
+  return regex->cap;
 }
 
-val regex_match_right_fun(val regex, val end)
+static void nfa_capture_accept(struct nfa_capture *nc, cnum *cap)
 {
-  if (null_or_missing_p(end))
-    return func_f1(regex, do_match_right);
-  return func_f1(cons(regex, end), do_match_right_offs);
+  cnum *match = nc->match;
+
+  if (match[0] < 0 || cap[0] < match[0] ||
+      (cap[0] == match[0] && cap[1] > match[1]))
+  {
+    memcpy(match, cap, nc->ncap * sizeof *cap);
+  }
 }
 
-val regex_match_full(val regex, val arg1, val arg2)
+static int nfa_capture_add(struct nfa_capture *nc, nfa_state_t **set,
+                           cnum *caps, int nout, nfa_state_t *s, cnum *cap)
 {
-  if (null_or_missing_p(arg2)) {
-    val str = arg1;
-    return if2(eql(match_regex(arg1, regex, arg2), length_str(str)), str);
-  } else {
-    val str = arg2;
-    val len = length_str(str);
-    val pos = if3(minusp(arg1), plus(len, arg1), arg1);
-    return if3(minusp(pos),
-               nil,
-               if2(eql(match_regex(str, regex, pos), len),
-                   sub_str(str, pos, t)));
+  if (!nfa_test_set_visited(s, nc->visited))
+    return nout;
+
+  switch (s->a.kind) {
+  case nfa_save:
+    {
+      int slot = s->t.tag;
+      cnum saved = cap[slot];
+      cap[slot] = nc->pos;
+      nout = nfa_capture_add(nc, set, caps, nout, s->t.trans, cap);
+      cap[slot] = saved;
+    }
+    break;
+  case nfa_accept:
+    nfa_capture_accept(nc, cap);
+    /* fallthrough */
+  case nfa_empty:
+    nout = nfa_capture_add(nc, set, caps, nout, s->e.trans0, cap);
+    nout = nfa_capture_add(nc, set, caps, nout, s->e.trans1, cap);
+    break;
+  default:
+    bug_unless (nout < nc->nstates);
+    set[nout] = s;
+    memcpy(caps + nout * nc->ncap, cap, nc->ncap * sizeof *cap);
+    nout++;
+    break;
   }
+
+  return nout;
 }
 
-val regex_match_left(val regex, val arg1, val arg2)
+/*
+ * Start a new thread at the current position; the caller has
+ * stamped nc->visited.
+ */
+static void nfa_capture_start(struct nfa_capture *nc, nfa_state_t *start)
 {
-  if (null_or_missing_p(arg2))
-    return match_regst(arg1, regex, arg2);
-  return match_regst(arg2, regex, arg1);
+  cnum *fresh = coerce(cnum *, alloca(nc->ncap * sizeof *fresh));
+  int i;
+
+  for (i = 0; i < nc->ncap; i++)
+    fresh[i] = -1;
+
+  nc->nclos = nfa_capture_add(nc, nc->set, nc->caps, nc->nclos, start, fresh);
 }
 
-val regex_match_right(val regex, val arg1, val arg2)
+static void nfa_capture_restart(struct nfa_capture *nc, nfa_state_t *start)
 {
-  if (null_or_missing_p(arg2))
-    return match_regst_right(arg1, regex, arg2);
-  return match_regst_right(arg2, regex, arg1);
+  nc->visited = start->a.visited + 1;
+  nfa_handle_wraparound(start, &nc->visited);
+  nc->nclos = 0;
+  nfa_capture_start(nc, start);
+  start->a.visited = nc->visited;
 }
 
-val regex_range_full(val regex, val arg1, val arg2)
+static void nfa_capture_feed(struct nfa_capture *nc, nfa_state_t *start,
+                             wchar_t ch, int anchored)
 {
-  if (null_or_missing_p(arg2)) {
-    val str = arg1;
-    val len = length_str(str);
-    return if2(eql(match_regex(str, regex, zero), len), rcons(zero, len));
-  } else {
-    val str = arg2;
-    val len = length_str(str);
-    val pos = if3(minusp(arg1), plus(len, arg1), arg1);
-    return if3(minusp(pos), nil,
-               if2(eql(match_regex(str, regex, pos), len), rcons(pos, len)));
+  nfa_state_t **set = nc->set, **nset = nc->nset;
+  cnum *caps = nc->caps, *ncaps = nc->ncaps;
+  cnum *match = nc->match;
+  int i, nout = 0;
+
+  nc->visited = start->a.visited + 1;
+  nfa_handle_wraparound(start, &nc->visited);
+  nc->pos++;
+
+  for (i = 0; i < nc->nclos; i++) {
+    nfa_state_t *s = set[i];
+    cnum *cap = caps + i * nc->ncap;
+
+    if (match[0] >= 0 && cap[0] > match[0])
+      break;
+
+    switch (s->a.kind) {
+    case nfa_wild:
+      break;
+    case nfa_single:
+      if (s->o.ch == ch)
+        break;
+      continue;
+    case nfa_set:
+      if (char_set_contains(s->s.set, ch))
+        break;
+      continue;
+    default:
+      continue;
+    }
+
+    nout = nfa_capture_add(nc, nset, ncaps, nout, s->o.trans, cap);
   }
+
+  nc->set = nset;
+  nc->nset = set;
+  nc->caps = ncaps;
+  nc->ncaps = caps;
+  nc->nclos = nout;
+
+  if (match[0] < 0 && !anchored)
+    nfa_capture_start(nc, start);
+
+  start->a.visited = nc->visited;
 }
 
-val regex_range_left(val regex, val arg1, val arg2)
+static val regex_groups(val self, val regex, val str, val start, int anchored)
 {
-  if (null_or_missing_p(arg2)) {
-    val len = match_regex(arg1, regex, arg2);
-    return if2(len, rcons(zero, len));
-  } else {
-    val pos = if3(minusp(arg1), plus(arg1, length_str(arg2)), arg1);
-    val new_pos = if3(minusp(pos), nil, match_regex(arg2, regex, pos));
-    return if2(new_pos, rcons(pos, new_pos));
+  regex_t *re = coerce(regex_t *, cobj_handle(self, regex, regex_cls));
+  regex_t *cre = coerce(regex_t *,
+                        regex_captures(self, regex, re)->co.handle);
+  nfa_state_t *nstart = cre->r.nfa.start;
+  val slen = length_str(str);
+  const wchar_t *h = c_str(str, self);
+  struct nfa_capture nc;
+  cnum len = c_num(slen, self), pos, i;
+  val ret = nil;
+
+  start = default_arg(start, zero);
+
+  if (minusp(start)) {
+    start = plus(start, slen);
+    if (minusp(start))
+      start = zero;
   }
-}
 
-val regex_range_right(val regex, val arg1, val arg2)
-{
-  if (null_or_missing_p(arg2)) {
-    val len = match_regex_right(arg1, regex, arg2);
-    if (len) {
-      val slen = length_str(arg1);
-      return rcons(minus(slen, len), slen);
-    } else {
+  if (gt(start, slen))
+    return nil;
+
+  pos = c_num(start, self);
+
+  if (!anchored && re->kind == REGEX_NFA) {
+    if (re->lit && !wcsstr(h + pos, re->lit))
+      return nil;
+    if (re->first && (pos = regex_skip(re, h, pos, len)) >= len)
       return nil;
-    }
-  } else {
-    val end = if3(minusp(arg1), plus(arg1, length_str(arg2)), arg1);
-    val len = match_regex_right(arg2, regex, end);
-    return if2(len, rcons(minus(end, len), end));
   }
-}
 
-val regex_range_search(val regex, val arg1, val arg2, val arg3)
-{
-  if (missingp(arg2)) {
-    return range_regex(arg1, regex, zero, nil);
-  } else if (missingp(arg3)) {
-    return range_regex(arg2, regex, arg1, nil);
-  } else {
-    return range_regex(arg3, regex, arg1, arg2);
-  }
-}
+  nc.nstates = cre->nstates;
+  nc.ncap = 2 * cre->ngroups;
+  nc.sets = coerce(nfa_state_t **,
+                   chk_malloc(2 * nc.nstates * sizeof *nc.sets));
+  nc.set = nc.sets;
+  nc.nset = nc.sets + nc.nstates;
+  nc.capv = coerce(cnum *, chk_malloc((2 * nc.nstates + 1) * nc.ncap *
+                                      sizeof *nc.capv));
+  nc.caps = nc.capv;
+  nc.ncaps = nc.capv + nc.nstates * nc.ncap;
+  nc.match = nc.ncaps + nc.nstates * nc.ncap;
+  nc.match[0] = -1;
+  nc.pos = pos;
+
+  nfa_capture_restart(&nc, nstart);
+
+  while (pos < len) {
+    if (nc.match[0] < 0 && !anchored && re->first &&
+        (nc.nclos == 0 || nc.caps[0] == pos))
+    {
+      /* Idle: skip to where a match can begin. */
+      cnum npos = regex_skip(re, h, pos, len);
 
-val regex_range_all(val regex, val arg1, val arg2, val arg3)
-{
-  if (missingp(arg2)) {
-    return range_regex_all(arg1, regex, zero, nil);
-  } else if (missingp(arg3)) {
-    return range_regex_all(arg2, regex, arg1, nil);
-  } else {
-    return range_regex_all(arg3, regex, arg1, arg2);
+      if (npos >= len)
+        break;
+
+      if (npos > pos) {
+        nc.pos = pos = npos;
+        nfa_capture_restart(&nc, nstart);
+      }
+    } else if (nc.nclos == 0 && (nc.match[0] >= 0 || anchored)) {
+      break;
+    }
+
+    nfa_capture_feed(&nc, nstart, h[pos++], anchored);
   }
-}
 
-val regex_range_full_fun(val regex, val pos)
-{
-  return pa_123_3(func_n3(regex_range_full),
-                  regex, default_arg(pos, zero));
-}
+  if (nc.match[0] >= 0) {
+    list_collect_decl (out, ptail);
 
-val regex_range_left_fun(val regex, val pos)
-{
-  return pa_123_3(func_n3(regex_range_left),
-                  regex, default_arg(pos, zero));
+    for (i = 0; i < nc.ncap; i += 2) {
+      cnum from = nc.match[i], to = nc.match[i + 1];
+      ptail = list_collect(ptail, if2(from >= 0 && to >= from,
+                                      rcons(num(from), num(to))));
+    }
+
+    ret = out;
+  }
+
+  free(nc.sets);
+  free(nc.capv);
+  gc_hint(str);
+  return ret;
 }
 
-val regex_range_right_fun(val regex, val end)
+val regex_match_groups(val regex, val str, val pos)
 {
-  if (null_or_missing_p(end))
-    return pa_123_2(func_n3(regex_range_right), regex, end);
-  return pa_123_3(func_n3(regex_range_left), regex, end);
+  return regex_groups(lit("regex-match-groups"), regex, str, pos, 1);
 }
 
-val regex_range_search_fun(val regex, val start, val from_end)
+val regex_search_groups(val regex, val str, val start)
 {
-  return pa_1234_1(func_n4(range_regex), regex, start, from_end);
+  return regex_groups(lit("regex-search-groups"), regex, str, start, 0);
 }
 
 static val scan_until_common(val self, val regex, val stream_in,
@@ -3198,7 +6028,9 @@ static val scan_until_common(val self, val regex, val stream_in,
   val stream = default_arg(stream_in, std_input);
   val include_match = default_null_arg(include_match_in);
 
-  regex_machine_init(self, &regm, regex);
+  regex_machine_init(self, &regm, regex, 0);
+
+  uw_simple_catch_begin;
 
   for (;;) {
     val ch = get_char(stream);
@@ -3270,7 +6102,11 @@ out_match:
     }
   }
 
-  regex_machine_cleanup(&regm);
+  uw_unwind {
+    regex_machine_cleanup(&regm);
+  }
+
+  uw_catch_end;
 
   while (stack)
     rcyc_pop(&stack);
@@ -3294,6 +6130,97 @@ val count_until_match(val regex, val stream_in)
   return scan_until_common(lit("count-until-match"), regex, stream_in, nil, nil);
 }
 
+/*
+ * Byte-oriented read-until-match. The bytes of the current match
+ * attempt are queued, so that a failed attempt can be restarted at the
+ * next byte without pushing bytes back into the stream. Only the bytes
+ * read past the end of the match are pushed back.
+ */
+val read_buf_until_match(val regex, val stream_in, val include_match_in)
+{
+  val self = lit("read-buf-until-match");
+  regex_t *rx = coerce(regex_t *, cobj_handle(self, regex, regex_cls));
+  val u8re = regex_utf8(self, regex, rx);
+  val stream = default_arg(stream_in, std_input);
+  val include_match = default_null_arg(include_match_in);
+  regex_machine_t regm;
+  unsigned char *q = 0, *out = 0;
+  cnum qlen = 0, qalloc = 0, qpos = 0, olen = 0, oalloc = 0;
+  cnum mlen = -1;
+  int eof = 0;
+  val result = nil;
+
+  regex_machine_init(self, &regm, u8re, 0);
+
+  uw_simple_catch_begin;
+
+  for (;;) {
+    regm_result_t res = REGM_FAIL;
+
+    if (qpos < qlen) {
+      res = regex_machine_feed(&regm, reg_byte_chr(q[qpos++]));
+    } else if (!eof) {
+      val byte = get_byte(stream);
+
+      if (byte) {
+        if (qlen == qalloc) {
+          qalloc = qalloc * 2 + 64;
+          q = coerce(unsigned char *, chk_realloc(q, qalloc));
+        }
+        q[qlen++] = c_int(byte, self);
+        qpos++;
+        res = regex_machine_feed(&regm, reg_byte_chr(q[qpos - 1]));
+      } else {
+        eof = 1;
+      }
+    }
+
+    if (res == REGM_MATCH || res == REGM_MATCH_DONE)
+      mlen = qpos;
+
+    if (res == REGM_MATCH || res == REGM_INCOMPLETE)
+      continue;
+
+    if (mlen >= 0 || qlen == 0)
+      break;
+
+    /* No match begins with the first queued byte. */
+    if (olen == oalloc) {
+      oalloc = oalloc * 2 + 64;
+      out = coerce(unsigned char *, chk_realloc(out, oalloc));
+    }
+
+    out[olen++] = q[0];
+    memmove(q, q + 1, --qlen);
+    qpos = 0;
+    regex_machine_reset(&regm);
+  }
+
+  if (mlen >= 0 || olen > 0) {
+    while (qlen > mlen && qlen > 0)
+      unget_byte(num_fast(q[--qlen]), stream);
+
+    if (include_match && qlen > 0) {
+      out = coerce(unsigned char *, chk_realloc(out, olen + qlen));
+      memcpy(out + olen, q, qlen);
+      olen += qlen;
+    }
+
+    result = make_owned_buf(unum(olen), out);
+    out = 0;
+  }
+
+  uw_unwind {
+    regex_machine_cleanup(&regm);
+    free(q);
+    free(out);
+  }
+
+  uw_catch_end;
+
+  return result;
+}
+
 static val trim_left(val regex, val string)
 {
   if (regexp(regex)) {
@@ -3376,6 +6303,7 @@ static char_set_t *create_wide_cs(void)
   char_set_add_range(cs, 0x30000, 0x3FFFF);
 #endif
 
+  char_set_finish(cs);
   return cs;
 }
 
@@ -3407,9 +6335,30 @@ void regex_init(void)
   regex_cls = cobj_register(regex_s);
   chset_cls = cobj_register(chset_s);
 
+  regex_set_s = intern(lit("regex-set"), user_package);
+  regex_set_cls = cobj_register(regex_set_s);
+
+  regex_tokenizer_s = intern(lit("regex-tokenizer"), user_package);
+  regex_tokenizer_cls = cobj_register(regex_tokenizer_s);
+
+  count_k = intern(lit("count"), keyword_package);
+  bytes_k = intern(lit("bytes"), keyword_package);
+  hits_k = intern(lit("hits"), keyword_package);
+  misses_k = intern(lit("misses"), keyword_package);
+  evictions_k = intern(lit("evictions"), keyword_package);
+
+  prot1(&regex_cache);
+  regex_cache = make_hash(hash_weak_none, t);
+  regex_cache_size_s = intern(lit("*regex-cache-size*"), user_package);
+  reg_var(regex_cache_size_s, num_fast(256));
+  regex_cache_bytes_s = intern(lit("*regex-cache-bytes*"), user_package);
+  reg_var(regex_cache_bytes_s, num_fast(4 * 1024 * 1024));
+
   reg_fun(intern(lit("regex-compile"), user_package), func_n2o(regex_compile, 1));
   reg_fun(intern(lit("regexp"), user_package), func_n1(regexp));
   reg_fun(intern(lit("regex-source"), user_package), func_n1(regex_source));
+  reg_fun(intern(lit("regex-cache-stats"), user_package), func_n0(regex_cache_stats));
+  reg_fun(intern(lit("regex-cache-clear"), user_package), func_n0(regex_cache_clear));
   reg_fun(intern(lit("search-regex"), user_package), func_n4o(search_regex, 2));
   reg_fun(intern(lit("range-regex"), user_package), func_n4o(range_regex, 2));
   reg_fun(intern(lit("search-regst"), user_package), func_n4o(search_regst, 2));
@@ -3422,6 +6371,21 @@ void regex_init(void)
   reg_fun(intern(lit("regex-prefix-match"), user_package),
           func_n3o(regex_prefix_match, 2));
   reg_fun(intern(lit("regsub"), user_package), func_n3(regsub));
+  reg_fun(intern(lit("regex-match-groups"), user_package),
+          func_n3o(regex_match_groups, 2));
+  reg_fun(intern(lit("regex-search-groups"), user_package),
+          func_n3o(regex_search_groups, 2));
+  reg_fun(regex_set_s, func_n1(regex_set));
+  reg_fun(intern(lit("regex-set-p"), user_package), func_n1(regex_set_p));
+  reg_fun(intern(lit("regex-set-matches"), user_package),
+          func_n3o(regex_set_matches, 2));
+  reg_fun(intern(lit("regex-set-search"), user_package),
+          func_n3o(regex_set_search, 2));
+  reg_fun(regex_tokenizer_s, func_n2o(regex_tokenizer, 1));
+  reg_fun(intern(lit("regex-tokenizer-next"), user_package),
+          func_n1(regex_tokenizer_next));
+  reg_fun(intern(lit("regex-tokenize"), user_package),
+          func_n2o(regex_tokenize, 1));
   reg_fun(intern(lit("regex-parse"), user_package), func_n2o(regex_parse, 1));
 
   reg_fun(intern(lit("reg-expand-nongreedy"), system_package),
@@ -3430,6 +6394,7 @@ void regex_init(void)
   reg_fun(intern(lit("read-until-match"), user_package), func_n3o(read_until_match, 1));
   reg_fun(intern(lit("scan-until-match"), user_package), func_n2(scan_until_match));
   reg_fun(intern(lit("count-until-match"), user_package), func_n2(count_until_match));
+  reg_fun(intern(lit("read-buf-until-match"), user_package), func_n3o(read_buf_until_match, 1));
   reg_fun(intern(lit("f^$"), user_package), func_n2o(regex_match_full_fun, 1));
   reg_fun(intern(lit("f^"), user_package), func_n2o(regex_match_left_fun, 1));
   reg_fun(intern(lit("f$"), user_package), func_n2o(regex_match_right_fun, 1));
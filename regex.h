@@ -34,6 +34,8 @@ extern struct cobj_class *regex_cls;
 extern wchar_t spaces[];
 
 val regex_compile(val regex, val error_stream);
+val regex_cache_stats(void);
+val regex_cache_clear(void);
 val regexp(val);
 val regex_source(val regex);
 val search_regex(val haystack, val needle_regex, val start_num, val from_end);
@@ -48,6 +50,7 @@ val match_regst_right(val str, val regex, val end);
 val regex_prefix_match(val reg, val str, val pos);
 val regsub(val regex, val repl, val str);
 val read_until_match(val regex, val stream, val keep_match);
+val read_buf_until_match(val regex, val stream, val keep_match);
 val scan_until_match(val regex, val stream_in);
 val count_until_match(val regex, val stream_in);
 val regex_match_full(val regex, val arg1, val arg2);
@@ -65,6 +68,16 @@ val regex_range_full_fun(val regex, val pos);
 val regex_range_left_fun(val regex, val pos);
 val regex_range_right_fun(val regex, val end);
 val regex_range_search_fun(val regex, val start, val from_end);
+val regex_group(val exp);
+val regex_match_groups(val regex, val str, val pos);
+val regex_search_groups(val regex, val str, val start);
+val regex_set(val regexes);
+val regex_set_p(val obj);
+val regex_set_matches(val set, val str, val start);
+val regex_set_search(val set, val str, val start);
+val regex_tokenizer(val regexes, val stream);
+val regex_tokenizer_next(val tokenizer);
+val regex_tokenize(val regexes, val stream);
 int wide_display_char_p(wchar_t ch);
 void regex_init(void);
 void regex_compat_fixup(int compat_ver);
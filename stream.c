@@ -61,6 +61,20 @@
 #if HAVE_ZLIB
 #include <zlib.h>
 #endif
+#if HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if HAVE_FREADAHEAD
+#include <stdio_ext.h>
+#endif
+#if HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #include "alloca.h"
 #include "lib.h"
 #include "gc.h"
@@ -523,10 +537,21 @@ struct stdio_handle {
   utf8_decoder_t ud;
   val err;
   char *buf;
+#if HAVE_GETLINE
+  char *lbuf;
+  size_t lsize;
+  char *lpart;
+  size_t npart;
+#endif
 #if HAVE_FORK_STUFF
   pid_t pid;
 #endif
   val mode; /* used by tail */
+#if HAVE_INOTIFY
+  int ifd, iwd_dir; /* used by tail */
+  dev_t wdev; /* used by tail */
+  ino_t wino; /* used by tail */
+#endif
   unsigned is_rotated : 8; /* used by tail */
   unsigned is_real_time : 8;
   unsigned is_byte_oriented : 8;
@@ -541,6 +566,11 @@ struct stdio_handle {
 #endif
 };
 
+#if HAVE_GETLINE
+static void stdio_spill_part(val stream);
+static size_t stdio_take_part(struct stdio_handle *h, mem_t *ptr, size_t len);
+#endif
+
 static void stdio_stream_print(val stream, val out, val pretty,
                                struct strm_ctx *ctx)
 {
@@ -564,6 +594,10 @@ static void stdio_stream_destroy(val stream)
   close_stream(stream, nil);
   strm_base_cleanup(&h->a);
   free(h->buf);
+#if HAVE_GETLINE
+  free(h->lbuf);
+  free(h->lpart);
+#endif
   free(h);
 }
 
@@ -605,8 +639,11 @@ static val stdio_maybe_read_error(val stream)
     val err = num(eno);
     h->err = err;
 #ifdef EAGAIN
-    if (eno == EAGAIN)
+    if (eno == EAGAIN) {
+      /* Let the read be retried when more data is available. */
+      clearerr(h->f);
       uw_ethrowf(timeout_error_s, lit("timed out reading ~s"), stream, nao);
+    }
 #endif
     uw_ethrowf(file_error_s, lit("error reading ~s: ~d/~s"),
                stream, err, errno_to_string(err), nao);
@@ -658,6 +695,15 @@ static int se_fflush(FILE *f)
   return ret;
 }
 
+static size_t se_fwrite(const void *ptr, size_t n, FILE *f)
+{
+  size_t ret;
+  sig_save_enable;
+  ret = fwrite(ptr, 1, n, f);
+  sig_restore_enable;
+  return ret;
+}
+
 #if CONFIG_STDIO_STRICT
 static void stdio_switch(struct stdio_handle *h, enum stdio_op op)
 {
@@ -702,12 +748,20 @@ static val stdio_put_string(val stream, val str)
 
   if (h->f != 0) {
     const wchar_t *s = c_str(str, self);
+    unsigned char chunk[1024];
 
     stdio_switch(h, stdio_write);
 
     while (*s) {
-      if (!utf8_encode(*s++, stdio_put_char_callback, coerce(mem_t *, h->f)))
+      size_t n = utf8_encode_buf(chunk, sizeof chunk, &s);
+
+      if (n == 0) {
+        /* diagnose unencodable character */
+        utf8_encode(*s, stdio_put_char_callback, coerce(mem_t *, h->f));
+        s++;
+      } else if (se_fwrite(chunk, n, h->f) != n) {
         return stdio_maybe_error(stream, lit("writing"));
+      }
     }
     return t;
   }
@@ -717,9 +771,13 @@ static val stdio_put_string(val stream, val str)
 static val stdio_put_char(val stream, val ch)
 {
   struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+  wchar_t wch = c_chr(ch);
   errno = 0;
   stdio_switch(h, stdio_write);
-  return h->f != 0 && utf8_encode(c_chr(ch), stdio_put_char_callback,
+  if (h->f != 0 && wch < 0x80)
+    return se_putc(wch, h->f) != EOF
+           ? t : stdio_maybe_error(stream, lit("writing"));
+  return h->f != 0 && utf8_encode(wch, stdio_put_char_callback,
                                   coerce(mem_t *, h->f))
          ? t : stdio_maybe_error(stream, lit("writing"));
 }
@@ -758,6 +816,9 @@ static val stdio_seek(val stream, val offset, enum strm_whence whence)
       if (stdio_fseek(h->f, offset, whence)) {
         utf8_decoder_init(&h->ud);
         h->unget_c = nil;
+#if HAVE_GETLINE
+        h->npart = 0;
+#endif
         return t;
       }
     }
@@ -889,6 +950,10 @@ static val stdio_get_char(val stream)
 {
   struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
 
+#if HAVE_GETLINE
+  stdio_spill_part(stream);
+#endif
+
   if (h->unget_c)
     return rcyc_pop(&h->unget_c);
 
@@ -911,10 +976,191 @@ static val stdio_get_char(val stream)
   return stdio_maybe_read_error(stream);
 }
 
+#if HAVE_GETLINE || HAVE_MMAP
+
+/* Convert the bytes of one line, without its terminating newline,
+ * to a string. The result is the same as what is obtained by reading
+ * those bytes through utf8_decode, or one byte per character if
+ * byte_oriented is true.
+ */
+static val decode_line(const unsigned char *src, const unsigned char *end,
+                       int byte_oriented)
+{
+  wchar_t *volatile buf = 0;
+  wchar_t *dst;
+  val out = nil;
+
+  uw_simple_catch_begin;
+
+  buf = dst = chk_wmalloc(end - src + 1);
+
+  /* Copy the ASCII prefix directly; what remains,
+   * if anything, goes through the UTF-8 decoder.
+   */
+  while (src < end && *src < 0x80 && *src != 0)
+    *dst++ = *src++;
+
+  if (src == end) {
+    *dst = 0;
+  } else if (byte_oriented) {
+    while (src < end) {
+      int ch = *src++;
+      *dst++ = ch ? ch : 0xDC00;
+    }
+    *dst = 0;
+  } else {
+    size_t nchar = utf8_from_buf(dst, src, end - src);
+    wchar_t *sbuf = coerce(wchar_t *,
+                           chk_realloc(coerce(mem_t *, buf),
+                                       (dst - buf + nchar) * sizeof *buf));
+    if (sbuf)
+      buf = sbuf;
+  }
+
+  out = string_own(buf);
+  buf = 0;
+
+  uw_unwind {
+    free(buf);
+  }
+
+  uw_catch_end;
+
+  return out;
+}
+
+#endif
+
+#if HAVE_GETLINE
+
+static int stdio_would_block(struct stdio_handle *h)
+{
+#ifdef EAGAIN
+  return ferror(h->f) && errno == EAGAIN;
+#else
+  (void) h;
+  return 0;
+#endif
+}
+
+/* Bytes of a line whose reading was cut short on a non-blocking
+ * stream are kept in lpart. Other input operations must see them
+ * first: for character input, they are converted to pushed-back
+ * characters, and byte input takes them directly.
+ */
+static void stdio_spill_part(val stream)
+{
+  struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+
+  if (h->npart != 0) {
+    const unsigned char *src = coerce(const unsigned char *, h->lpart);
+    val str = decode_line(src, src + h->npart, h->is_byte_oriented);
+    h->npart = 0;
+    set(mkloc(h->unget_c, stream), append2(h->unget_c, list_str(str)));
+  }
+}
+
+static size_t stdio_take_part(struct stdio_handle *h, mem_t *ptr, size_t len)
+{
+  size_t n = min(len, h->npart);
+  memcpy(ptr, h->lpart, n);
+  memmove(h->lpart, h->lpart + n, h->npart - n);
+  h->npart -= n;
+  return n;
+}
+
+static ssize_t se_getline(char **pline, size_t *psize, FILE *f)
+{
+  ssize_t ret;
+  sig_save_enable;
+  ret = getline(pline, psize, f);
+  sig_restore_enable;
+  return ret;
+}
+
+static val stdio_get_line(val stream)
+{
+  struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+  ssize_t nbytes;
+  const unsigned char *src, *end;
+  val out;
+  int nl;
+
+  /* Pushed back characters, or bytes held in the decoder
+   * from a previous character-wise read, must come first;
+   * leave those cases to the character-at-a-time function.
+   */
+  if (h->unget_c || h->f == 0 ||
+      h->ud.state != utf8_init || h->ud.head != h->ud.tail ||
+      (h->ud.flags & UTF8_ADMIT_NUL) != 0)
+  {
+    stdio_spill_part(stream);
+    return generic_get_line(stream);
+  }
+
+  stdio_switch(h, stdio_read);
+
+  errno = 0;
+
+  if ((nbytes = se_getline(&h->lbuf, &h->lsize, h->f)) <= 0) {
+    if (h->npart == 0 || stdio_would_block(h))
+      return stdio_maybe_read_error(stream);
+    nbytes = 0;
+  }
+
+  if (h->npart != 0) {
+    size_t total = h->npart + nbytes;
+    h->lpart = coerce(char *, chk_realloc(coerce(mem_t *, h->lpart), total));
+    memcpy(h->lpart + h->npart, h->lbuf, nbytes);
+    h->npart = 0;
+    src = coerce(const unsigned char *, h->lpart);
+    end = src + total;
+  } else {
+    src = coerce(const unsigned char *, h->lbuf);
+    end = src + nbytes;
+  }
+
+  if ((nl = (end[-1] == '\n'))) {
+    end--;
+  } else if (stdio_would_block(h)) {
+    /* Non-blocking stream ran out of data in the middle of a line.
+     * Hold on to what we have until the rest of the line arrives.
+     */
+    if (src != coerce(const unsigned char *, h->lpart)) {
+      h->lpart = coerce(char *, chk_realloc(coerce(mem_t *, h->lpart),
+                                            nbytes));
+      memcpy(h->lpart, h->lbuf, nbytes);
+    }
+    h->npart = end - src;
+    return stdio_maybe_read_error(stream);
+  }
+
+  out = decode_line(src, end, h->is_byte_oriented);
+
+  if (!nl)
+    stdio_maybe_read_error(stream);
+
+  return out;
+}
+
+#else
+
+#define stdio_get_line generic_get_line
+
+#endif
+
 static val stdio_get_byte(val stream)
 {
   struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
 
+#if HAVE_GETLINE
+  if (h->npart != 0) {
+    unsigned char byte;
+    stdio_take_part(h, &byte, 1);
+    return num_fast(byte);
+  }
+#endif
+
   stdio_switch(h, stdio_read);
 
   if (h->f) {
@@ -927,6 +1173,9 @@ static val stdio_get_byte(val stream)
 static val stdio_unget_char(val stream, val ch)
 {
   struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+#if HAVE_GETLINE
+  stdio_spill_part(stream);
+#endif
   mpush(ch, mkloc(h->unget_c, stream));
   return ch;
 }
@@ -935,6 +1184,16 @@ static val stdio_unget_byte(val stream, int byte)
 {
   struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
 
+#if HAVE_GETLINE
+  if (h->npart != 0) {
+    h->lpart = coerce(char *, chk_realloc(coerce(mem_t *, h->lpart),
+                                          h->npart + 1));
+    memmove(h->lpart + 1, h->lpart, h->npart++);
+    h->lpart[0] = byte;
+    return num_fast(byte);
+  }
+#endif
+
   errno = 0;
   return h->f != 0 && ungetc(byte, coerce(FILE *, h->f)) != EOF
          ? num_fast(byte)
@@ -967,6 +1226,10 @@ static ucnum stdio_fill_buf(val stream, mem_t *ptr, ucnum len, ucnum pos)
     uw_throwf(error_s, lit("~a: buffer too large"), self, nao);
   if (pos >= len)
     return len;
+#if HAVE_GETLINE
+  if (h->npart != 0)
+    return pos + stdio_take_part(h, ptr + pos, len - pos);
+#endif
   errno = 0;
   if (h->f != 0) {
     cnum nread = fread(ptr + pos, 1, len - pos, h->f);
@@ -1101,7 +1364,7 @@ static struct strm_ops stdio_ops =
                 stdio_put_string,
                 stdio_put_char,
                 stdio_put_byte,
-                generic_get_line,
+                stdio_get_line,
                 stdio_get_char,
                 stdio_get_byte,
                 stdio_unget_char,
@@ -1180,11 +1443,156 @@ static void tail_calc(unsigned long *state, int *usec, int *mod)
     *mod = 1;
 }
 
+enum tail_event { tail_none, tail_check };
+
+#if HAVE_INOTIFY
+
+/*
+ * Set up an inotify descriptor for a tail stream, replacing any
+ * previous one. The file is watched for modification, as well as
+ * for being moved, deleted or unlinked, which could mean rotation.
+ * The directory is watched for a file of that name appearing.
+ * If nothing can be watched, the stream falls back on polling.
+ * A watch which is already on the same file as the stream's current
+ * FILE handle is kept, since inotify follows the file, not the name.
+ */
+static void tail_watch(struct stdio_handle *h, val self)
+{
+  char *path;
+  char *slash;
+  const char *dir = ".";
+  int wd_file;
+  struct stat st;
+  int have_st = (h->f != 0 && fstat(fileno(h->f), &st) == 0);
+
+  if (h->ifd >= 0 && have_st &&
+      st.st_dev == h->wdev && st.st_ino == h->wino)
+    return;
+
+  path = utf8_dup_to(c_str(h->descr, self));
+  slash = strrchr(path, '/');
+
+  if (h->ifd >= 0)
+    close(h->ifd);
+
+  h->wdev = if3(have_st, st.st_dev, 0);
+  h->wino = if3(have_st, st.st_ino, 0);
+
+  h->iwd_dir = -1;
+
+  if ((h->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    free(path);
+    return;
+  }
+
+  wd_file = inotify_add_watch(h->ifd, path,
+                              IN_MODIFY | IN_ATTRIB |
+                              IN_MOVE_SELF | IN_DELETE_SELF);
+
+  if (slash == path) {
+    dir = "/";
+  } else if (slash) {
+    *slash = 0;
+    dir = path;
+  }
+
+  h->iwd_dir = inotify_add_watch(h->ifd, dir,
+                                 IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+
+  if (wd_file < 0 && h->iwd_dir < 0) {
+    close(h->ifd);
+    h->ifd = -1;
+  }
+
+  free(path);
+}
+
+/*
+ * Drain the pending inotify events. If the file was moved away or
+ * deleted, or anything else other than a modification happened to it,
+ * or the file's name was (re)created in the directory, a rotation
+ * check is called for. A move or deletion also invalidates the watch.
+ */
+static enum tail_event tail_events(struct stdio_handle *h, val self)
+{
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  char *path = 0;
+  const char *base = 0;
+  enum tail_event check = tail_none;
+  ssize_t nread;
+
+  while ((nread = read(h->ifd, u.buf, sizeof u.buf)) > 0) {
+    char *ptr = u.buf, *end = u.buf + nread;
+
+    while (ptr < end) {
+      struct inotify_event *ev = coerce(struct inotify_event *, ptr);
+
+      if (ev->wd == h->iwd_dir) {
+        if (!base) {
+          const char *slash;
+          path = utf8_dup_to(c_str(h->descr, self));
+          slash = strrchr(path, '/');
+          base = slash ? slash + 1 : path;
+        }
+        if (ev->len && strcmp(ev->name, base) == 0)
+          check = tail_check;
+      } else if ((ev->mask & ~IN_MODIFY) != 0) {
+        check = tail_check;
+        if ((ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0)
+          h->wino = 0;
+      }
+
+      ptr += sizeof *ev + ev->len;
+    }
+  }
+
+  free(path);
+  return check;
+}
+
+#endif
+
+/*
+ * Wait for the tail stream's file to change, or for usec microseconds
+ * to pass, and report whether it may have rotated.
+ */
+static enum tail_event tail_wait(val stream, int usec)
+{
+  val self = lit("open-tail");
+  struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+#if HAVE_INOTIFY
+  if (h->ifd >= 0) {
+    struct pollfd pfd;
+    int res;
+
+    pfd.fd = h->ifd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    sig_save_enable;
+    res = poll(&pfd, 1, usec / 1000);
+    sig_restore_enable;
+
+    return res > 0 ? tail_events(h, self) : tail_none;
+  }
+#endif
+  (void) self;
+  (void) h;
+  sig_save_enable;
+  usleep_wrap(num(usec));
+  sig_restore_enable;
+  return tail_none;
+}
+
 static void tail_strategy(val stream, unsigned long *state)
 {
   val self = lit("open-tail");
   struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
   int usec = 0, mod = 0;
+  enum tail_event check = tail_none;
   val mode = nil;
   struct stdio_mode m, m_r = stdio_mode_init_r;
 
@@ -1192,24 +1600,41 @@ static void tail_strategy(val stream, unsigned long *state)
 
   if (h->is_rotated) {
     /* We already know that the file has rotated. The caller
-     * has read through to the end of the old open file, and
-     * so we can close it now and open a new file.
+     * has read through to the end of the old open file. A process
+     * may still be writing to it, until it reopens the file by name,
+     * so we close it only if it stays quiet for one more wait.
      */
+    struct stat st;
+    long pos;
+
+    (void) tail_wait(stream, usec);
+    clearerr(h->f);
+    h->err = nil;
+
+    if ((pos = ftell(h->f)) != -1 && fstat(fileno(h->f), &st) == 0 &&
+        st.st_size > pos)
+      return;
+
     fclose(h->f);
     h->f = 0;
     h->is_rotated = 0;
   } else if (h->f != 0) {
-    /* We have a file and it hasn't rotated; so sleep on it. */
-    sig_save_enable;
-    usleep_wrap(num(usec));
-    sig_restore_enable;
+    /* We have a file and it hasn't rotated; so wait on it.
+     * The end-of-file indication must be cleared, or else
+     * the stream won't see the data which is appended.
+     */
+    check = tail_wait(stream, usec);
+    clearerr(h->f);
+    h->err = nil;
   }
 
   /* If the state indicates we should poll for a file rotation,
+   * or an event suggests that it may have rotated,
    * or we have no file ...
    */
-  if (h->f == 0 || *state % mod == 0) {
+  if (h->f == 0 || *state % mod == 0 || check) {
     long save_pos = 0, size;
+    struct stat ost, nst;
 
     if (h->f != 0 && (save_pos = ftell(h->f)) == -1)
       return;
@@ -1224,20 +1649,17 @@ static void tail_strategy(val stream, unsigned long *state)
        */
       if (!(newf = w_fopen_mode(c_str(h->descr, self), c_str(mode, self), m))) {
         /* If already have the file open previously, and the name
-         * does not open any more, then the file has rotated.
-         * Have the caller try to read the last bit of data
-         * from the old h->f.
+         * does not open any more, then the file has been moved away
+         * or deleted. Until a new file of that name appears, whatever
+         * is written to the old file is still wanted, so keep reading
+         * it.
          */
-        if (h->f) {
-          h->is_rotated = 1;
+        if (h->f)
           return;
-        }
 
         /* Unable to open; keep trying. */
         tail_calc(state, &usec, &mod);
-        sig_save_enable;
-        usleep_wrap(num(usec));
-        sig_restore_enable;
+        (void) tail_wait(stream, usec);
         continue;
       }
 
@@ -1248,6 +1670,9 @@ static void tail_strategy(val stream, unsigned long *state)
         h->f = newf;
 #if CONFIG_STDIO_STRICT
         h->last_op = stdio_none;
+#endif
+#if HAVE_INOTIFY
+        tail_watch(h, self);
 #endif
         (void) set_mode_props(m, stream);
         break;
@@ -1261,12 +1686,17 @@ static void tail_strategy(val stream, unsigned long *state)
         return;
       }
 
-      /* The newly opened file is smaller than the previously opened
-       * file. The file has rotated and is quite possibly a new object.
-       * We just close newf, and let the caller read the last bit of data from
-       * the old stream before cutting over.
+      /* The newly opened file is a different object, or it is
+       * smaller than the previously opened file. The file has rotated,
+       * or has been truncated. We just close newf, and let the caller
+       * read the last bit of data from the old stream before cutting
+       * over.
        */
-      if (size < save_pos) {
+      if (size < save_pos ||
+          (fstat(fileno(newf), &nst) == 0 &&
+           fstat(fileno(h->f), &ost) == 0 &&
+           (nst.st_dev != ost.st_dev || nst.st_ino != ost.st_ino)))
+      {
         /* TODO: optimize: keep newf in the handle so as not to have to
            re-open it again. */
         h->is_rotated = 1;
@@ -1274,10 +1704,11 @@ static void tail_strategy(val stream, unsigned long *state)
         return;
       }
 
-      /* Newly opened file is not smaller. We take a gamble and say
-       * that it's the same object as h->f, since rotating files
-       * are usually large and it is unlikely that it is a new file
-       * which has grown larger than the original. Just in case,
+      /* Newly opened file is not smaller, and is the same object
+       * as h->f, or couldn't be examined. In the latter case, we take
+       * a gamble and say that it's the same object, since rotating
+       * files are usually large and it is unlikely that it is a new
+       * file which has grown larger than the original. Just in case,
        * though, we take the new file handle. But we do not reset
        * the UTF8 machine.
        */
@@ -1287,6 +1718,9 @@ static void tail_strategy(val stream, unsigned long *state)
       h->f = newf;
 #if CONFIG_STDIO_STRICT
       h->last_op = stdio_none;
+#endif
+#if HAVE_INOTIFY
+      tail_watch(h, self);
 #endif
       (void) set_mode_props(m, stream);
       return;
@@ -1329,6 +1763,22 @@ static val tail_get_byte(val stream)
   return ret;
 }
 
+#if HAVE_INOTIFY
+static val tail_close(val stream, val throw_on_error)
+{
+  struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+
+  if (h->ifd >= 0) {
+    close(h->ifd);
+    h->ifd = h->iwd_dir = -1;
+  }
+
+  return stdio_close(stream, throw_on_error);
+}
+#else
+#define tail_close stdio_close
+#endif
+
 static struct strm_ops tail_ops =
   strm_ops_init(cobj_ops_init(eq,
                               stdio_stream_print,
@@ -1347,7 +1797,7 @@ static struct strm_ops tail_ops =
                 stdio_unget_byte,
                 stdio_put_buf,
                 stdio_fill_buf,
-                stdio_close,
+                tail_close,
                 stdio_flush,
                 stdio_seek,
                 stdio_truncate,
@@ -1422,7 +1872,7 @@ static struct strm_ops pipe_ops =
                 stdio_put_string,
                 stdio_put_char,
                 stdio_put_byte,
-                generic_get_line,
+                stdio_get_line,
                 stdio_get_char,
                 stdio_get_byte,
                 stdio_unget_char,
@@ -1605,12 +2055,20 @@ static struct stdio_mode do_parse_mode(val mode_str, struct stdio_mode m_dfl,
         break;
       }
       break;
+    case 'M':
+      m.mmap = 1;
+      break;
     default:
       m.malformed = 1;
       return m;
     }
   }
 
+  if (m.mmap && (m.write || m.gzip)) {
+    m.malformed = 1;
+    return m;
+  }
+
   if (nredir < STDIO_MODE_NREDIRS)
     m.redir[nredir][0] = -1;
 
@@ -1733,8 +2191,19 @@ static val make_stdio_stream_common(FILE *f, val descr, struct cobj_ops *ops)
   utf8_decoder_init(&h->ud);
   h->err = nil;
   h->buf = 0;
+#if HAVE_GETLINE
+  h->lbuf = 0;
+  h->lsize = 0;
+  h->lpart = 0;
+  h->npart = 0;
+#endif
   h->pid = 0;
   h->mode = nil;
+#if HAVE_INOTIFY
+  h->ifd = h->iwd_dir = -1;
+  h->wdev = 0;
+  h->wino = 0;
+#endif
   h->is_rotated = 0;
 #if HAVE_ISATTY
   h->is_real_time = if3(opt_compat && opt_compat <= 105,
@@ -1755,79 +2224,488 @@ static val make_stdio_stream_common(FILE *f, val descr, struct cobj_ops *ops)
   return stream;
 }
 
-val make_stdio_stream(FILE *f, val descr)
+val make_stdio_stream(FILE *f, val descr)
+{
+  return make_stdio_stream_common(f, descr, &stdio_ops.cobj_ops);
+}
+
+val make_tail_stream(FILE *f, val descr)
+{
+  val stream = make_stdio_stream_common(f, descr, &tail_ops.cobj_ops);
+  stream_set_prop(stream, real_time_k, t);
+  return stream;
+}
+
+#if HAVE_SOCKETS
+val make_sock_stream(FILE *f, val family, val type)
+{
+  val s = make_stdio_stream_common(f, nil, &stdio_sock_ops.cobj_ops);
+  struct stdio_handle *h = coerce(struct stdio_handle *, s->co.handle);
+  h->family = family;
+  h->type = type;
+  return s;
+}
+#endif
+
+val stream_fd(val stream)
+{
+  val self = lit("fileno");
+  struct strm_ops *ops = coerce(struct strm_ops *,
+                                cobj_ops(self, stream, stream_cls));
+  return ops->get_fd(stream);
+}
+
+#if HAVE_IO_READ_PTR
+#ifndef _IO_IN_BACKUP
+#define _IO_IN_BACKUP 0x100
+#endif
+#endif
+
+/* Number of bytes buffered in a stdio stream which can be read without
+ * reading from its file descriptor, or -1 if that can't be determined.
+ * In glibc, bytes pushed back with ungetc may be held in a separate
+ * backup area; while that is being read, the read pointers refer to
+ * the backup area, and the rest of the main buffer is described by the
+ * save pointers.
+ */
+static cnum stdio_buffered_bytes(FILE *f)
+{
+#if HAVE_IO_READ_PTR
+  cnum n = f->_IO_read_end - f->_IO_read_ptr;
+  if ((f->_flags & _IO_IN_BACKUP) != 0)
+    n += f->_IO_save_end - f->_IO_save_base;
+  return n;
+#elif HAVE_FREADAHEAD
+  return __freadahead(f);
+#else
+  (void) f;
+  return -1;
+#endif
+}
+
+/* Determine whether input is available from a stream without
+ * reading from its file descriptor: pushed-back characters, or
+ * data buffered by stdio.
+ */
+int stream_input_pending(val stream)
+{
+  if (cobjclassp(stream, stdio_stream_cls)) {
+    struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+
+    if (h->unget_c || h->ud.head != h->ud.tail)
+      return 1;
+
+#if HAVE_GETLINE
+    if (h->npart != 0)
+      return 1;
+#endif
+
+    if (h->f != 0)
+      return stdio_buffered_bytes(h->f) > 0;
+  }
+
+  return 0;
+}
+
+#if HAVE_SOCKETS
+val sock_family(val stream)
+{
+  val self = lit("sock-family");
+  struct strm_ops *ops = coerce(struct strm_ops *,
+                                cobj_ops(self, stream, stream_cls));
+  return ops->get_sock_family(stream);
+}
+
+val sock_type(val stream)
+{
+  val self = lit("sock-type");
+  struct strm_ops *ops = coerce(struct strm_ops *,
+                                cobj_ops(self, stream, stream_cls));
+  return ops->get_sock_type(stream);
+}
+
+val sock_peer(val stream)
+{
+  val self = lit("sock-peer");
+  struct strm_ops *ops = coerce(struct strm_ops *,
+                                cobj_ops(self, stream, stream_cls));
+  return ops->get_sock_peer(stream);
+}
+
+val sock_set_peer(val stream, val peer)
+{
+  val self = lit("sock-set-peer");
+  struct strm_ops *ops = coerce(struct strm_ops *,
+                                cobj_ops(self, stream, stream_cls));
+  return ops->set_sock_peer(stream, peer);
+}
+#endif
+
+#if HAVE_FORK_STUFF
+static val make_pipevp_stream(FILE *f, val descr, pid_t pid)
+{
+  val stream = make_stdio_stream_common(f, descr, &pipe_ops.cobj_ops);
+  struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
+  h->pid = pid;
+  return stream;
+}
+#endif
+
+#if HAVE_MMAP && HAVE_FCNTL
+
+#define MMAP_UNGET_MAX 16
+
+struct mmap_handle {
+  struct strm_base a;
+  unsigned char *map;
+  size_t size, pos;
+  int fd;
+  val descr;
+  val unget_c;
+  utf8_decoder_t ud;
+  val err;
+  unsigned is_closed : 8;
+  unsigned is_byte_oriented : 8;
+  unsigned unget_n;
+  unsigned char unget_b[MMAP_UNGET_MAX];
+};
+
+static void mmap_stream_print(val stream, val out, val pretty,
+                              struct strm_ctx *ctx)
+{
+  struct strm_ops *ops = coerce(struct strm_ops *, stream->co.ops);
+  val name = static_str(ops->name);
+  val descr = ops->get_prop(stream, name_k);
+
+  (void) pretty;
+  (void) ctx;
+
+  format(out, lit("#<~a ~a ~p>"), name, descr, stream, nao);
+}
+
+static void mmap_stream_destroy(val stream)
+{
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  close_stream(stream, nil);
+  strm_base_cleanup(&h->a);
+  free(h);
+}
+
+static void mmap_stream_mark(val stream)
+{
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  strm_base_mark(&h->a);
+  gc_mark(h->descr);
+  gc_mark(h->unget_c);
+  gc_mark(h->err);
+}
+
+static struct mmap_handle *mmap_check_open(val stream)
+{
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  if (h->is_closed)
+    uw_throwf(file_error_s, lit("error reading ~s: file closed"), stream, nao);
+  return h;
+}
+
+static val mmap_eof(struct mmap_handle *h)
+{
+  h->err = t;
+  return nil;
+}
+
+static int mmap_get_char_callback(mem_t *ctx)
+{
+  struct mmap_handle *h = coerce(struct mmap_handle *, ctx);
+  if (h->unget_n > 0)
+    return h->unget_b[--h->unget_n];
+  return h->pos < h->size ? h->map[h->pos++] : EOF;
+}
+
+static val mmap_get_line(val stream)
+{
+  struct mmap_handle *h = mmap_check_open(stream);
+  const unsigned char *src, *end, *nl;
+
+  if (h->unget_c || h->unget_n > 0 ||
+      h->ud.state != utf8_init || h->ud.head != h->ud.tail)
+  {
+    return generic_get_line(stream);
+  }
+
+  if (h->pos >= h->size)
+    return mmap_eof(h);
+
+  src = h->map + h->pos;
+  end = h->map + h->size;
+
+  if ((nl = coerce(const unsigned char *, memchr(src, '\n', end - src))) != 0) {
+    h->pos = nl - h->map + 1;
+    return decode_line(src, nl, h->is_byte_oriented);
+  }
+
+  h->pos = h->size;
+  h->err = t;
+  return decode_line(src, end, h->is_byte_oriented);
+}
+
+static val mmap_get_char(val stream)
+{
+  struct mmap_handle *h = mmap_check_open(stream);
+  wint_t ch;
+
+  if (h->unget_c)
+    return rcyc_pop(&h->unget_c);
+
+  if (h->is_byte_oriented) {
+    ch = mmap_get_char_callback(coerce(mem_t *, h));
+    if (ch == 0)
+      ch = 0xDC00;
+  } else {
+    ch = utf8_decode(&h->ud, mmap_get_char_callback, coerce(mem_t *, h));
+  }
+
+  return (ch != WEOF) ? chr(ch) : mmap_eof(h);
+}
+
+static val mmap_get_byte(val stream)
+{
+  struct mmap_handle *h = mmap_check_open(stream);
+  int byte = mmap_get_char_callback(coerce(mem_t *, h));
+  return byte != EOF ? num_fast(byte) : mmap_eof(h);
+}
+
+static val mmap_unget_char(val stream, val ch)
+{
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  mpush(ch, mkloc(h->unget_c, stream));
+  return ch;
+}
+
+static val mmap_unget_byte(val stream, int byte)
+{
+  val self = lit("unget-byte");
+  struct mmap_handle *h = mmap_check_open(stream);
+
+  if (h->pos <= h->unget_n)
+    uw_throwf(file_error_s,
+              lit("~a: cannot push back past start of stream ~s"),
+              self, stream, nao);
+
+  /* The mapping is read-only; a byte which differs from the
+   * one in the file is kept on the side.
+   */
+  if (h->unget_n == 0 && h->pos <= h->size && h->map[h->pos - 1] == byte)
+    h->pos--;
+  else if (h->unget_n < MMAP_UNGET_MAX)
+    h->unget_b[h->unget_n++] = byte;
+  else
+    uw_throwf(file_error_s,
+              lit("~a: too many bytes pushed back into stream ~s"),
+              self, stream, nao);
+
+  return num_fast(byte);
+}
+
+static ucnum mmap_fill_buf(val stream, mem_t *ptr, ucnum len, ucnum pos)
+{
+  struct mmap_handle *h = mmap_check_open(stream);
+
+  while (pos < len && h->unget_n > 0)
+    ptr[pos++] = h->unget_b[--h->unget_n];
+
+  if (pos < len && h->pos < h->size) {
+    size_t n = h->size - h->pos;
+    if (n > len - pos)
+      n = len - pos;
+    memcpy(ptr + pos, h->map + h->pos, n);
+    h->pos += n;
+    return pos + n;
+  }
+
+  if (pos < len)
+    mmap_eof(h);
+
+  return pos;
+}
+
+static val mmap_close(val stream, val throw_on_error)
 {
-  return make_stdio_stream_common(f, descr, &stdio_ops.cobj_ops);
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+
+  (void) throw_on_error;
+
+  if (!h->is_closed) {
+    if (h->map)
+      munmap(h->map, h->size);
+    close(h->fd);
+    h->map = 0;
+    h->fd = -1;
+    h->size = h->pos = 0;
+    h->unget_n = 0;
+    h->is_closed = 1;
+    return t;
+  }
+
+  return nil;
 }
 
-val make_tail_stream(FILE *f, val descr)
+static val mmap_seek(val stream, val offset, enum strm_whence whence)
 {
-  val stream = make_stdio_stream_common(f, descr, &tail_ops.cobj_ops);
-  stream_set_prop(stream, real_time_k, t);
-  return stream;
+  val self = lit("seek-stream");
+  struct mmap_handle *h = mmap_check_open(stream);
+  val npos;
+
+  switch (whence) {
+  case strm_start:
+    npos = offset;
+    break;
+  case strm_cur:
+    if (offset == zero)
+      return unum(h->pos - h->unget_n);
+    npos = plus(unum(h->pos - h->unget_n), offset);
+    break;
+  case strm_end:
+    npos = plus(unum(h->size), offset);
+    break;
+  default:
+    internal_error("invalid whence value");
+  }
+
+  if (minusp(npos))
+    uw_throwf(file_error_s, lit("~a: cannot seek to negative position ~s"),
+              self, npos, nao);
+
+  h->pos = c_unum(npos, self);
+  h->unget_n = 0;
+  h->unget_c = nil;
+  h->err = nil;
+  utf8_decoder_init(&h->ud);
+  return t;
 }
 
-#if HAVE_SOCKETS
-val make_sock_stream(FILE *f, val family, val type)
+static val mmap_get_prop(val stream, val ind)
 {
-  val s = make_stdio_stream_common(f, nil, &stdio_sock_ops.cobj_ops);
-  struct stdio_handle *h = coerce(struct stdio_handle *, s->co.handle);
-  h->family = family;
-  h->type = type;
-  return s;
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+
+  if (ind == name_k)
+    return h->descr;
+  else if (ind == byte_oriented_k)
+    return tnil(h->is_byte_oriented);
+
+  return nil;
 }
-#endif
 
-val stream_fd(val stream)
+static val mmap_set_prop(val stream, val ind, val prop)
 {
-  val self = lit("fileno");
-  struct strm_ops *ops = coerce(struct strm_ops *,
-                                cobj_ops(self, stream, stream_cls));
-  return ops->get_fd(stream);
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+
+  if (ind == byte_oriented_k) {
+    h->is_byte_oriented = prop ? 1 : 0;
+    return t;
+  } else if (ind == name_k) {
+    h->descr = prop;
+    return t;
+  }
+
+  return nil;
 }
 
-#if HAVE_SOCKETS
-val sock_family(val stream)
+static val mmap_get_error(val stream)
 {
-  val self = lit("sock-family");
-  struct strm_ops *ops = coerce(struct strm_ops *,
-                                cobj_ops(self, stream, stream_cls));
-  return ops->get_sock_family(stream);
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  return h->err;
 }
 
-val sock_type(val stream)
+static val mmap_get_error_str(val stream)
 {
-  val self = lit("sock-type");
-  struct strm_ops *ops = coerce(struct strm_ops *,
-                                cobj_ops(self, stream, stream_cls));
-  return ops->get_sock_type(stream);
+  return errno_to_string(mmap_get_error(stream));
 }
 
-val sock_peer(val stream)
+static val mmap_clear_error(val stream)
 {
-  val self = lit("sock-peer");
-  struct strm_ops *ops = coerce(struct strm_ops *,
-                                cobj_ops(self, stream, stream_cls));
-  return ops->get_sock_peer(stream);
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  val ret = h->err;
+  h->err = nil;
+  return ret;
 }
 
-val sock_set_peer(val stream, val peer)
+static val mmap_get_fd(val stream)
 {
-  val self = lit("sock-set-peer");
-  struct strm_ops *ops = coerce(struct strm_ops *,
-                                cobj_ops(self, stream, stream_cls));
-  return ops->set_sock_peer(stream, peer);
+  struct mmap_handle *h = coerce(struct mmap_handle *, stream->co.handle);
+  return h->fd != -1 ? num(h->fd) : nil;
 }
-#endif
 
-#if HAVE_FORK_STUFF
-static val make_pipevp_stream(FILE *f, val descr, pid_t pid)
+static struct strm_ops mmap_ops =
+  strm_ops_init(cobj_ops_init(eq,
+                              mmap_stream_print,
+                              mmap_stream_destroy,
+                              mmap_stream_mark,
+                              cobj_eq_hash_op,
+                              0),
+                wli("mmap-stream"),
+                0,
+                0,
+                0,
+                mmap_get_line,
+                mmap_get_char,
+                mmap_get_byte,
+                mmap_unget_char,
+                mmap_unget_byte,
+                0,
+                mmap_fill_buf,
+                mmap_close,
+                0,
+                mmap_seek,
+                0,
+                mmap_get_prop,
+                mmap_set_prop,
+                mmap_get_error,
+                mmap_get_error_str,
+                mmap_clear_error,
+                mmap_get_fd);
+
+/* Map the regular file open on fd into a stream, which takes
+ * ownership of fd. Returns nil if fd isn't a regular file.
+ */
+static val make_mmap_stream(int fd, val descr)
 {
-  val stream = make_stdio_stream_common(f, descr, &pipe_ops.cobj_ops);
-  struct stdio_handle *h = coerce(struct stdio_handle *, stream->co.handle);
-  h->pid = pid;
+  struct stat st;
+  unsigned char *map = 0;
+  size_t size;
+  struct mmap_handle *h;
+  val stream;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    return nil;
+
+  size = st.st_size;
+
+  if (convert(off_t, size) != st.st_size)
+    return nil;
+
+  if (size > 0) {
+    void *addr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      return nil;
+    map = coerce(unsigned char *, addr);
+    madvise(addr, size, MADV_SEQUENTIAL);
+  }
+
+  h = coerce(struct mmap_handle *, chk_calloc(1, sizeof *h));
+  strm_base_init(&h->a);
+  h->map = map;
+  h->size = size;
+  h->fd = fd;
+  h->descr = nil;
+  h->unget_c = nil;
+  h->err = nil;
+  utf8_decoder_init(&h->ud);
+  stream = cobj(coerce(mem_t *, h), stream_cls, &mmap_ops.cobj_ops);
+  h->descr = descr;
   return stream;
 }
+
 #endif
 
 struct dir_handle {
@@ -2575,6 +3453,70 @@ static void cat_stream_print(val stream, val out, val pretty,
   format(out, lit("#<~a ~s>"), name, s->streams, nao);
 }
 
+#define CAT_PREFETCH_SIZE (1024 * 1024)
+
+/* Ask the system to start reading the next stream in the list
+ * from its current position, so that the data is likely to be
+ * in memory by the time the current stream is exhausted.
+ * Streams not yet opened, like those in a lazy list produced by
+ * open-files*, are left alone: forcing them would change when
+ * files are opened and errors are thrown.
+ */
+static int cat_forced(val list)
+{
+  return type(list) != LCONS || list->lc.func == nil;
+}
+
+static void cat_prefetch(val streams)
+{
+  val next, ns;
+  struct strm_ops *ops;
+
+  if (!consp(streams) || !cat_forced(streams))
+    return;
+
+  if (!(next = cdr(streams)) || !cat_forced(next))
+    return;
+
+  ns = car(next);
+
+  if (!streamp(ns))
+    return;
+
+  ops = coerce(struct strm_ops *, ns->co.ops);
+
+#if HAVE_MMAP && HAVE_FCNTL
+  if (ops == &mmap_ops) {
+    struct mmap_handle *h = coerce(struct mmap_handle *, ns->co.handle);
+    if (h->map && h->pos < h->size) {
+      size_t pgsz = sysconf(_SC_PAGESIZE);
+      size_t start = h->pos - h->pos % pgsz;
+      size_t len = h->size - start;
+      madvise(h->map + start, if3(len < CAT_PREFETCH_SIZE,
+                                  len, CAT_PREFETCH_SIZE), MADV_WILLNEED);
+    }
+    return;
+  }
+#endif
+
+#if HAVE_POSIX_FADVISE
+  {
+    val fd = ops->get_fd(ns);
+    if (fd) {
+      /* Data the stream has already buffered is in memory; the
+       * file offset is where its next read will take place.
+       */
+      int fdn = c_num(fd, lit("open-files"));
+      off_t pos = lseek(fdn, 0, SEEK_CUR);
+      if (pos != -1)
+        posix_fadvise(fdn, pos, CAT_PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+    }
+  }
+#else
+  (void) ops;
+#endif
+}
+
 static val cat_get_line(val stream)
 {
   struct cat_strm *s = coerce(struct cat_strm *, stream->co.handle);
@@ -2588,6 +3530,7 @@ static val cat_get_line(val stream)
     if ((streams = rest(streams)) != nil) {
       close_stream(fs, t);
       set(mkloc(s->streams, stream), streams);
+      cat_prefetch(streams);
     }
   }
 
@@ -2607,6 +3550,7 @@ static val cat_get_char(val stream)
     if ((streams = rest(streams)) != nil) {
       close_stream(fs, t);
       set(mkloc(s->streams, stream), streams);
+      cat_prefetch(streams);
     }
   }
 
@@ -2626,6 +3570,7 @@ static val cat_get_byte(val stream)
     if ((streams = rest(streams)) != nil) {
       close_stream(fs, t);
       set(mkloc(s->streams, stream), streams);
+      cat_prefetch(streams);
     }
   }
 
@@ -2728,6 +3673,7 @@ val make_catenated_stream(val stream_list)
   s->streams = nil;
   catstrm = cobj(coerce(mem_t *, s), stream_cls, &cat_stream_ops.cobj_ops);
   s->streams = stream_list;
+  cat_prefetch(stream_list);
   return catstrm;
 }
 
@@ -3171,6 +4117,209 @@ val fill_buf_adjust(val buf, val pos_in, val stream_in)
   return readpos;
 }
 
+static ucnum copy_stream_buffered(val in, struct strm_ops *iops,
+                                  val out, struct strm_ops *oops,
+                                  ucnum limit, ucnum total, val self)
+{
+  const ucnum bufsize = 65536;
+  mem_t *buf = chk_malloc(bufsize);
+
+  uw_simple_catch_begin;
+
+  while (total < limit) {
+    ucnum want = min(limit - total, bufsize);
+    ucnum got = iops->fill_buf(in, buf, want, 0);
+    ucnum pos = 0;
+
+    if (got == 0)
+      break;
+
+    while (pos < got) {
+      ucnum npos = oops->put_buf(out, buf, got, pos);
+      if (npos <= pos)
+        uw_throwf(file_error_s, lit("~a: error writing ~s"), self, out, nao);
+      pos = npos;
+    }
+
+    total += got;
+  }
+
+  uw_unwind {
+    free(buf);
+  }
+
+  uw_catch_end;
+
+  return total;
+}
+
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE || HAVE_SPLICE
+
+/* Number of bytes which fill_buf can return from the stdio stream
+ * without reading from the file descriptor, or -1 if that can't be
+ * determined.
+ */
+static cnum stdio_pending_bytes(struct stdio_handle *h)
+{
+  cnum n = stdio_buffered_bytes(h->f);
+#if HAVE_GETLINE
+  if (n >= 0)
+    n += h->npart;
+#endif
+  return n;
+}
+
+/* Copy from ifd to ofd within the kernel, trying copy_file_range,
+ * sendfile and splice in that order, until the input ends or *ptotal
+ * reaches limit. Returns 1 if the copy is complete, or 0 if none of
+ * the methods is applicable, in which case the caller carries on
+ * with a buffered copy. A method which returns zero before it has
+ * transferred anything is also considered inapplicable, because that
+ * happens on some special files which do have data.
+ */
+static int copy_stream_kernel(int ifd, int ofd, ucnum limit,
+                              ucnum *ptotal, val self)
+{
+  int method = 0;
+  int moved = 0;
+
+  while (*ptotal < limit) {
+    ucnum left = limit - *ptotal;
+    size_t chunk = min(left, 0x40000000);
+    ssize_t n = -1;
+
+    errno = ENOSYS;
+
+    sig_save_enable;
+
+    switch (method) {
+    case 0:
+#if HAVE_COPY_FILE_RANGE
+      n = copy_file_range(ifd, 0, ofd, 0, chunk, 0);
+#endif
+      break;
+    case 1:
+#if HAVE_SENDFILE
+      n = sendfile(ofd, ifd, 0, chunk);
+#endif
+      break;
+    case 2:
+#if HAVE_SPLICE
+      n = splice(ifd, 0, ofd, 0, chunk, SPLICE_F_MOVE);
+#endif
+      break;
+    default:
+      break;
+    }
+
+    sig_restore_enable;
+
+    if (method > 2)
+      return 0;
+
+    if (n > 0) {
+      *ptotal += n;
+      moved = 1;
+      continue;
+    }
+
+    if (n == 0) {
+      if (moved)
+        return 1;
+      method++;
+      continue;
+    }
+
+    switch (errno) {
+    case EINTR:
+      continue;
+#ifdef EAGAIN
+    case EAGAIN:
+      if (*ptotal == 0)
+        uw_ethrowf(timeout_error_s, lit("~a: timed out"), self, nao);
+      return 1;
+#endif
+    case ENOSYS: case EINVAL: case EXDEV: case EBADF: case ESPIPE:
+#ifdef EOPNOTSUPP
+    case EOPNOTSUPP:
+#endif
+      if (moved)
+        return 0;
+      method++;
+      continue;
+    default:
+      {
+        int eno = errno;
+        uw_ethrowf(errno_to_file_error(eno), lit("~a: ~d/~s"),
+                   self, num(eno), errno_to_str(eno), nao);
+      }
+    }
+  }
+
+  return 1;
+}
+
+#endif
+
+val copy_stream(val in, val out, val count)
+{
+  val self = lit("copy-stream");
+  struct strm_ops *iops = coerce(struct strm_ops *,
+                                 cobj_ops(self, in, stream_cls));
+  struct strm_ops *oops = coerce(struct strm_ops *,
+                                 cobj_ops(self, out, stream_cls));
+  ucnum limit = if3(null_or_missing_p(count),
+                    convert(ucnum, -1), c_unum(count, self));
+  ucnum total = 0;
+
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE || HAVE_SPLICE
+  if (cobjclassp(in, stdio_stream_cls) && cobjclassp(out, stdio_stream_cls))
+  {
+    struct stdio_handle *ih = coerce(struct stdio_handle *, in->co.handle);
+    struct stdio_handle *oh = coerce(struct stdio_handle *, out->co.handle);
+    cnum pending = if3(ih->f != 0 && oh->f != 0,
+                       stdio_pending_bytes(ih), -1);
+
+    if (pending >= 0) {
+      if (pending > 0)
+        total = copy_stream_buffered(in, iops, out, oops,
+                                     min(convert(ucnum, pending), limit),
+                                     0, self);
+      if (total < limit) {
+        stdio_switch(ih, stdio_read);
+        flush_stream(out);
+        if (copy_stream_kernel(fileno(ih->f), fileno(oh->f),
+                               limit, &total, self))
+          return unum(total);
+      }
+    }
+  }
+#if HAVE_MMAP && HAVE_FCNTL
+  else if (iops == &mmap_ops && cobjclassp(out, stdio_stream_cls))
+  {
+    struct mmap_handle *ih = coerce(struct mmap_handle *, in->co.handle);
+    struct stdio_handle *oh = coerce(struct stdio_handle *, out->co.handle);
+
+    if (!ih->is_closed && oh->f != 0 && ih->unget_n == 0 && !ih->unget_c &&
+        ih->pos < ih->size && lseek(ih->fd, ih->pos, SEEK_SET) != -1)
+    {
+      ucnum avail = ih->size - ih->pos;
+      int done;
+
+      flush_stream(out);
+      done = copy_stream_kernel(ih->fd, fileno(oh->f),
+                                min(limit, avail), &total, self);
+      ih->pos += total;
+      if (done)
+        return unum(total);
+    }
+  }
+#endif
+#endif
+
+  return unum(copy_stream_buffered(in, iops, out, oops, limit, total, self));
+}
+
 val get_line_as_buf(val stream_in)
 {
   val self = lit("get-line-as-buf");
@@ -3426,7 +4575,23 @@ val formatv(val stream_in, val fmtstr, varg al)
           align = al_right;
           continue;
         default:
-          put_char(chr(ch), stream);
+          {
+            wchar_t run[258], *lrun = wref(run);
+            int n = 0;
+
+            run[0] = 0;
+            lrun[n++] = ch;
+
+            while (*fmt && *fmt != '~' && n < 256)
+              lrun[n++] = *fmt++;
+
+            if (n == 1) {
+              put_char(chr(ch), stream);
+            } else {
+              lrun[n] = 0;
+              put_string(auto_str(coerce(const wchli_t *, lrun)), stream);
+            }
+          }
           continue;
         }
         break;
@@ -4279,6 +5444,29 @@ val open_file(val path, val mode_str)
   struct stdio_mode m, m_r = stdio_mode_init_r;
   val norm_mode = normalize_mode(&m, mode_str, m_r, self);
 
+#if HAVE_MMAP && HAVE_FCNTL
+  if (m.mmap) {
+    int fd = w_open_mode(c_str(path, self), m);
+    val stream;
+    FILE *f;
+
+    if (fd < 0)
+      goto error;
+
+    if ((stream = make_mmap_stream(fd, path)) != nil)
+      return stream;
+
+    if ((f = w_fdopen(fd, c_str(norm_mode, self))) == 0) {
+      int eno = errno;
+      close(fd);
+      errno = eno;
+      goto error;
+    }
+
+    return set_mode_props(m, make_stdio_stream(f, path));
+  }
+#endif
+
 #if HAVE_ZLIB
 again:
 #endif
@@ -4291,8 +5479,9 @@ again:
     return set_mode_props(m, make_stdio_stream(f, path));
   } else {
 #if HAVE_ZLIB
+    int fd;
     gzFile f = w_gzopen_mode(c_str(path, self), c_str(norm_mode, self),
-                             m, self);
+                             m, &fd, self);
 
     if (!f)
       goto error;
@@ -4303,7 +5492,7 @@ again:
       goto again;
     }
 
-    return make_gzio_stream(f, -1, path, m.write);
+    return gzio_set_mode_props(m, make_gzio_stream(f, fd, path, m.write));
 #else
     uw_ethrowf(file_error_s, lit("~a: not built with zlib support"),
                self, nao);
@@ -4326,8 +5515,24 @@ val open_fileno(val fd, val mode_str, val pid_opt)
   val pid = default_arg(pid_opt, nil);
 
   if (!m.gzip) {
-    FILE *f = (errno = 0, w_fdopen(c_num(fd, self),
-                                   c_str(norm_mode, self)));
+    FILE *f;
+
+#if HAVE_FCNTL
+    if (m.nonblock) {
+      int fdn = c_num(fd, self);
+      int flags = fcntl(fdn, F_GETFL);
+
+      if (flags < 0 || fcntl(fdn, F_SETFL, flags | O_NONBLOCK) < 0) {
+        int eno = errno;
+        close(fdn);
+        uw_ethrowf(errno_to_file_error(eno),
+                   lit("error opening descriptor ~a: ~d/~s"),
+                   fd, num(eno), errno_to_str(eno), nao);
+      }
+    }
+#endif
+
+    f = (errno = 0, w_fdopen(c_num(fd, self), c_str(norm_mode, self)));
 
     if (!f)
     {
@@ -4355,8 +5560,10 @@ val open_fileno(val fd, val mode_str, val pid_opt)
 #if HAVE_ZLIB
     cnum fdn = c_num(fd, self);
     gzFile f = w_gzdopen_mode(fdn, c_str(norm_mode, self), m, self);
-    return make_gzio_stream(f, fdn, format(nil, lit("fd ~d"), fd, nao),
-                            m.write);
+    return gzio_set_mode_props(m, make_gzio_stream(f, fdn,
+                                                   format(nil, lit("fd ~d"),
+                                                          fd, nao),
+                                                   m.write));
 #else
     uw_ethrowf(file_error_s, lit("~a: not built with zlib support"),
                self, nao);
@@ -4382,6 +5589,9 @@ val open_tail(val path, val mode_str, val seek_end_p)
   stream = make_tail_stream(f, path);
   h = coerce(struct stdio_handle *, stream->co.handle);
   h->mode = mode_str;
+#if HAVE_INOTIFY
+  tail_watch(h, self);
+#endif
   if (!f)
     tail_strategy(stream, &state);
   return set_mode_props(m, stream);
@@ -5626,6 +6836,7 @@ void stream_init(void)
   reg_fun(fill_buf_s, func_n3o(fill_buf, 1));
   reg_fun(intern(lit("get-line-as-buf"), user_package), func_n1o(get_line_as_buf, 0));
   reg_fun(intern(lit("fill-buf-adjust"), user_package), func_n3o(fill_buf_adjust, 1));
+  reg_fun(intern(lit("copy-stream"), user_package), func_n3o(copy_stream, 2));
   reg_fun(intern(lit("flush-stream"), user_package), func_n1o(flush_stream, 0));
   reg_fun(intern(lit("seek-stream"), user_package), func_n3(seek_stream));
   reg_fun(intern(lit("truncate-stream"), user_package), func_n2o(truncate_stream, 1));
@@ -5722,6 +6933,9 @@ void stream_init(void)
   fill_stream_ops(&strlist_out_ops);
   fill_stream_ops(&dir_ops);
   fill_stream_ops(&cat_stream_ops);
+#if HAVE_MMAP && HAVE_FCNTL
+  fill_stream_ops(&mmap_ops);
+#endif
 
 #if HAVE_SOCKETS
   stdio_sock_ops = stdio_ops;
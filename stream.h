@@ -119,14 +119,15 @@ struct stdio_mode {
   unsigned gzip : 1;
   unsigned gzlevel : 4;
   unsigned tmpfile : 1;
+  unsigned mmap : 1;
   int buforder : 5;
   int redir[STDIO_MODE_NREDIRS][2];
   int streamfd;
 };
 
-#define stdio_mode_init_blank { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, { { 0 } }, -1 }
-#define stdio_mode_init_r     { 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, { { 0 } }, -1 }
-#define stdio_mode_init_rpb   { 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, { { 0 } }, -1 }
+#define stdio_mode_init_blank { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, { { 0 } }, -1 }
+#define stdio_mode_init_r     { 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, { { 0 } }, -1 }
+#define stdio_mode_init_rpb   { 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, { { 0 } }, -1 }
 
 #define std_input (deref(lookup_var_l(nil, stdin_s)))
 #define std_output (deref(lookup_var_l(nil, stdout_s)))
@@ -198,6 +199,7 @@ val make_tail_stream(FILE *, val descr);
 val pipe_close_status_helper(val stream, val throw_on_error,
                              int status, val self);
 val stream_fd(val stream);
+int stream_input_pending(val stream);
 #if HAVE_SOCKETS
 val make_sock_stream(FILE *f, val family, val type);
 val sock_family(val stream);
@@ -230,6 +232,7 @@ val unget_byte(val byte, val stream);
 val put_buf(val buf, val pos, val stream);
 val fill_buf(val buf, val pos, val stream);
 val fill_buf_adjust(val buf, val pos, val stream);
+val copy_stream(val in, val out, val count);
 val get_line_as_buf(val stream);
 val vformat(val stream, val string, va_list);
 val vformat_to_string(val string, va_list);
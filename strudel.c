@@ -60,6 +60,10 @@ static val strudel_put_string(val stream, val str)
   struct strudel_base *sb = coerce(struct strudel_base *, stream->co.handle);
   val obj = sb->obj;
   val meth = slot(obj, put_string_s);
+  /* str may be a literal in temporary storage, such as a run of
+     text from format; don't let it escape into Lisp. */
+  if (is_lit(str))
+    str = copy_str(str);
   return funcall2(meth, obj, str);
 }
 
@@ -65,6 +65,9 @@
 #if HAVE_POLL
 #include <poll.h>
 #endif
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 #if HAVE_PWUID
 #include <pwd.h>
 #endif
@@ -162,6 +165,9 @@ val rlim_s, cur_s, max_s;
 static val rlim_st;
 
 struct cobj_class *dir_cls;
+#if HAVE_EPOLL
+static struct cobj_class *epoll_cls;
+#endif
 
 static val at_exit_list;
 
@@ -1621,6 +1627,310 @@ static val poll_wrap(val poll_list, val timeout_in)
 
 #endif
 
+#if HAVE_EPOLL
+
+struct epoll {
+  int fd;
+  val regs; /* fd -> (obj fun events) */
+  val fds; /* obj -> fd */
+  val last; /* objects reported in previous wait */
+};
+
+static void epoll_destroy(val obj)
+{
+  struct epoll *e = coerce(struct epoll *, obj->co.handle);
+  if (e->fd >= 0)
+    close(e->fd);
+  free(e);
+}
+
+static void epoll_mark(val obj)
+{
+  struct epoll *e = coerce(struct epoll *, obj->co.handle);
+  gc_mark(e->regs);
+  gc_mark(e->fds);
+  gc_mark(e->last);
+}
+
+static struct cobj_ops epoll_ops = cobj_ops_init(eq,
+                                                 cobj_print_op,
+                                                 epoll_destroy,
+                                                 epoll_mark,
+                                                 cobj_eq_hash_op,
+                                                 0);
+
+static val epoll_create_wrap(void)
+{
+  int fd = epoll_create1(EPOLL_CLOEXEC);
+
+  if (fd < 0) {
+    uw_ethrowf(system_error_s, lit("epoll-create failed: ~d/~s"),
+               num(errno), errno_to_str(errno), nao);
+  } else {
+    val regs = make_hash(hash_weak_none, nil);
+    val fds = make_eq_hash(hash_weak_none);
+    struct epoll *e = coerce(struct epoll *, chk_malloc(sizeof *e));
+    e->fd = fd;
+    e->regs = regs;
+    e->fds = fds;
+    e->last = nil;
+    return cobj(coerce(mem_t *, e), epoll_cls, &epoll_ops);
+  }
+}
+
+static struct epoll *epoll_handle(val ep, val self)
+{
+  struct epoll *e = coerce(struct epoll *, cobj_handle(self, ep, epoll_cls));
+  if (e->fd < 0)
+    uw_throwf(file_error_s, lit("~a: ~s is closed"), self, ep, nao);
+  return e;
+}
+
+static int epoll_obj_fd(val obj, val self)
+{
+  if (is_num(obj))
+    return c_int(obj, self);
+
+  if (streamp(obj)) {
+    val fdval = stream_fd(obj);
+    if (!fdval)
+      uw_throwf(file_error_s,
+                lit("~a: stream ~s doesn't have a file descriptor"),
+                self, obj, nao);
+    return c_int(fdval, self);
+  }
+
+  uw_throwf(file_error_s, lit("~a: ~s isn't a stream or file descriptor"),
+            self, obj, nao);
+}
+
+/*
+ * Drop the registration of obj, under file descriptor fdval.
+ */
+static void epoll_forget(struct epoll *e, val obj, val fdval)
+{
+  remhash(e->regs, fdval);
+  remhash(e->fds, obj);
+}
+
+/*
+ * Retrieve the registration under a descriptor reported by the
+ * kernel. If it belongs to a stream which was closed without being
+ * deleted, the kernel can still report the descriptor if it was
+ * duplicated; the stale registration is then dropped.
+ */
+static val epoll_reg(struct epoll *e, val fdval)
+{
+  val reg = gethash(e->regs, fdval);
+
+  if (reg) {
+    val obj = first(reg);
+
+    if (streamp(obj) && stream_fd(obj) != fdval) {
+      epoll_forget(e, obj, fdval);
+      return nil;
+    }
+  }
+
+  return reg;
+}
+
+static val epoll_ctl_common(val ep, int op, val obj, val events,
+                            val fun, val self)
+{
+  struct epoll *e = epoll_handle(ep, self);
+  int fd;
+  struct epoll_event ev;
+
+  /* A stream which has been closed can still be deleted,
+   * using the descriptor under which it was registered;
+   * closing it has already removed it from the kernel's set.
+   */
+  if (op == EPOLL_CTL_DEL && streamp(obj) && !stream_fd(obj)) {
+    val fdval = gethash(e->fds, obj);
+    if (fdval) {
+      val reg = gethash(e->regs, fdval);
+      if (reg && first(reg) == obj)
+        epoll_forget(e, obj, fdval);
+      else
+        remhash(e->fds, obj);
+      return obj;
+    }
+  }
+
+  fd = epoll_obj_fd(obj, self);
+
+  memset(&ev, 0, sizeof ev);
+  ev.events = c_u32(events, self);
+  ev.data.fd = fd;
+
+  if (epoll_ctl(e->fd, op, fd, &ev) < 0)
+    uw_ethrowf(system_error_s, lit("~a: ~s: ~d/~s"),
+               self, obj, num(errno), errno_to_str(errno), nao);
+
+  if (op == EPOLL_CTL_DEL) {
+    val reg = gethash(e->regs, num(fd));
+    if (reg)
+      epoll_forget(e, first(reg), num(fd));
+  } else {
+    val reg = gethash(e->regs, num(fd));
+    if (reg && first(reg) != obj)
+      remhash(e->fds, first(reg));
+    sethash(e->regs, num(fd), list(obj, fun, events, nao));
+    sethash(e->fds, obj, num(fd));
+  }
+
+  return obj;
+}
+
+static val epoll_add(val ep, val obj, val events, val fun)
+{
+  val self = lit("epoll-add");
+  return epoll_ctl_common(ep, EPOLL_CTL_ADD, obj, events,
+                          default_null_arg(fun), self);
+}
+
+static val epoll_mod(val ep, val obj, val events, val fun)
+{
+  val self = lit("epoll-mod");
+
+  if (missingp(fun)) {
+    struct epoll *e = epoll_handle(ep, self);
+    val reg = gethash(e->regs, num(epoll_obj_fd(obj, self)));
+    fun = second(reg);
+  }
+
+  return epoll_ctl_common(ep, EPOLL_CTL_MOD, obj, events, fun, self);
+}
+
+static val epoll_del(val ep, val obj)
+{
+  val self = lit("epoll-del");
+  return epoll_ctl_common(ep, EPOLL_CTL_DEL, obj, zero, nil, self);
+}
+
+static val epoll_wait_wrap(val ep, val timeout_in, val maxevents_in)
+{
+  val self = lit("epoll-wait");
+  struct epoll *e = epoll_handle(ep, self);
+  int timeout = c_int(default_arg(timeout_in, negone), self);
+  int maxevents = c_int(default_arg(maxevents_in, num_fast(64)), self);
+  struct epoll_event *evs;
+  list_collect_decl (out, ptail);
+  val pending = nil;
+  val iter;
+  int i, res;
+
+  if (maxevents <= 0)
+    uw_throwf(error_s, lit("~a: invalid maximum event count ~s"),
+              self, maxevents_in, nao);
+
+  /* Streams which were ready last time may have read ahead into
+   * a buffer; the kernel doesn't know about that data, so it
+   * must be reported here. The kernel reports a descriptor at
+   * most once per wait, so only these entries may have to be
+   * merged with its events; they are indexed in a hash.
+   */
+  for (iter = e->last; iter; iter = cdr(iter)) {
+    val obj = car(iter);
+
+    if (streamp(obj) && stream_input_pending(obj)) {
+      val fdval = stream_fd(obj);
+      val reg = if2(fdval, gethash(e->regs, fdval));
+
+      if (reg && first(reg) == obj &&
+          (c_u32(third(reg), self) & EPOLLIN) != 0)
+      {
+        val cell = cons(obj, num_fast(EPOLLIN));
+        ptail = list_collect(ptail, cell);
+        if (!pending)
+          pending = make_eq_hash(hash_weak_none);
+        sethash(pending, obj, cell);
+      }
+    }
+  }
+
+  if (out)
+    timeout = 0;
+
+  evs = coerce(struct epoll_event *, chk_malloc(maxevents * sizeof *evs));
+
+  sig_save_enable;
+
+  res = epoll_wait(e->fd, evs, maxevents, timeout);
+
+  sig_restore_enable;
+
+  if (res < 0) {
+    int eno = errno;
+    free(evs);
+    uw_ethrowf(system_error_s, lit("~a failed: ~d/~s"),
+               self, num(eno), errno_to_str(eno), nao);
+  }
+
+  for (i = 0; i < res; i++) {
+    val reg = epoll_reg(e, num(evs[i].data.fd));
+
+    if (reg) {
+      val obj = first(reg);
+      val events = num(evs[i].events);
+      val prev = if2(pending, gethash(pending, obj));
+
+      if (prev)
+        rplacd(prev, logior(cdr(prev), events));
+      else
+        ptail = list_collect(ptail, cons(obj, events));
+    }
+  }
+
+  free(evs);
+
+  set(mkloc(e->last, ep), mapcar(car_f, out));
+
+  return out;
+}
+
+static val epoll_dispatch(val ep, val timeout, val maxevents)
+{
+  val self = lit("epoll-dispatch");
+  struct epoll *e = epoll_handle(ep, self);
+  val ready = epoll_wait_wrap(ep, timeout, maxevents);
+  val iter;
+  cnum count = 0;
+
+  for (iter = ready; iter; iter = cdr(iter)) {
+    cons_bind (obj, events, car(iter));
+    val fdval = if3(is_num(obj), obj, stream_fd(obj));
+    val reg = if2(fdval && e->fd >= 0, gethash(e->regs, fdval));
+
+    if (reg && first(reg) == obj && second(reg)) {
+      funcall2(second(reg), obj, events);
+      count++;
+    }
+  }
+
+  return num(count);
+}
+
+static val epoll_close(val ep)
+{
+  val self = lit("epoll-close");
+  struct epoll *e = coerce(struct epoll *, cobj_handle(self, ep, epoll_cls));
+
+  if (e->fd >= 0) {
+    close(e->fd);
+    e->fd = -1;
+    clearhash(e->regs);
+    clearhash(e->fds);
+    e->last = nil;
+    return t;
+  }
+
+  return nil;
+}
+
+#endif
+
 #if HAVE_GETEUID
 
 static val getuid_wrap(void)
@@ -2611,6 +2921,9 @@ void sysif_init(void)
   child_env_s = intern(lit("*child-env*"), user_package);
 
   dir_cls = cobj_register(dir_s);
+#if HAVE_EPOLL
+  epoll_cls = cobj_register(intern(lit("epoll"), user_package));
+#endif
 
   make_struct_type(stat_s, nil, nil,
                    list(dev_s, ino_s, mode_s, nlink_s, uid_s, gid_s,
@@ -2975,6 +3288,16 @@ void sysif_init(void)
   reg_varl(intern(lit("poll-wrband"), user_package), num_fast(POLLWRBAND));
 #endif
 #endif
+#if HAVE_EPOLL
+  reg_varl(intern(lit("epoll-in"), user_package), num_fast(EPOLLIN));
+  reg_varl(intern(lit("epoll-out"), user_package), num_fast(EPOLLOUT));
+  reg_varl(intern(lit("epoll-pri"), user_package), num_fast(EPOLLPRI));
+  reg_varl(intern(lit("epoll-err"), user_package), num_fast(EPOLLERR));
+  reg_varl(intern(lit("epoll-hup"), user_package), num_fast(EPOLLHUP));
+  reg_varl(intern(lit("epoll-rdhup"), user_package), num_fast(EPOLLRDHUP));
+  reg_varl(intern(lit("epoll-oneshot"), user_package), num(EPOLLONESHOT));
+  reg_varl(intern(lit("epoll-et"), user_package), num(EPOLLET));
+#endif
 
 #if HAVE_FORK_STUFF
   reg_fun(intern(lit("fork"), user_package), func_n0(fork_wrap));
@@ -3062,6 +3385,16 @@ void sysif_init(void)
   reg_fun(intern(lit("poll"), user_package), func_n2o(poll_wrap, 1));
 #endif
 
+#if HAVE_EPOLL
+  reg_fun(intern(lit("epoll-create"), user_package), func_n0(epoll_create_wrap));
+  reg_fun(intern(lit("epoll-add"), user_package), func_n4o(epoll_add, 3));
+  reg_fun(intern(lit("epoll-mod"), user_package), func_n4o(epoll_mod, 3));
+  reg_fun(intern(lit("epoll-del"), user_package), func_n2(epoll_del));
+  reg_fun(intern(lit("epoll-wait"), user_package), func_n3o(epoll_wait_wrap, 1));
+  reg_fun(intern(lit("epoll-dispatch"), user_package), func_n3o(epoll_dispatch, 1));
+  reg_fun(intern(lit("epoll-close"), user_package), func_n1(epoll_close));
+#endif
+
 #if HAVE_SYS_STAT
   reg_fun(intern(lit("umask"), user_package), func_n1o(umask_wrap, 0));
 #endif
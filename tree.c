@@ -52,11 +52,19 @@
 #error portme
 #endif
 
+struct tr_size {
+  val node;
+  ucnum size;
+};
+
 struct tree {
   val root;
   ucnum size, max_size;
   val key_fn, less_fn, equal_fn;
   val key_fn_name, less_fn_name, equal_fn_name;
+  struct tr_size *sizes;
+  ucnum sizes_mask, sizes_count;
+  int persistent;
 };
 
 enum tree_iter_state {
@@ -157,6 +165,147 @@ static ucnum tn_size_one_child(val node, val child, ucnum size)
                         if3(node->tn.left, tn_size(node->tn.left), 0));
 }
 
+/*
+ * Once order statistics have been requested from a tree, the size of
+ * every subtree is recorded in the tree's sizes table, keyed on the
+ * address of the subtree's root node; a tnode has no room for a count
+ * of its own. The table is updated along the path of every insertion
+ * and deletion, and for every subtree which is rebuilt, so that
+ * positional access and ranking take logarithmic time.
+ *
+ * The table is private to the tree and invisible to the garbage
+ * collector. A node which leaves the tree leaves a stale entry behind,
+ * which is harmless: every node which joins the tree has its size
+ * stored, even if it reuses the address of a dead node. When the
+ * stale entries come to outnumber the live ones, the table is rebuilt
+ * from the tree by tr_sizes_check, which is called only when the tree
+ * is consistent, at the end of each modifying operation.
+ */
+static ucnum tr_size_hash(val node)
+{
+  ucnum h = coerce(ucnum, node) >> 4;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+  return h;
+}
+
+static ucnum tr_size(struct tree *tr, val node)
+{
+  if (node) {
+    ucnum mask = tr->sizes_mask, i = tr_size_hash(node) & mask;
+    struct tr_size *ent;
+
+    for (; (ent = &tr->sizes[i])->node; i = (i + 1) & mask)
+      if (ent->node == node)
+        return ent->size;
+  }
+
+  return 0;
+}
+
+static void tr_sizes_alloc(struct tree *tr, ucnum nslots)
+{
+  tr->sizes = coerce(struct tr_size *,
+                     chk_calloc(nslots, sizeof *tr->sizes));
+  tr->sizes_mask = nslots - 1;
+  tr->sizes_count = 0;
+}
+
+static void tr_sizes_free(struct tree *tr)
+{
+  free(tr->sizes);
+  tr->sizes = 0;
+  tr->sizes_mask = tr->sizes_count = 0;
+}
+
+static void tr_set_size(struct tree *tr, val node, ucnum size);
+
+static void tr_sizes_grow(struct tree *tr)
+{
+  struct tr_size *old = tr->sizes;
+  ucnum i, nslots = tr->sizes_mask + 1;
+
+  tr_sizes_alloc(tr, 2 * nslots);
+
+  for (i = 0; i < nslots; i++)
+    if (old[i].node)
+      tr_set_size(tr, old[i].node, old[i].size);
+
+  free(old);
+}
+
+static void tr_set_size(struct tree *tr, val node, ucnum size)
+{
+  ucnum mask = tr->sizes_mask, i = tr_size_hash(node) & mask;
+  struct tr_size *ent;
+
+  for (; (ent = &tr->sizes[i])->node; i = (i + 1) & mask) {
+    if (ent->node == node) {
+      ent->size = size;
+      return;
+    }
+  }
+
+  ent->node = node;
+  ent->size = size;
+
+  if (2 * ++tr->sizes_count > mask)
+    tr_sizes_grow(tr);
+}
+
+static void tr_fix_size(struct tree *tr, val node)
+{
+  tr_set_size(tr, node, 1 + tr_size(tr, node->tn.left) +
+                        tr_size(tr, node->tn.right));
+}
+
+static void tr_adjust_size(struct tree *tr, val node, int delta)
+{
+  tr_set_size(tr, node, tr_size(tr, node) + delta);
+}
+
+static ucnum tr_fill_sizes(struct tree *tr, val node)
+{
+  if (node) {
+    ucnum size = 1 + tr_fill_sizes(tr, node->tn.left) +
+                 tr_fill_sizes(tr, node->tn.right);
+    tr_set_size(tr, node, size);
+    return size;
+  }
+
+  return 0;
+}
+
+static void tr_sizes_check(struct tree *tr)
+{
+  if (tr->sizes && tr->sizes_count > 2 * tr->size + 16) {
+    ucnum nslots = 16;
+
+    while (nslots < 4 * tr->size)
+      nslots *= 2;
+
+    tr_sizes_free(tr);
+    tr_sizes_alloc(tr, nslots);
+    tr_fill_sizes(tr, tr->root);
+  }
+}
+
+static val tr_tnode(struct tree *tr, val key, val left, val right)
+{
+  val node = tnode(key, left, right);
+  if (tr->sizes)
+    tr_fix_size(tr, node);
+  return node;
+}
+
+static val tr_shrunk(struct tree *tr, val subtree, val victim)
+{
+  if (victim && tr->sizes)
+    tr_adjust_size(tr, subtree, -1);
+  return victim;
+}
+
 static val tn_lookup(struct tree *tr, val node, val key)
 {
   val tr_key = if3(tr->key_fn,
@@ -326,6 +475,72 @@ static val tn_build_tree(ucnum n, val x)
   }
 }
 
+static val tn_build_balanced(val *nodes, ucnum lo, ucnum hi)
+{
+  if (lo == hi) {
+    return nil;
+  } else {
+    ucnum mid = lo + (hi - lo) / 2;
+    val node = nodes[mid];
+    set(mkloc(node->tn.left, node), tn_build_balanced(nodes, lo, mid));
+    set(mkloc(node->tn.right, node), tn_build_balanced(nodes, mid + 1, hi));
+    return node;
+  }
+}
+
+/*
+ * Load keys into an empty tree for as long as they arrive in order,
+ * and then build a balanced tree from them in linear time. The nodes
+ * end up allocated in key order, so in-order traversals of a
+ * bulk-loaded tree tend to proceed sequentially through memory.
+ *
+ * If a key is encountered which is out of order, it is stored in *pkey
+ * and 1 is returned; the caller inserts that key and the rest in the
+ * regular way.
+ */
+static int tr_load_sorted(val tree, struct tree *tr, seq_iter_t *ki,
+                          val dup, val *pkey)
+{
+  val key, nodes = vector(zero, nil), tail = nil, tail_key = nil;
+  int more = 0;
+
+  while (seq_get(ki, &key)) {
+    val tn_key = if3(tr->key_fn, funcall1(tr->key_fn, key), key);
+
+    if (tail) {
+      if (if3(tr->less_fn,
+              funcall2(tr->less_fn, tn_key, tail_key),
+              less(tn_key, tail_key)))
+      {
+        *pkey = key;
+        more = 1;
+        break;
+      }
+
+      if (!dup && if3(tr->equal_fn == nil,
+                      equal(tn_key, tail_key),
+                      funcall2(tr->equal_fn, tn_key, tail_key)))
+      {
+        set(mkloc(tail->tn.key, tail), key);
+        tail_key = tn_key;
+        continue;
+      }
+    }
+
+    tail = tnode(key, nil, nil);
+    tail_key = tn_key;
+    vec_push(nodes, tail);
+  }
+
+  if (tail) {
+    ucnum size = c_unum(length_vec(nodes), lit("tree"));
+    set(mkloc(tr->root, tree), tn_build_balanced(nodes->v.vec, 0, size));
+    tr->size = tr->max_size = size;
+  }
+
+  return more;
+}
+
 static void tr_rebuild(val tree, struct tree *tr, val node,
                        val parent, ucnum size)
 {
@@ -337,6 +552,9 @@ static void tr_rebuild(val tree, struct tree *tr, val node,
   val flat = tn_flatten(node, &dummy);
   val new_root = (tn_build_tree(size, flat), dummy.tn.left);
 
+  if (tr->sizes)
+    tr_fill_sizes(tr, new_root);
+
   if (parent) {
     if (parent->tn.left == node)
       set(mkloc(parent->tn.left, parent), new_root);
@@ -365,6 +583,18 @@ static void tr_find_rebuild_scapegoat(val tree, struct tree *tr,
   }
 }
 
+static void tr_grow_path(struct tree *tr, struct tree_iter *ti,
+                         val parent, val node)
+{
+  int i;
+
+  tr_set_size(tr, node, 1);
+  tr_adjust_size(tr, parent, 1);
+
+  for (i = 0; i < ti->depth; i++)
+    tr_adjust_size(tr, ti->path[i], 1);
+}
+
 static void tr_insert(val tree, struct tree *tr, struct tree_iter *ti,
                       val subtree, val node, val dup)
 {
@@ -385,6 +615,8 @@ static void tr_insert(val tree, struct tree *tr, struct tree_iter *ti,
     } else {
       int dep = ti->depth + 1;
       set(mkloc(subtree->tn.left, subtree), node);
+      if (tr->sizes)
+        tr_grow_path(tr, ti, subtree, node);
       if (++tr->size > tr->max_size)
         tr->max_size = tr->size;
       if (subtree->tn.right == nil && (convert(ucnum, 1) << dep) > tr->size) {
@@ -399,6 +631,8 @@ static void tr_insert(val tree, struct tree *tr, struct tree_iter *ti,
   {
     set(mkloc(node->tn.left, node), subtree->tn.left);
     set(mkloc(node->tn.right, node), subtree->tn.right);
+    if (tr->sizes)
+      tr_set_size(tr, node, tr_size(tr, subtree));
     if (ti->depth > 0) {
       val parent = ti->path[ti->depth - 1];
 
@@ -416,6 +650,8 @@ static void tr_insert(val tree, struct tree *tr, struct tree_iter *ti,
     } else {
       int dep = ti->depth + 1;
       set(mkloc(subtree->tn.right, subtree), node);
+      if (tr->sizes)
+        tr_grow_path(tr, ti, subtree, node);
       if (++tr->size > tr->max_size)
         tr->max_size = tr->size;
       if (subtree->tn.left == nil && (convert(ucnum, 1) << dep) > tr->size) {
@@ -426,11 +662,224 @@ static void tr_insert(val tree, struct tree *tr, struct tree_iter *ti,
   }
 }
 
+/*
+ * Persistent trees never modify a node once it is part of the tree, so
+ * that any number of trees may share nodes. Updates copy the nodes on
+ * the path from the root to the point of change; a scapegoat rebuild
+ * copies the rebuilt subtree.
+ */
+static val tn_build_copy(struct tree *tr, val *nodes, ucnum lo, ucnum hi)
+{
+  if (lo == hi) {
+    return nil;
+  } else {
+    ucnum mid = lo + (hi - lo) / 2;
+    val le = tn_build_copy(tr, nodes, lo, mid);
+    val ri = tn_build_copy(tr, nodes, mid + 1, hi);
+    return tr_tnode(tr, nodes[mid]->tn.key, le, ri);
+  }
+}
+
+static val tn_copy_balanced(struct tree *tr, val subtree, ucnum size)
+{
+  val nodes = vector(unum(size), nil);
+  val *vec = nodes->v.vec;
+  struct tree_iter trit = tree_iter_init(0);
+  val node = subtree, root;
+  ucnum i = 0;
+
+  while (i < size && (node = tn_find_next(node, &trit)))
+    vec[i++] = node;
+
+  root = tn_build_copy(tr, vec, 0, size);
+  gc_hint(nodes);
+  return root;
+}
+
+static void tr_insert_persistent(val tree, struct tree *tr, val node, val dup)
+{
+  val path[TREE_DEPTH_MAX];
+  int right[TREE_DEPTH_MAX];
+  int depth = 0, i;
+  val subtree = tr->root, child = node, sib = nil;
+  val tn_key = if3(tr->key_fn,
+                   funcall1(tr->key_fn, node->tn.key),
+                   node->tn.key);
+  int replaced = 0;
+
+  while (subtree) {
+    val tr_key = if3(tr->key_fn,
+                     funcall1(tr->key_fn, subtree->tn.key),
+                     subtree->tn.key);
+
+    bug_unless (depth < TREE_DEPTH_MAX);
+
+    if (if3(tr->less_fn,
+            funcall2(tr->less_fn, tn_key, tr_key),
+            less(tn_key, tr_key)))
+    {
+      path[depth] = subtree;
+      right[depth++] = 0;
+      sib = subtree->tn.right;
+      subtree = subtree->tn.left;
+    } else if (if3(tr->equal_fn == nil,
+                   equal(tn_key, tr_key),
+                   funcall2(tr->equal_fn, tn_key, tr_key)) &&
+               !dup)
+    {
+      set(mkloc(node->tn.left, node), subtree->tn.left);
+      set(mkloc(node->tn.right, node), subtree->tn.right);
+      replaced = 1;
+      break;
+    } else {
+      path[depth] = subtree;
+      right[depth++] = 1;
+      sib = subtree->tn.left;
+      subtree = subtree->tn.right;
+    }
+  }
+
+  if (tr->sizes)
+    tr_fix_size(tr, node);
+
+  for (i = depth - 1; i >= 0; i--) {
+    val orig = path[i];
+    child = path[i] = if3(right[i],
+                          tr_tnode(tr, orig->tn.key, orig->tn.left, child),
+                          tr_tnode(tr, orig->tn.key, child, orig->tn.right));
+  }
+
+  set(mkloc(tr->root, tree), child);
+
+  if (replaced)
+    return;
+
+  if (++tr->size > tr->max_size)
+    tr->max_size = tr->size;
+
+  if (depth > 0 && sib == nil && (convert(ucnum, 1) << depth) > tr->size) {
+    ucnum child_size = 1;
+
+    for (child = node, i = depth - 1; i >= 0; child = path[i--]) {
+      val parent = path[i];
+      ucnum parent_size = tn_size_one_child(parent, child, child_size);
+      ucnum sib_size = parent_size - child_size;
+
+      if (2 * child_size > parent_size || 2 * sib_size > parent_size) {
+        val rebuilt = tn_copy_balanced(tr, parent, parent_size);
+
+        if (i == 0)
+          set(mkloc(tr->root, tree), rebuilt);
+        else if (right[i - 1])
+          set(mkloc(path[i - 1]->tn.right, path[i - 1]), rebuilt);
+        else
+          set(mkloc(path[i - 1]->tn.left, path[i - 1]), rebuilt);
+        break;
+      }
+
+      child_size = parent_size;
+    }
+  }
+}
+
+static val tn_copy_without_min(struct tree *tr, val node)
+{
+  if (node->tn.left == nil)
+    return node->tn.right;
+  return tr_tnode(tr, node->tn.key, tn_copy_without_min(tr, node->tn.left),
+                  node->tn.right);
+}
+
+static val tn_copy_without_root(struct tree *tr, val node)
+{
+  val le = node->tn.left;
+  val ri = node->tn.right;
+
+  if (le && ri) {
+    val succ = ri;
+
+    while (succ->tn.left)
+      succ = succ->tn.left;
+
+    return tr_tnode(tr, succ->tn.key, le, tn_copy_without_min(tr, ri));
+  } else {
+    uses_or2;
+    return or2(le, ri);
+  }
+}
+
+static val tn_delete_persistent(struct tree *tr, val subtree,
+                                val key, val thisnode, val *pvictim)
+{
+  if (subtree == nil) {
+    return nil;
+  } else if (subtree == thisnode) {
+    *pvictim = subtree;
+    return tn_copy_without_root(tr, subtree);
+  } else {
+    val tr_key = if3(tr->key_fn,
+                     funcall1(tr->key_fn, subtree->tn.key),
+                     subtree->tn.key);
+    val le = subtree->tn.left;
+    val ri = subtree->tn.right;
+
+    if (if3(tr->less_fn,
+            funcall2(tr->less_fn, key, tr_key),
+            less(key, tr_key)))
+    {
+      val nle = tn_delete_persistent(tr, le, key, thisnode, pvictim);
+      return if3(*pvictim, tr_tnode(tr, subtree->tn.key, nle, ri), subtree);
+    } else if (if3(tr->equal_fn == nil,
+                   equal(key, tr_key),
+                   funcall2(tr->equal_fn, key, tr_key)))
+    {
+      if (!thisnode) {
+        *pvictim = subtree;
+        return tn_copy_without_root(tr, subtree);
+      } else {
+        val nle = tn_delete_persistent(tr, le, key, thisnode, pvictim);
+
+        if (*pvictim) {
+          return tr_tnode(tr, subtree->tn.key, nle, ri);
+        } else {
+          val nri = tn_delete_persistent(tr, ri, key, thisnode, pvictim);
+          return if3(*pvictim, tr_tnode(tr, subtree->tn.key, le, nri),
+                     subtree);
+        }
+      }
+    } else {
+      val nri = tn_delete_persistent(tr, ri, key, thisnode, pvictim);
+      return if3(*pvictim, tr_tnode(tr, subtree->tn.key, le, nri), subtree);
+    }
+  }
+}
+
+static void tr_removed_persistent(val tree, struct tree *tr, val nroot)
+{
+  set(mkloc(tr->root, tree), nroot);
+
+  if (2 * --tr->size < tr->max_size) {
+    set(mkloc(tr->root, tree), tn_copy_balanced(tr, tr->root, tr->size));
+    tr->max_size = tr->size;
+  }
+}
+
 static val tr_lookup(struct tree *tree, val key)
 {
   return if2(tree->root, tn_lookup(tree, tree->root, key));
 }
 
+static void tr_shrink_succ_path(struct tree *tr, struct tree_iter *trit,
+                                val node, val succ)
+{
+  int i;
+
+  for (i = 0; i < trit->depth; i++)
+    tr_adjust_size(tr, trit->path[i], -1);
+
+  tr_set_size(tr, succ, tr_size(tr, node) - 1);
+}
+
 static val tr_do_delete(val tree, struct tree *tr, val subtree,
                         val parent, val key)
 {
@@ -443,7 +892,9 @@ static val tr_do_delete(val tree, struct tree *tr, val subtree,
           less(key, tr_key)))
   {
     if (subtree->tn.left)
-      return tr_do_delete(tree, tr, subtree->tn.left, subtree, key);
+      return tr_shrunk(tr, subtree,
+                       tr_do_delete(tree, tr, subtree->tn.left,
+                                    subtree, key));
     return nil;
   } else if (if3(tr->equal_fn == nil,
                  equal(key, tr_key),
@@ -464,6 +915,9 @@ static val tr_do_delete(val tree, struct tree *tr, val subtree,
       set(mkloc(succ->tn.left, succ), subtree->tn.left);
       set(mkloc(succ->tn.right, succ), subtree->tn.right);
 
+      if (tr->sizes)
+        tr_shrink_succ_path(tr, &trit, subtree, succ);
+
       if (parent) {
         if (parent->tn.left == subtree)
           set(mkloc(parent->tn.left, parent), succ);
@@ -490,7 +944,9 @@ static val tr_do_delete(val tree, struct tree *tr, val subtree,
     return subtree;
   } else {
     if (subtree->tn.right)
-      return tr_do_delete(tree, tr, subtree->tn.right, subtree, key);
+      return tr_shrunk(tr, subtree,
+                       tr_do_delete(tree, tr, subtree->tn.right,
+                                    subtree, key));
     return nil;
   }
 }
@@ -517,6 +973,9 @@ static val tr_do_delete_specific(val tree, struct tree *tr, val subtree,
       set(mkloc(succ->tn.left, succ), subtree->tn.left);
       set(mkloc(succ->tn.right, succ), subtree->tn.right);
 
+      if (tr->sizes)
+        tr_shrink_succ_path(tr, &trit, subtree, succ);
+
       if (parent) {
         if (parent->tn.left == subtree)
           set(mkloc(parent->tn.left, parent), succ);
@@ -553,7 +1012,9 @@ static val tr_do_delete_specific(val tree, struct tree *tr, val subtree,
             less(key, tr_key)))
     {
       val le = subtree->tn.left;
-      return tr_do_delete_specific(tree, tr, le, subtree, key, thisnode);
+      return tr_shrunk(tr, subtree,
+                       tr_do_delete_specific(tree, tr, le, subtree,
+                                             key, thisnode));
     } else if (if3(tr->equal_fn == nil,
                    equal(key, tr_key),
                    funcall2(tr->equal_fn, key, tr_key)))
@@ -561,17 +1022,30 @@ static val tr_do_delete_specific(val tree, struct tree *tr, val subtree,
       uses_or2;
       val le = subtree->tn.left;
       val ri = subtree->tn.right;
-      return or2(tr_do_delete_specific(tree, tr, le, subtree, key, thisnode),
-                 tr_do_delete_specific(tree, tr, ri, subtree, key, thisnode));
+      return tr_shrunk(tr, subtree,
+                       or2(tr_do_delete_specific(tree, tr, le, subtree,
+                                                 key, thisnode),
+                           tr_do_delete_specific(tree, tr, ri, subtree,
+                                                 key, thisnode)));
     } else {
       val ri = subtree->tn.right;
-      return tr_do_delete_specific(tree, tr, ri, subtree, key, thisnode);
+      return tr_shrunk(tr, subtree,
+                       tr_do_delete_specific(tree, tr, ri, subtree,
+                                             key, thisnode));
     }
   }
 }
 
 static val tr_delete(val tree, struct tree *tr, val key)
 {
+  if (tr->persistent) {
+    val victim = nil;
+    val nroot = tn_delete_persistent(tr, tr->root, key, nil, &victim);
+    if (victim)
+      tr_removed_persistent(tree, tr, nroot);
+    return victim;
+  }
+
   if (tr->root) {
     val node = tr_do_delete(tree, tr, tr->root, nil, key);
     if (node) {
@@ -588,6 +1062,16 @@ static val tr_delete(val tree, struct tree *tr, val key)
 
 static val tr_delete_specific(val tree, struct tree *tr, val thisnode)
 {
+  if (tr->persistent) {
+    val nkey = key(thisnode);
+    val key = if3(tr->key_fn, funcall1(tr->key_fn, nkey), nkey);
+    val victim = nil;
+    val nroot = tn_delete_persistent(tr, tr->root, key, thisnode, &victim);
+    if (victim)
+      tr_removed_persistent(tree, tr, nroot);
+    return victim;
+  }
+
   if (tr->root) {
     val nkey = key(thisnode);
     val key = if3(tr->key_fn, funcall1(tr->key_fn, nkey), nkey);
@@ -605,32 +1089,51 @@ static val tr_delete_specific(val tree, struct tree *tr, val thisnode)
   return nil;
 }
 
-val tree_insert_node(val tree, val node, val dup_in)
+static val tr_insert_node(val tree, struct tree *tr, val node, val dup)
 {
-  val self = lit("tree-insert-node");
-  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
-  val dup = default_null_arg(dup_in);
-
-  type_check(self, node, TNOD);
-
   node->tn.left = nil;
   node->tn.right = nil;
 
-  if (tr->root == nil) {
+  if (tr->persistent) {
+    tr_insert_persistent(tree, tr, node, dup);
+  } else if (tr->root == nil) {
     tr->size = 1;
     tr->max_size = 1;
     set(mkloc(tr->root, tree), node);
+    if (tr->sizes)
+      tr_set_size(tr, node, 1);
   } else {
     struct tree_iter ti = tree_iter_init(0);
     tr_insert(tree, tr, &ti, tr->root, node, dup);
   }
 
+  tr_sizes_check(tr);
   return node;
 }
 
+val tree_insert_node(val tree, val node, val dup_in)
+{
+  val self = lit("tree-insert-node");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  val dup = default_null_arg(dup_in);
+
+  type_check(self, node, TNOD);
+
+  /* The node may be shared with other versions of a persistent
+   * tree, so it is not linked in; a copy is inserted instead.
+   */
+  if (tr->persistent)
+    node = tnode(node->tn.key, nil, nil);
+
+  return tr_insert_node(tree, tr, node, dup);
+}
+
 val tree_insert(val tree, val key, val dup_in)
 {
-  return tree_insert_node(tree, tnode(key, nil, nil), default_null_arg(dup_in));
+  val self = lit("tree-insert");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  return tr_insert_node(tree, tr, tnode(key, nil, nil),
+                        default_null_arg(dup_in));
 }
 
 val tree_lookup_node(val tree, val key)
@@ -672,7 +1175,9 @@ val tree_delete_node(val tree, val key)
 {
   val self = lit("tree-delete-node");
   struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
-  return tr_delete(tree, tr, key);
+  val node = tr_delete(tree, tr, key);
+  tr_sizes_check(tr);
+  return node;
 }
 
 val tree_delete(val tree, val key)
@@ -685,7 +1190,9 @@ val tree_delete_specific_node(val tree, val node)
 {
   val self = lit("tree-delete-node");
   struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
-  return tr_delete_specific(tree, tr, node);
+  val victim = tr_delete_specific(tree, tr, node);
+  tr_sizes_check(tr);
+  return victim;
 }
 
 val tree_del_min_node(val tree)
@@ -694,6 +1201,16 @@ val tree_del_min_node(val tree)
   struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
   val node = tr->root, parent = nil;;
 
+  if (tr->persistent) {
+    if (node == nil)
+      return nil;
+    while (node->tn.left)
+      node = node->tn.left;
+    tr_removed_persistent(tree, tr, tn_copy_without_min(tr, tr->root));
+    tr_sizes_check(tr);
+    return node;
+  }
+
   while (node != nil) {
     val le = node->tn.left;
 
@@ -710,8 +1227,11 @@ val tree_del_min_node(val tree)
         tr->max_size = tr->size;
       }
 
+      tr_sizes_check(tr);
       return node;
     }
+    if (tr->sizes)
+      tr_adjust_size(tr, node, -1);
     parent = node;
     node = le;
   }
@@ -822,6 +1342,13 @@ static void tree_mark(val tree)
   gc_mark(ltr->equal_fn_name);
 }
 
+static void tree_destroy(val tree)
+{
+  struct tree *tr = coerce(struct tree *, tree->co.handle);
+  tr_sizes_free(tr);
+  free(tr);
+}
+
 static ucnum tree_hash_op(val obj, int *count, ucnum seed)
 {
   struct tree *tr = coerce(struct tree *, obj->co.handle);
@@ -847,7 +1374,7 @@ static ucnum tree_hash_op(val obj, int *count, ucnum seed)
 
 static struct cobj_ops tree_ops = cobj_ops_init(tree_equal_op,
                                                 tree_print_op,
-                                                cobj_destroy_free_op,
+                                                tree_destroy,
                                                 tree_mark,
                                                 tree_hash_op,
                                                 copy_search_tree);
@@ -874,8 +1401,11 @@ val tree(val keys_in, val key_fn, val less_fn, val equal_fn, val dup_in)
 
   seq_iter_init(tree_s, &ki, keys);
 
-  while (seq_get(&ki, &key))
-    tree_insert(tree, key, dup);
+  if (tr_load_sorted(tree, tr, &ki, dup, &key)) {
+    do
+      tree_insert(tree, key, dup);
+    while (seq_get(&ki, &key));
+  }
 
   return tree;
 }
@@ -918,10 +1448,12 @@ val copy_search_tree(val tree)
   val self = lit("copy-search-tree");
   struct tree *ntr = coerce(struct tree *, malloc(sizeof *ntr));
   struct tree *otr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
-  val nroot = deep_copy_tnode(otr->root);
+  val nroot = if3(otr->persistent, otr->root, deep_copy_tnode(otr->root));
   val ntree = cobj(coerce(mem_t *, ntr), tree_cls, &tree_ops);
   *ntr = *otr;
   ntr->root = nroot;
+  ntr->sizes = 0;
+  ntr->sizes_mask = ntr->sizes_count = 0;
   gc_hint(tree);
   return ntree;
 }
@@ -934,6 +1466,8 @@ val make_similar_tree(val tree)
   val ntree = cobj(coerce(mem_t *, ntr), tree_cls, &tree_ops);
   *ntr = *otr;
   ntr->root = nil;
+  ntr->sizes = 0;
+  ntr->sizes_mask = ntr->sizes_count = 0;
   ntr->size = ntr->max_size = 0;
   gc_hint(tree);
   return ntree;
@@ -944,6 +1478,21 @@ val treep(val obj)
   return tnil(type(obj) == COBJ && obj->co.cls == tree_cls);
 }
 
+val persist_tree(val tree)
+{
+  val self = lit("persist-tree");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  tr->persistent = 1;
+  return tree;
+}
+
+val tree_persistent_p(val tree)
+{
+  val self = lit("tree-persistent-p");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  return tnil(tr->persistent);
+}
+
 val tree_count(val tree)
 {
   val self = lit("tree-count");
@@ -1137,6 +1686,7 @@ val tree_clear(val tree)
   struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
   cnum oldsize = tr->size;
   tr->root = nil;
+  tr_sizes_free(tr);
   tr->size = tr->max_size = 0;
   return oldsize ? num(oldsize) : nil;
 }
@@ -1153,6 +1703,94 @@ val sub_tree(val tree, val from, val to)
   return out;
 }
 
+static void tr_sizes(struct tree *tr)
+{
+  if (!tr->sizes) {
+    tr_sizes_alloc(tr, 16);
+    tr_fill_sizes(tr, tr->root);
+  }
+}
+
+static ucnum tr_rank(struct tree *tr, val key)
+{
+  val node = tr->root;
+  ucnum rank = 0;
+
+  tr_sizes(tr);
+
+  while (node) {
+    val tr_key = if3(tr->key_fn,
+                     funcall1(tr->key_fn, node->tn.key),
+                     node->tn.key);
+
+    if (if3(tr->less_fn,
+            funcall2(tr->less_fn, tr_key, key),
+            less(tr_key, key)))
+    {
+      rank += tr_size(tr, node->tn.left) + 1;
+      node = node->tn.right;
+    } else {
+      node = node->tn.left;
+    }
+  }
+
+  return rank;
+}
+
+val tree_nth_node(val tree, val index)
+{
+  val self = lit("tree-nth-node");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  cnum ix = c_num(index, self);
+  val node = tr->root;
+  ucnum i;
+
+  if (ix < 0)
+    ix += tr->size;
+
+  if (ix < 0 || convert(ucnum, ix) >= tr->size)
+    return nil;
+
+  tr_sizes(tr);
+
+  for (i = ix; node; ) {
+    ucnum lsize = tr_size(tr, node->tn.left);
+
+    if (i < lsize) {
+      node = node->tn.left;
+    } else if (i == lsize) {
+      break;
+    } else {
+      i -= lsize + 1;
+      node = node->tn.right;
+    }
+  }
+
+  return node;
+}
+
+val tree_nth(val tree, val index)
+{
+  val node = tree_nth_node(tree, index);
+  return if2(node, node->tn.key);
+}
+
+val tree_rank(val tree, val key)
+{
+  val self = lit("tree-rank");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  return unum(tr_rank(tr, key));
+}
+
+val tree_count_range(val tree, val from, val to)
+{
+  val self = lit("tree-count-range");
+  struct tree *tr = coerce(struct tree *, cobj_handle(self, tree, tree_cls));
+  ucnum lo = if3(missingp(from), 0, tr_rank(tr, from));
+  ucnum hi = if3(missingp(to), tr->size, tr_rank(tr, to));
+  return unum(if3(hi > lo, hi - lo, 0));
+}
+
 void tree_init(void)
 {
   tree_s = intern(lit("tree"), user_package);
@@ -1176,6 +1814,8 @@ void tree_init(void)
   reg_fun(intern(lit("copy-search-tree"), user_package), func_n1(copy_search_tree));
   reg_fun(intern(lit("make-similar-tree"), user_package), func_n1(make_similar_tree));
   reg_fun(intern(lit("treep"), user_package), func_n1(treep));
+  reg_fun(intern(lit("persist-tree"), user_package), func_n1(persist_tree));
+  reg_fun(intern(lit("tree-persistent-p"), user_package), func_n1(tree_persistent_p));
   reg_fun(intern(lit("tree-count"), user_package), func_n1(tree_count));
   reg_fun(intern(lit("tree-insert-node"), user_package), func_n3o(tree_insert_node, 2));
   reg_fun(intern(lit("tree-insert"), user_package), func_n3o(tree_insert, 2));
@@ -1197,5 +1837,9 @@ void tree_init(void)
   reg_fun(intern(lit("tree-peek"), user_package), func_n1(tree_peek));
   reg_fun(intern(lit("tree-clear"), user_package), func_n1(tree_clear));
   reg_fun(intern(lit("sub-tree"), user_package), func_n3o(sub_tree, 1));
+  reg_fun(intern(lit("tree-nth-node"), user_package), func_n2(tree_nth_node));
+  reg_fun(intern(lit("tree-nth"), user_package), func_n2(tree_nth));
+  reg_fun(intern(lit("tree-rank"), user_package), func_n2(tree_rank));
+  reg_fun(intern(lit("tree-count-range"), user_package), func_n3o(tree_count_range, 1));
   reg_var(tree_fun_whitelist_s, list(identity_s, equal_s, less_s, nao));
 }
@@ -44,6 +44,8 @@ val tree(val keys, val key_fn, val less_fn, val equal_fn, val dup);
 val copy_search_tree(val tree);
 val make_similar_tree(val tree);
 val treep(val obj);
+val persist_tree(val tree);
+val tree_persistent_p(val tree);
 val tree_count(val tree);
 val tree_insert_node(val tree, val node, val dup);
 val tree_insert(val tree, val key, val dup);
@@ -64,4 +66,8 @@ val tree_next(val iter);
 val tree_peek(val iter);
 val tree_clear(val tree);
 val sub_tree(val tree, val from, val to);
+val tree_nth_node(val tree, val index);
+val tree_nth(val tree, val index);
+val tree_rank(val tree, val key);
+val tree_count_range(val tree, val from, val to);
 void tree_init(void);
@@ -275,6 +275,45 @@ int utf8_encode(wchar_t wch, int (*put)(int ch, mem_t *ctx), mem_t *ctx)
             num(wch), nao);
 }
 
+/* Like utf8_encode, but into a buffer: stops when fewer than four
+ * bytes of space remain, or at the null terminator or a character that
+ * cannot be encoded. *psrc is advanced past what was encoded.
+ */
+size_t utf8_encode_buf(unsigned char *dst, size_t size, const wchar_t **psrc)
+{
+  const wchar_t *src = *psrc;
+  unsigned char *ptr = dst, *lim = dst + size - 4;
+  wchar_t wch;
+
+  while (ptr <= lim && (wch = *src) != 0) {
+    if (wch < 0x80) {
+      *ptr++ = wch;
+    } else if (wch < 0x800) {
+      *ptr++ = 0xC0 | (wch >> 6);
+      *ptr++ = 0x80 | (wch & 0x3F);
+    } else if (wch < 0x10000) {
+      if ((wch & 0xFF00) == 0xDC00) {
+        *ptr++ = wch & 0xFF;
+      } else {
+        *ptr++ = 0xE0 | (wch >> 12);
+        *ptr++ = 0x80 | ((wch >> 6) & 0x3F);
+        *ptr++ = 0x80 | (wch & 0x3F);
+      }
+    } else if (wch < 0x110000) {
+      *ptr++ = 0xF0 | (wch >> 18);
+      *ptr++ = 0x80 | ((wch >> 12) & 0x3F);
+      *ptr++ = 0x80 | ((wch >> 6) & 0x3F);
+      *ptr++ = 0x80 | (wch & 0x3F);
+    } else {
+      break;
+    }
+    src++;
+  }
+
+  *psrc = src;
+  return ptr - dst;
+}
+
 void utf8_decoder_init(utf8_decoder_t *ud)
 {
   ud->state = utf8_init;
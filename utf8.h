@@ -48,6 +48,7 @@ typedef struct utf8_decoder {
 } utf8_decoder_t;
 
 int utf8_encode(wchar_t, int (*put)(int ch, mem_t *ctx), mem_t *ctx);
+size_t utf8_encode_buf(unsigned char *dst, size_t size, const wchar_t **psrc);
 void utf8_decoder_init(utf8_decoder_t *);
 wint_t utf8_decode(utf8_decoder_t *,int (*get)(mem_t *ctx), mem_t *ctx);
 